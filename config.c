@@ -44,6 +44,7 @@
 
 static int		 config_parse_refusefiles(struct coll *);
 static int		 config_parse_refusefile(struct coll *, char *);
+static char		*coll_collfile(struct coll *, const char *);
 
 extern FILE *yyin;
 
@@ -131,7 +132,9 @@ config_init(const char *file, struct coll *override, int overridemask)
 			coll->co_options &= ~CO_CHECKRCS;
 		/* In recent versions, we always try to set the file modes. */
 		coll->co_options |= CO_SETMODE;
-		coll->co_options |= CO_NORSYNC;
+		/* We only use rsync for the files that are updated in place. */
+		if (pattlist_size(coll->co_inplace) == 0)
+			coll->co_options |= CO_NORSYNC;
 		error = config_parse_refusefiles(coll);
 		if (error)
 			goto bad;
@@ -281,12 +284,15 @@ struct coll *
 coll_new(struct coll *def)
 {
 	struct coll *new;
+	size_t i;
 
 	new = xmalloc(sizeof(struct coll));
 	memset(new, 0, sizeof(struct coll));
 	if (def != NULL) {
 		new->co_options = def->co_options;
 		new->co_umask = def->co_umask;
+		new->co_zlevel = def->co_zlevel;
+		new->co_durability = def->co_durability;
 		if (def->co_host != NULL)
 			new->co_host = xstrdup(def->co_host);
 		if (def->co_base != NULL)
@@ -304,10 +310,18 @@ coll_new(struct coll *def)
 	} else {
 		new->co_tag = xstrdup(".");
 		new->co_date = xstrdup(".");
+		new->co_zlevel = STREAM_ZLEVEL_DEFAULT;
 	}
+	new->co_hashcache = NULL;
 	new->co_keyword = keyword_new();
 	new->co_accepts = pattlist_new();
 	new->co_refusals = pattlist_new();
+	new->co_inplace = pattlist_new();
+	if (def != NULL) {
+		for (i = 0; i < pattlist_size(def->co_inplace); i++)
+			pattlist_add(new->co_inplace,
+			    pattlist_get(def->co_inplace, i));
+	}
 	new->co_attrignore = FA_DEV | FA_INODE;
 	return (new);
 }
@@ -368,6 +382,10 @@ coll_override(struct coll *coll, struct coll *from, int mask)
 		pattlist_add(coll->co_refusals,
 		    pattlist_get(from->co_refusals, i));
 	}
+	for (i = 0; i < pattlist_size(from->co_inplace); i++) {
+		pattlist_add(coll->co_inplace,
+		    pattlist_get(from->co_inplace, i));
+	}
 	coll->co_options = oldoptions | newoptions;
 }
 
@@ -401,25 +419,53 @@ coll_statussuffix(struct coll *coll)
 
 char *
 coll_statuspath(struct coll *coll)
+{
+
+	return (coll_collfile(coll, "checkouts"));
+}
+
+/* Pathname of the checksum cache, see hashcache.c. */
+char *
+coll_hashcachepath(struct coll *coll)
+{
+
+	return (coll_collfile(coll, "hashes"));
+}
+
+/*
+ * Returns true if the file should be updated in place by the rsync
+ * algorithm, rather than rebuilt in a temporary file.  The patterns
+ * are matched against the whole pathname, '*' matching slashes too.
+ */
+int
+coll_inplace(struct coll *coll, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < pattlist_size(coll->co_inplace); i++) {
+		if (fnmatch(pattlist_get(coll->co_inplace, i), name, 0) == 0)
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ * Pathname of a file in the collection directory, with the same suffix
+ * as the list file.
+ */
+static char *
+coll_collfile(struct coll *coll, const char *name)
 {
 	char *path, *suffix;
 
 	suffix = coll_statussuffix(coll);
-	if (suffix != NULL) {
-		if (coll->co_colldir[0] == '/')
-			xasprintf(&path, "%s/%s/checkouts%s", coll->co_colldir,
-			    coll->co_name, suffix);
-		else
-			xasprintf(&path, "%s/%s/%s/checkouts%s", coll->co_base,
-			    coll->co_colldir, coll->co_name, suffix);
-	} else {
-		if (coll->co_colldir[0] == '/')
-			xasprintf(&path, "%s/%s/checkouts", coll->co_colldir,
-			    coll->co_name);
-		else
-			xasprintf(&path, "%s/%s/%s/checkouts", coll->co_base,
-			    coll->co_colldir, coll->co_name);
-	}
+	if (coll->co_colldir[0] == '/')
+		xasprintf(&path, "%s/%s/%s%s", coll->co_colldir,
+		    coll->co_name, name, suffix != NULL ? suffix : "");
+	else
+		xasprintf(&path, "%s/%s/%s/%s%s", coll->co_base,
+		    coll->co_colldir, coll->co_name, name,
+		    suffix != NULL ? suffix : "");
 	free(suffix);
 	return (path);
 }
@@ -488,6 +534,8 @@ coll_free(struct coll *coll)
 		pattlist_free(coll->co_accepts);
 	if (coll->co_refusals != NULL)
 		pattlist_free(coll->co_refusals);
+	if (coll->co_inplace != NULL)
+		pattlist_free(coll->co_inplace);
 	free(coll);
 }
 
@@ -495,7 +543,7 @@ void
 coll_setopt(int opt, char *value)
 {
 	struct coll *coll;
-	int error, mask;
+	int error, level, mask;
 
 	coll = cur_coll;
 	switch (opt) {
@@ -559,10 +607,42 @@ coll_setopt(int opt, char *value)
 		break;
 	case PT_COMPRESS:
 		coll->co_options |= CO_COMPRESS;
+		if (value == NULL)
+			break;
+		if (strcmp(value, "auto") == 0) {
+			coll->co_zlevel = STREAM_ZLEVEL_AUTO;
+		} else {
+			error = asciitoint(value, &level, 10);
+			if (error || level < 0 || level > 9) {
+				lprintf(-1, "Parse error in \"%s\": Invalid "
+				    "compression level\n", cfgfile);
+				exit(1);
+			}
+			coll->co_zlevel = level;
+		}
+		free(value);
 		break;
 	case PT_NORSYNC:
 		coll->co_options |= CO_NORSYNC;
 		break;
+	case PT_DURABILITY:
+		if (strcmp(value, "none") == 0) {
+			coll->co_durability = DURABILITY_NONE;
+		} else if (strcmp(value, "batch") == 0) {
+			coll->co_durability = DURABILITY_BATCH;
+		} else {
+			lprintf(-1, "Parse error in \"%s\": Invalid "
+			    "durability mode\n", cfgfile);
+			exit(1);
+		}
+		free(value);
+		break;
+	case PT_INPLACE:
+		if (value == NULL)
+			value = xstrdup("*");
+		pattlist_add(coll->co_inplace, value);
+		free(value);
+		break;
 	}
 }
 
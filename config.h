@@ -69,6 +69,10 @@
 /* Options that the server is allowed to clear. */
 #define	CO_SERVMAYCLEAR		CO_CHECKRCS
 
+/* How hard we try to have the updates survive a crash. */
+#define	DURABILITY_NONE		0
+#define	DURABILITY_BATCH	1	/* Sync files in groups. */
+
 struct coll {
 	char *co_name;
 	char *co_host;
@@ -82,6 +86,7 @@ struct coll {
 	int co_attrignore;
 	struct pattlist *co_accepts;
 	struct pattlist *co_refusals;
+	struct pattlist *co_inplace;	/* Files to rsync in place. */
 	struct globtree *co_dirfilter;
 	struct globtree *co_filefilter;
 	struct globtree *co_norsync;
@@ -90,6 +95,9 @@ struct coll {
 	time_t co_scantime;		/* Set by the detailer thread. */
 	int co_options;
 	mode_t co_umask;
+	int co_zlevel;
+	int co_durability;
+	struct hashcache *co_hashcache;	/* Checksum cache, may be NULL. */
 	struct keyword *co_keyword;
 	STAILQ_ENTRY(coll) co_next;
 };
@@ -101,6 +109,9 @@ struct config {
 	struct sockaddr *laddr;
 	socklen_t laddrlen;
 	int deletelim;
+	size_t winsize;
+	int muxbackend;
+	int zthreaded;
 	int socket;
 	struct chan *chan0;
 	struct chan *chan1;
@@ -116,6 +127,8 @@ void		 config_free(struct config *);
 struct coll	*coll_new(struct coll *);
 void		 coll_override(struct coll *, struct coll *, int);
 char		*coll_statuspath(struct coll *);
+char		*coll_hashcachepath(struct coll *);
+int		 coll_inplace(struct coll *, const char *);
 char		*coll_statussuffix(struct coll *);
 void		 coll_add(char *);
 void		 coll_free(struct coll *);
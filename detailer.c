@@ -24,7 +24,9 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/param.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
@@ -34,9 +36,12 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "dircache.h"
 #include "detailer.h"
 #include "fixups.h"
 #include "globtree.h"
+#include "hashcache.h"
+#include "hasher.h"
 #include "misc.h"
 #include "mux.h"
 #include "proto.h"
@@ -51,11 +56,22 @@
 #define	DETAILER_ERR_READ	(-3)	/* Error reading from server. */
 #define	DETAILER_ERR_WRITE	(-4)	/* Error writing to server. */
 
+/* Maximum number of checksums computed ahead of time. */
+#define	DETAILER_MAXJOBS	32
+
 struct detailer {
 	struct config *config;
 	struct stream *rd;
 	struct stream *wr;
+	struct dircache *dircache;	/* For the current collection. */
 	char *errmsg;
+
+	/* Checksums of files the server is going to ask about. */
+	struct hasher *hasher;
+	struct hashjob *jobs[DETAILER_MAXJOBS];
+	int jobhead;
+	int njobs;
+	size_t scanned;			/* Input already looked at. */
 };
 
 static int	detailer_batch(struct detailer *);
@@ -68,8 +84,18 @@ static int	detailer_send_co(struct detailer *, struct coll *,
 static int	detailer_send_rcs(struct detailer *, struct coll *, char *);
 static int	detailer_send_regular(struct detailer *, struct coll *, char *);
 static int	detailer_send_rsync(struct detailer *, struct coll *, char *);
+static int	detailer_send_blocks(struct detailer *, char *, off_t, size_t,
+		    char *);
 static int	detailer_checkrcsattr(struct detailer *, struct coll *, char *,
 		    struct fattr *, int);
+static int	detailer_wantrsync(struct coll *, char *);
+static int	detailer_hashable(struct coll *, char *);
+static void	detailer_prefetch(struct detailer *, struct coll *);
+static int	detailer_md5(struct detailer *, char *, char *, off_t *,
+		    struct stat *);
+static void	detailer_flushjobs(struct detailer *);
+static int	detailer_stat(struct detailer *, const char *, struct stat *);
+static struct fattr	*detailer_getattr(struct detailer *, const char *);
 
 void *
 detailer(void *arg)
@@ -84,7 +110,12 @@ detailer(void *arg)
 	d->config = args->config;
 	d->rd = args->rd;
 	d->wr = args->wr;
+	d->dircache = NULL;
 	d->errmsg = NULL;
+	d->hasher = hasher_new(0);
+	d->jobhead = 0;
+	d->njobs = 0;
+	d->scanned = 0;
 
 #ifdef DETAILER_DEBUG
 	error = stream_log(d->rd, "detailer-in.log");
@@ -94,6 +125,10 @@ detailer(void *arg)
 #endif
 
 	error = detailer_batch(d);
+	if (d->hasher != NULL) {
+		detailer_flushjobs(d);
+		hasher_free(d->hasher);
+	}
 	switch (error) {
 	case DETAILER_ERR_PROTO:
 		xasprintf(&args->errmsg, "Detailer failed: Protocol error");
@@ -131,6 +166,7 @@ detailer_batch(struct detailer *d)
 {
 	struct config *config;
 	struct stream *rd, *wr;
+	struct stream_zopts zopts;
 	struct coll *coll;
 	struct status *st;
 	struct fixup *fixup;
@@ -140,6 +176,8 @@ detailer_batch(struct detailer *d)
 	config = d->config;
 	rd = d->rd;
 	wr = d->wr;
+	zopts.threaded = config->zthreaded;
+	zopts.backlog = (stream_backlogfn_t *)chan_backlog;
 	STAILQ_FOREACH(coll, &config->colls, co_next) {
 		if (coll->co_options & CO_SKIP)
 			continue;
@@ -158,13 +196,17 @@ detailer_batch(struct detailer *d)
 			return (DETAILER_ERR_WRITE);
 		stream_flush(wr);
 		if (coll->co_options & CO_COMPRESS) {
-			stream_filter_start(rd, STREAM_FILTER_ZLIB, NULL);
-			stream_filter_start(wr, STREAM_FILTER_ZLIB, NULL);
+			zopts.level = coll->co_zlevel;
+			stream_filter_start(rd, STREAM_FILTER_ZLIB, &zopts);
+			stream_filter_start(wr, STREAM_FILTER_ZLIB, &zopts);
 		}
 		st = status_open(coll, -1, &d->errmsg);
 		if (st == NULL)
 			return (DETAILER_ERR_MSG);
+		d->dircache = dircache_new();
 		error = detailer_coll(d, coll, st);
+		dircache_free(d->dircache);
+		d->dircache = NULL;
 		status_close(st, NULL);
 		if (error)
 			return (error);
@@ -194,8 +236,10 @@ detailer_batch(struct detailer *d)
 		    coll->co_release);
 		if (error)
 			return (DETAILER_ERR_WRITE);
-		if (coll->co_options & CO_COMPRESS)
-			stream_filter_start(wr, STREAM_FILTER_ZLIB, NULL);
+		if (coll->co_options & CO_COMPRESS) {
+			zopts.level = coll->co_zlevel;
+			stream_filter_start(wr, STREAM_FILTER_ZLIB, &zopts);
+		}
 		while (!fixupseof) {
 			if (fixup == NULL)
 				fixup = fixups_get(config->fixups);
@@ -239,10 +283,14 @@ detailer_coll(struct detailer *d, struct coll *coll, struct status *st)
 
 	rd = d->rd;
 	wr = d->wr;
+	d->scanned = 0;
 	line = stream_getln(rd, NULL);
 	if (line == NULL)
 		return (DETAILER_ERR_READ);
 	while (strcmp(line, ".") != 0) {
+		/* The line we just read was part of the input we looked at. */
+		d->scanned -= min(d->scanned, strlen(line) + 1);
+		detailer_prefetch(d, coll);
 		cmd = proto_get_char(&line);
 		switch (cmd) {
 		case 'D':
@@ -327,33 +375,235 @@ detailer_coll(struct detailer *d, struct coll *coll, struct status *st)
 		if (line == NULL)
 			return (DETAILER_ERR_READ);
 	}
+	detailer_flushjobs(d);
 	error = proto_printf(wr, ".\n");
 	if (error)
 		return (DETAILER_ERR_WRITE);
 	return (0);
 }
 
+/*
+ * Returns true if the file should be updated with the rsync algorithm,
+ * which we only use for the files that are patched in place.
+ */
+static int
+detailer_wantrsync(struct coll *coll, char *name)
+{
+
+	if (coll->co_options & CO_NORSYNC)
+		return (0);
+	if (globtree_test(coll->co_norsync, name))
+		return (0);
+	return (coll_inplace(coll, name));
+}
+
+/*
+ * Returns true if detailer_send_regular() would compute the checksum
+ * of this file, if it turns out to be a regular file.
+ */
+static int
+detailer_hashable(struct coll *coll, char *name)
+{
+	size_t len;
+
+	if (coll->co_options & CO_CHECKOUTMODE)
+		return (0);
+	if (isrcs(name, &len) && !(coll->co_options & CO_NORCS))
+		return (0);
+	return (!detailer_wantrsync(coll, name));
+}
+
+/*
+ * Look at the commands that we have already received from the server
+ * but not processed yet, and start computing the checksums of the files
+ * that we are going to need.  This doesn't read anything more from the
+ * server, so that we never wait for input while we still have answers
+ * to send, and the answers still go out in order.
+ */
+static void
+detailer_prefetch(struct detailer *d, struct coll *coll)
+{
+	struct hashjob *job;
+	struct stat sb;
+	char md5[MD5_DIGEST_SIZE];
+	char *buf, *cmd, *end, *file, *line, *nl, *path;
+	size_t len;
+
+	if (d->hasher == NULL)
+		return;
+	buf = stream_peek(d->rd, &len);
+	if (d->scanned > len)
+		d->scanned = 0;
+	end = buf + len;
+	buf += d->scanned;
+	while (d->njobs < DETAILER_MAXJOBS &&
+	    (nl = memchr(buf, '\n', end - buf)) != NULL) {
+		cmd = xmalloc(nl - buf + 1);
+		memcpy(cmd, buf, nl - buf);
+		cmd[nl - buf] = '\0';
+		d->scanned += nl - buf + 1;
+		buf = nl + 1;
+		if (strcmp(cmd, ".") == 0) {
+			/* End of this collection. */
+			free(cmd);
+			break;
+		}
+		line = cmd;
+		if (proto_get_char(&line) == 'U') {
+			file = proto_get_ascii(&line);
+			if (file != NULL && line == NULL &&
+			    detailer_hashable(coll, file)) {
+				path = cvspath(coll->co_prefix, file, 0);
+				if (coll->co_hashcache != NULL &&
+				    stat(path, &sb) == 0 &&
+				    hashcache_getmd5(coll->co_hashcache, path,
+				    &sb, md5) == 0) {
+					/* We already know this one. */
+					free(path);
+					free(cmd);
+					continue;
+				}
+				job = hasher_submit(d->hasher, path, 0, -1);
+				d->jobs[(d->jobhead + d->njobs) %
+				    DETAILER_MAXJOBS] = job;
+				d->njobs++;
+				free(path);
+			}
+		}
+		free(cmd);
+	}
+}
+
+/*
+ * Look up a file relative to its directory in the cache.  The updater
+ * may have removed and recreated that directory since we opened it, so
+ * if the file can't be found, make sure that isn't why.
+ */
+static int
+detailer_stat(struct detailer *d, const char *path, struct stat *sb)
+{
+	const char *base;
+	int dirfd, error;
+
+	dirfd = dircache_lookup(d->dircache, path, &base);
+	error = fstatat(dirfd, base, sb, 0);
+	if (error && errno == ENOENT && dircache_stale(d->dircache)) {
+		dirfd = dircache_lookup(d->dircache, path, &base);
+		error = fstatat(dirfd, base, sb, 0);
+	}
+	return (error);
+}
+
+/* Same as detailer_stat(), but return the attributes of the file. */
+static struct fattr *
+detailer_getattr(struct detailer *d, const char *path)
+{
+	struct fattr *fa;
+	const char *base;
+	int dirfd;
+
+	dirfd = dircache_lookup(d->dircache, path, &base);
+	fa = fattr_frompathat(dirfd, base, FATTR_NOFOLLOW);
+	if (fa == NULL && errno == ENOENT && dircache_stale(d->dircache)) {
+		dirfd = dircache_lookup(d->dircache, path, &base);
+		fa = fattr_frompathat(dirfd, base, FATTR_NOFOLLOW);
+	}
+	return (fa);
+}
+
+/*
+ * Compute the checksum of a file, using the result of detailer_prefetch()
+ * if we have it.  Prefetched checksums coming before it in the queue are
+ * for files that didn't need them after all.  If the checksum comes from
+ * the hasher, the file may have been read long before the caller stat'ed
+ * it, so "sb" is then replaced with the attributes the file had then,
+ * unless it is NULL.
+ */
+static int
+detailer_md5(struct detailer *d, char *path, char *md5, off_t *sizep,
+    struct stat *sb)
+{
+	struct hashjob *job;
+	int i;
+
+	for (i = 0; i < d->njobs; i++) {
+		job = d->jobs[(d->jobhead + i) % DETAILER_MAXJOBS];
+		if (strcmp(hashjob_path(job), path) == 0)
+			break;
+	}
+	if (i == d->njobs)
+		return (MD5_File(path, md5, sizep));
+	while (i-- > 0) {
+		job = d->jobs[d->jobhead];
+		d->jobhead = (d->jobhead + 1) % DETAILER_MAXJOBS;
+		d->njobs--;
+		(void)hashjob_wait(job, md5, NULL, NULL);
+	}
+	job = d->jobs[d->jobhead];
+	d->jobhead = (d->jobhead + 1) % DETAILER_MAXJOBS;
+	d->njobs--;
+	return (hashjob_wait(job, md5, sizep, sb));
+}
+
+/* Throw away the checksums that haven't been used. */
+static void
+detailer_flushjobs(struct detailer *d)
+{
+	char md5[MD5_DIGEST_SIZE];
+
+	while (d->njobs > 0) {
+		(void)hashjob_wait(d->jobs[d->jobhead], md5, NULL, NULL);
+		d->jobhead = (d->jobhead + 1) % DETAILER_MAXJOBS;
+		d->njobs--;
+	}
+	d->scanned = 0;
+}
+
 /*
  * Tell the server to update a regular file.
  */
 static int
 detailer_send_regular(struct detailer *d, struct coll *coll, char *name)
 {
+	struct hashcache *hc;
 	struct stream *wr;
+	struct stat hashsb, sb;
 	char md5[MD5_DIGEST_SIZE];
 	char *path;
 	off_t size;
 	int error;
 
-	if (!(coll->co_options & CO_NORSYNC) &&
-	    !globtree_test(coll->co_norsync, name)) {
+	if (detailer_wantrsync(coll, name))
 		return detailer_send_rsync(d, coll, name);
-	}
 
 	wr = d->wr;
 	path = cvspath(coll->co_prefix, name, 0);
 
-	error = MD5_File(path, md5, &size);
+	/*
+	 * The file is stat'ed before it is read, so that if it changes
+	 * while we compute the checksum, the cache entry is already stale.
+	 * A prefetched checksum may have been computed before that, so
+	 * if the file has changed since the hasher opened it, we read it
+	 * again rather than cache the checksum of the old contents.
+	 */
+	hc = coll->co_hashcache;
+	if (hc != NULL) {
+		if (detailer_stat(d, path, &sb) == -1 || !S_ISREG(sb.st_mode))
+			hc = NULL;
+	}
+	if (hc != NULL && hashcache_getmd5(hc, path, &sb, md5) == 0) {
+		size = sb.st_size;
+		error = 0;
+	} else {
+		if (hc != NULL)
+			hashsb = sb;
+		error = detailer_md5(d, path, md5, &size,
+		    hc != NULL ? &hashsb : NULL);
+		if (!error && hc != NULL && !hashcache_samefile(&hashsb, &sb))
+			error = MD5_File(path, md5, &size);
+		if (!error && hc != NULL)
+			hashcache_putmd5(hc, path, &sb, md5);
+	}
 	if (error && errno != ENOENT) {
 		xasprintf(&d->errmsg, "Read failure from \"%s\": %s\n", path,
 		    strerror(errno));
@@ -381,16 +631,39 @@ detailer_send_regular(struct detailer *d, struct coll *coll, char *name)
 static int
 detailer_send_rsync(struct detailer *d, struct coll *coll, char *name)
 {
+	struct hashcache *hc;
 	struct stream *wr;
 	struct rsyncfile *rf;
-	char *path;
+	struct stat sb;
+	char *blocks, *path;
+	size_t blocksize, len, n, size;
 	int error;
 
 	wr = d->wr;
 	path = cvspath(coll->co_prefix, name, 0);
+	/* Finish any interrupted in-place update before looking at it. */
+	if (rsync_recover(path) == -1) {
+		lprintf(-1, "Cannot finish in-place update of \"%s\": %s\n",
+		    path, strerror(errno));
+	}
+	hc = coll->co_hashcache;
+	if (hc != NULL) {
+		if (detailer_stat(d, path, &sb) == -1 || !S_ISREG(sb.st_mode))
+			hc = NULL;
+	}
+	if (hc != NULL) {
+		blocks = hashcache_getblocks(hc, path, &sb, &blocksize);
+		if (blocks != NULL) {
+			free(path);
+			error = detailer_send_blocks(d, name, sb.st_size,
+			    blocksize, blocks);
+			free(blocks);
+			return (error);
+		}
+	}
 	rf = rsync_open(path, 0, 1);
-	free(path);
 	if (rf == NULL) {
+		free(path);
 		/* Fallback if we fail in opening it. */
 		error = proto_printf(wr, "A %s\n", name);
 		if (error)
@@ -401,19 +674,66 @@ detailer_send_rsync(struct detailer *d, struct coll *coll, char *name)
 	    rsync_blocksize(rf));
 	if (error) {
 		rsync_close(rf);
+		free(path);
 		return (DETAILER_ERR_WRITE);
 	}
-	/* Detail the blocks. */
+	/* Detail the blocks, and remember them for the next time. */
+	blocks = NULL;
+	len = size = 0;
 	while (rsync_nextblock(rf) != 0) {
 		error = proto_printf(wr, "%s %s\n", rsync_rsum(rf),
 		    rsync_blockmd5(rf));
 		if (error) {
 			rsync_close(rf);
+			free(blocks);
+			free(path);
 			return (DETAILER_ERR_WRITE);
 		}
+		if (hc == NULL)
+			continue;
+		n = strlen(rsync_rsum(rf)) + strlen(rsync_blockmd5(rf)) + 2;
+		if (len + n + 1 > size) {
+			size = MAX(size * 2, len + n + 1);
+			blocks = xrealloc(blocks, size);
+		}
+		len += snprintf(blocks + len, size - len, "%s%s %s",
+		    len > 0 ? " " : "", rsync_rsum(rf), rsync_blockmd5(rf));
 	}
 	error = proto_printf(wr, ".\n");
+	if (hc != NULL && blocks != NULL)
+		hashcache_putblocks(hc, path, &sb, rsync_blocksize(rf), blocks);
 	rsync_close(rf);
+	free(blocks);
+	free(path);
+	if (error)
+		return (DETAILER_ERR_WRITE);
+	return (0);
+}
+
+/*
+ * Send the rsync block signatures of a file from the checksum cache.
+ */
+static int
+detailer_send_blocks(struct detailer *d, char *name, off_t size,
+    size_t blocksize, char *blocks)
+{
+	struct stream *wr;
+	char *md5, *rsum;
+	int error;
+
+	wr = d->wr;
+	error = proto_printf(wr, "r %s %O %z\n", name, size, blocksize);
+	if (error)
+		return (DETAILER_ERR_WRITE);
+	while ((rsum = proto_get_ascii(&blocks)) != NULL) {
+		md5 = proto_get_ascii(&blocks);
+		if (md5 == NULL)
+			break;
+		error = proto_printf(wr, "%s %s\n", rsum, md5);
+		if (error)
+			return (DETAILER_ERR_WRITE);
+	}
+	error = proto_printf(wr, ".\n");
 	if (error)
 		return (DETAILER_ERR_WRITE);
 	return (0);
@@ -434,7 +754,7 @@ detailer_send_rcs(struct detailer *d, struct coll *coll, char *name)
 	wr = d->wr;
 	/* XXX atticpath() is inherently racy and should not be used. */
 	path = atticpath(coll->co_prefix, name);
-	fa = fattr_frompath(path, FATTR_NOFOLLOW);
+	fa = detailer_getattr(d, path);
 	if (fa == NULL) {
 		/* The RCS file doesn't exist on the client.  Just have the
 		   server send a whole new file. */
@@ -477,7 +797,7 @@ detailer_send_co(struct detailer *d, struct coll *coll, struct status *st,
 	path = checkoutpath(coll->co_prefix, file);
 	if (path == NULL)
 		return (DETAILER_ERR_PROTO);
-	fa = fattr_frompath(path, FATTR_NOFOLLOW);
+	fa = detailer_getattr(d, path);
 	if (fa == NULL) {
 		/* We don't have the file, so the only option at this
 		   point is to tell the server to send it.  The server
@@ -552,7 +872,7 @@ detailer_checkrcsattr(struct detailer *d, struct coll *coll, char *name,
 	assert(!(coll->co_options & CO_CHECKOUTMODE));
 
 	path = cvspath(coll->co_prefix, name, attic);
-	fa = fattr_frompath(path, FATTR_NOFOLLOW);
+	fa = detailer_getattr(d, path);
 	free(path);
 
 	if (fa != NULL && fattr_equal(fa, server_attr)) {
@@ -591,12 +911,12 @@ detailer_send_details(struct detailer *d, struct coll *coll, struct status *st,
 	if (fa == NULL) {
 		/* We don't have the attributes yet. */
 		path = cvspath(coll->co_prefix, name, 0);
-		fa = fattr_frompath(path, FATTR_NOFOLLOW);
+		fa = detailer_getattr(d, path);
 		if (fa == NULL) {
 			/* Try the attic. */
 			free(path);
 			path = cvspath(coll->co_prefix, name, 1);
-			fa = fattr_frompath(path, FATTR_NOFOLLOW);
+			fa = detailer_getattr(d, path);
 		}
 		free(path);
 		free_fa = 1;
@@ -67,6 +67,32 @@ struct diffstart {
 	LIST_HEAD(, editcmd) dhead;
 };
 
+/* A line of a difftext, see below. */
+struct diffline {
+	char *text;
+	size_t len;
+	int dollar;			/* May contain a keyword. */
+};
+
+/* The text of the lines lives in chunks that never move. */
+struct diffchunk {
+	struct diffchunk *next;
+	size_t used;
+	size_t size;
+};
+
+#define	DIFFTEXT_CHUNKSIZE	(64 * 1024)
+
+struct difftext {
+	struct diffline *lines;		/* The current version. */
+	lineno_t nlines;
+	lineno_t size;
+	struct diffline *newlines;	/* The one being built. */
+	lineno_t nnewlines;
+	lineno_t newsize;
+	struct diffchunk *chunks;
+};
+
 static int	diff_geteditcmd(struct editcmd *, char *);
 static int	diff_copyln(struct editcmd *, lineno_t);
 static int	diff_ignoreln(struct editcmd *, lineno_t);
@@ -74,6 +100,13 @@ static void	diff_write(struct editcmd *, void *, size_t);
 static int	diff_insert_edit(struct diffstart *, struct editcmd *);
 static void	diff_free(struct diffstart *);
 
+static char	*difftext_alloc(struct difftext *, size_t);
+static void	 difftext_addline(struct difftext *, char *, size_t, int);
+static int	 difftext_copyln(struct difftext *, struct editcmd *,
+		     lineno_t);
+static void	 difftext_merge(struct difftext *, struct diffline *,
+		     struct diffline *);
+
 int
 diff_apply(struct stream *rd, struct stream *orig, struct stream *dest,
     struct keyword *keyword, struct diffinfo *di, int comode)
@@ -433,3 +466,245 @@ diff_write(struct editcmd *ec, void *buf, size_t size)
 		stream_write(ec->dest, buf, size);
 	}
 }
+
+/*
+ * Apply a series of checkout mode deltas in memory.  The lines of the file
+ * are kept in an array of descriptors pointing into chunks of text that
+ * never move: the original file, and the text added by the deltas.  So
+ * applying a delta only builds a new array of descriptors, and the file
+ * is written once after the last delta rather than once for each.
+ *
+ * The result is the same as that of applying the deltas one after the
+ * other with diff_apply(), down to the keywords being expanded for every
+ * delta, which only needs to look at the few lines with a '$' in them.
+ */
+struct difftext *
+difftext_new(struct stream *orig)
+{
+	struct difftext *dt;
+	struct diffline *tmp;
+	size_t size;
+	char *line;
+
+	dt = xmalloc(sizeof(struct difftext));
+	memset(dt, 0, sizeof(*dt));
+	while ((line = stream_getln(orig, &size)) != NULL)
+		difftext_addline(dt, line, size, 1);
+	if (!stream_eof(orig)) {
+		difftext_free(dt);
+		return (NULL);
+	}
+	tmp = dt->lines;
+	dt->lines = dt->newlines;
+	dt->nlines = dt->nnewlines;
+	dt->newlines = tmp;
+	dt->size = dt->newsize;
+	dt->newsize = 0;
+	return (dt);
+}
+
+/* Apply a delta read from "rd", like diff_apply() does in checkout mode. */
+int
+difftext_apply(struct difftext *dt, struct stream *rd, struct keyword *keyword,
+    struct diffinfo *di)
+{
+	struct editcmd ec;
+	struct diffline *dl, *tmp;
+	lineno_t i, j, size;
+	size_t len;
+	char *line, *newline;
+	int empty, noeol;
+
+	memset(&ec, 0, sizeof(ec));
+	dt->nnewlines = 0;
+	empty = 0;
+	noeol = 0;
+	line = stream_getln(rd, NULL);
+	while (line != NULL && strcmp(line, ".") != 0 &&
+	    strcmp(line, ".+") != 0) {
+		/* See diff_apply() for forced commits. */
+		if (*line == '\0') {
+			if (empty)
+				return (-1);
+			empty = 1;
+			line = stream_getln(rd, NULL);
+			continue;
+		}
+		if (diff_geteditcmd(&ec, line) != 0)
+			return (-1);
+		if (ec.cmd == EC_ADD) {
+			if (difftext_copyln(dt, &ec, ec.where) != 0)
+				return (-1);
+			for (i = 0; i < ec.count; i++) {
+				line = stream_getln(rd, &len);
+				if (line == NULL)
+					return (-1);
+				if (line[0] == '.') {
+					line++;
+					len--;
+				}
+				difftext_addline(dt, line, len, 1);
+			}
+		} else {
+			assert(ec.cmd == EC_DEL);
+			if (difftext_copyln(dt, &ec, ec.where - 1) != 0)
+				return (-1);
+			if (ec.count > dt->nlines - ec.editline)
+				return (-1);
+			ec.editline += ec.count;
+		}
+		line = stream_getln(rd, NULL);
+	}
+	if (line == NULL)
+		return (-1);
+	if (strcmp(line, ".+") == 0 && !empty)
+		noeol = 1;
+	(void)difftext_copyln(dt, &ec, dt->nlines);
+
+	/* The new version becomes the current one. */
+	tmp = dt->lines;
+	dt->lines = dt->newlines;
+	dt->nlines = dt->nnewlines;
+	dt->newlines = tmp;
+	size = dt->size;
+	dt->size = dt->newsize;
+	dt->newsize = size;
+
+	/* Expand the keywords, as diff_write() does. */
+	for (i = 0; i < dt->nlines; i++) {
+		dl = &dt->lines[i];
+		if (!dl->dollar || !keyword_expand(keyword, di, dl->text,
+		    dl->len, &newline, &len))
+			continue;
+		dl->text = difftext_alloc(dt, len);
+		memcpy(dl->text, newline, len);
+		dl->len = len;
+		dl->dollar = (memchr(newline, '$', len) != NULL);
+		free(newline);
+	}
+	if (noeol) {
+		/* The last character goes away, whatever it is. */
+		if (dt->nlines == 0)
+			return (-1);
+		dl = &dt->lines[dt->nlines - 1];
+		if (--dl->len == 0)
+			dt->nlines--;
+		else
+			dl->dollar = (memchr(dl->text, '$', dl->len) != NULL);
+	}
+	/*
+	 * A line without a newline can only be last in a file.  Anything
+	 * that got added after it by this delta is part of the same line
+	 * when the next delta is applied.
+	 */
+	for (i = 0, j = 0; i < dt->nlines; i++, j++) {
+		dl = &dt->lines[i];
+		while (dl->text[dl->len - 1] != '\n' && i + 1 < dt->nlines)
+			difftext_merge(dt, dl, &dt->lines[++i]);
+		dt->lines[j] = *dl;
+	}
+	dt->nlines = j;
+	return (0);
+}
+
+/* Write the current version of the text. */
+int
+difftext_write(struct difftext *dt, struct stream *dest)
+{
+	struct diffline *dl;
+	lineno_t i;
+
+	for (i = 0; i < dt->nlines; i++) {
+		dl = &dt->lines[i];
+		if (stream_write(dest, dl->text, dl->len) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+void
+difftext_free(struct difftext *dt)
+{
+	struct diffchunk *chunk;
+
+	while ((chunk = dt->chunks) != NULL) {
+		dt->chunks = chunk->next;
+		free(chunk);
+	}
+	free(dt->newlines);
+	free(dt->lines);
+	free(dt);
+}
+
+/* Get room for "size" bytes of text. */
+static char *
+difftext_alloc(struct difftext *dt, size_t size)
+{
+	struct diffchunk *chunk;
+	char *cp;
+
+	chunk = dt->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = xmalloc(sizeof(struct diffchunk) +
+		    max(size, DIFFTEXT_CHUNKSIZE));
+		chunk->used = 0;
+		chunk->size = max(size, DIFFTEXT_CHUNKSIZE);
+		chunk->next = dt->chunks;
+		dt->chunks = chunk;
+	}
+	cp = (char *)(chunk + 1) + chunk->used;
+	chunk->used += size;
+	return (cp);
+}
+
+/* Add a line to the version being built, copying its text if asked to. */
+static void
+difftext_addline(struct difftext *dt, char *text, size_t len, int copy)
+{
+	struct diffline *dl;
+
+	if (dt->nnewlines == dt->newsize) {
+		dt->newsize = dt->newsize == 0 ? 1024 : dt->newsize * 2;
+		dt->newlines = xrealloc(dt->newlines,
+		    dt->newsize * sizeof(struct diffline));
+	}
+	dl = &dt->newlines[dt->nnewlines++];
+	if (copy) {
+		dl->text = difftext_alloc(dt, len);
+		memcpy(dl->text, text, len);
+	} else {
+		dl->text = text;
+	}
+	dl->len = len;
+	dl->dollar = (memchr(text, '$', len) != NULL);
+}
+
+/* Copy lines from the current version up to line "to". */
+static int
+difftext_copyln(struct difftext *dt, struct editcmd *ec, lineno_t to)
+{
+	struct diffline *dl;
+
+	if (to > dt->nlines)
+		return (-1);
+	while (ec->editline < to) {
+		dl = &dt->lines[ec->editline++];
+		difftext_addline(dt, dl->text, dl->len, 0);
+	}
+	return (0);
+}
+
+/* Append the text of line "next" to line "dl". */
+static void
+difftext_merge(struct difftext *dt, struct diffline *dl,
+    struct diffline *next)
+{
+	char *text;
+
+	text = difftext_alloc(dt, dl->len + next->len);
+	memcpy(text, dl->text, dl->len);
+	memcpy(text + dl->len, next->text, next->len);
+	dl->text = text;
+	dl->len += next->len;
+	dl->dollar = dl->dollar || next->dollar;
+}
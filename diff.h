@@ -29,6 +29,7 @@
 struct stream;
 struct keyword;
 struct file_update;
+struct difftext;
 
 /* Description of an RCS delta. */
 struct diffinfo {
@@ -47,4 +48,10 @@ int		 diff_apply(struct stream *, struct stream *, struct stream *,
 int		 diff_reverse(struct stream *, struct stream *,
 		     struct stream *, struct keyword *, struct diffinfo *);
 
+struct difftext	*difftext_new(struct stream *);
+int		 difftext_apply(struct difftext *, struct stream *,
+		     struct keyword *, struct diffinfo *);
+int		 difftext_write(struct difftext *, struct stream *);
+void		 difftext_free(struct difftext *);
+
 #endif /* !_DIFF_H_ */
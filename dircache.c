@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2012, Maxime Henrion <mux@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dircache.h"
+#include "misc.h"
+
+/*
+ * A cache of open directories, so that the files of a collection can be
+ * looked up relative to their directory, instead of walking their whole
+ * path from the root every time.  Since we visit the files in sorted
+ * order, we only keep the current directory and its parents open, and
+ * move up and down the tree as the paths change, much like pathcomp does
+ * for the status file.
+ *
+ * The directories are not checked again once open.  The updater may
+ * remove and recreate them while the detailer looks at the same tree,
+ * which leaves us with a directory that is empty and unlinked, where
+ * every lookup fails with ENOENT.  So when that happens, the caller uses
+ * dircache_stale() to check that the directory is still the one at its
+ * pathname, and tries again if it wasn't.  Nothing in csup renames
+ * directories, which would be harder to notice.
+ */
+
+struct dircache {
+	char *path;		/* The current directory, with a final '/'. */
+	size_t pathsize;
+	int *fds;		/* Open directories, outermost first. */
+	size_t *ends;		/* Offset of the '/' ending each of them. */
+	int depth;
+	int size;
+};
+
+struct dircache *
+dircache_new(void)
+{
+	struct dircache *dc;
+
+	dc = xmalloc(sizeof(struct dircache));
+	dc->pathsize = 128;
+	dc->path = xmalloc(dc->pathsize);
+	dc->size = 16;
+	dc->fds = xmalloc(dc->size * sizeof(int));
+	dc->ends = xmalloc(dc->size * sizeof(size_t));
+	dc->depth = 0;
+	return (dc);
+}
+
+/*
+ * Return a directory descriptor and a name in "*name", to use with the
+ * *at() system calls to reach "path".  If the directory can't be opened,
+ * this returns AT_FDCWD and "path" itself, so that the caller gets the
+ * same error it would have without the cache.  The descriptor belongs
+ * to the cache and is only valid until the next call.
+ */
+int
+dircache_lookup(struct dircache *dc, const char *path, const char **name)
+{
+	const char *comp;
+	size_t dirlen, end, start;
+	int fd, parent;
+
+	*name = pathlast(path);
+	dirlen = *name - path;
+	if (dirlen == 0 || **name == '\0') {
+		*name = path;
+		return (AT_FDCWD);
+	}
+
+	/* Leave the directories that aren't above the new path. */
+	while (dc->depth > 0) {
+		end = dc->ends[dc->depth - 1];
+		if (end < dirlen && memcmp(dc->path, path, end + 1) == 0)
+			break;
+		dc->depth--;
+		close(dc->fds[dc->depth]);
+	}
+
+	/* And enter the new ones, one component at a time. */
+	if (dirlen + 1 > dc->pathsize) {
+		while (dirlen + 1 > dc->pathsize)
+			dc->pathsize *= 2;
+		dc->path = xrealloc(dc->path, dc->pathsize);
+	}
+	memcpy(dc->path, path, dirlen);
+	start = dc->depth > 0 ? dc->ends[dc->depth - 1] + 1 : 0;
+	while (start < dirlen) {
+		end = start;
+		while (dc->path[end] != '/')
+			end++;
+		parent = dc->depth > 0 ? dc->fds[dc->depth - 1] : AT_FDCWD;
+		dc->path[end] = '\0';
+		if (end == start)
+			comp = (start == 0) ? "/" : ".";
+		else
+			comp = dc->path + start;
+		fd = openat(parent, comp, O_RDONLY | O_DIRECTORY);
+		dc->path[end] = '/';
+		if (fd == -1) {
+			*name = path;
+			return (AT_FDCWD);
+		}
+		if (dc->depth == dc->size) {
+			dc->size *= 2;
+			dc->fds = xrealloc(dc->fds, dc->size * sizeof(int));
+			dc->ends = xrealloc(dc->ends,
+			    dc->size * sizeof(size_t));
+		}
+		dc->fds[dc->depth] = fd;
+		dc->ends[dc->depth] = end;
+		dc->depth++;
+		start = end + 1;
+	}
+	return (dc->fds[dc->depth - 1]);
+}
+
+/*
+ * Close the open directories that are no longer the ones found at their
+ * pathname, starting with the innermost one.  Returns 1 if there were
+ * any, in which case the lookup that failed should be retried, and 0 if
+ * the cache was right.  Checking the innermost directory costs as much
+ * as a lookup without the cache, which is fine since this is only done
+ * after a failure.
+ */
+int
+dircache_stale(struct dircache *dc)
+{
+	struct stat sb, fdsb;
+	size_t end;
+	char save;
+	int error, saved_errno, stale;
+
+	saved_errno = errno;
+	stale = 0;
+	while (dc->depth > 0) {
+		end = dc->ends[dc->depth - 1];
+		save = dc->path[end + 1];
+		dc->path[end + 1] = '\0';
+		error = stat(dc->path, &sb);
+		dc->path[end + 1] = save;
+		if (!error && fstat(dc->fds[dc->depth - 1], &fdsb) == 0 &&
+		    sb.st_dev == fdsb.st_dev && sb.st_ino == fdsb.st_ino)
+			break;
+		dc->depth--;
+		close(dc->fds[dc->depth]);
+		stale = 1;
+	}
+	errno = saved_errno;
+	return (stale);
+}
+
+void
+dircache_free(struct dircache *dc)
+{
+
+	while (dc->depth > 0)
+		close(dc->fds[--dc->depth]);
+	free(dc->ends);
+	free(dc->fds);
+	free(dc->path);
+	free(dc);
+}
@@ -30,6 +30,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -140,6 +141,8 @@ fattr_fini(void)
 const struct fattr *fattr_bogus = &bogus;
 
 static char		*fattr_scanattr(struct fattr *, int, const char *);
+static int		 fattr_doinstall(struct fattr *, const char *,
+			     const char *, int);
 
 int
 fattr_supported(int type)
@@ -217,22 +220,27 @@ fattr_fromstat(struct stat *sb)
 
 struct fattr *
 fattr_frompath(const char *path, int nofollow)
+{
+
+	return (fattr_frompathat(AT_FDCWD, path, nofollow));
+}
+
+/* Like fattr_frompath(), with "path" relative to the directory "dirfd". */
+struct fattr *
+fattr_frompathat(int dirfd, const char *path, int nofollow)
 {
 	struct fattr *fa;
 	struct stat sb;
 	int error, len;
 
-	if (nofollow)
-		error = lstat(path, &sb);
-	else
-		error = stat(path, &sb);
+	error = fstatat(dirfd, path, &sb, nofollow ? AT_SYMLINK_NOFOLLOW : 0);
 	if (error)
 		return (NULL);
 	fa = fattr_fromstat(&sb);
 	if (fa->mask & FA_LINKTARGET) {
 		char buf[1024];
 
-		len = readlink(path, buf, sizeof(buf));
+		len = readlinkat(dirfd, path, buf, sizeof(buf));
 		if (len == -1) {
 			fattr_free(fa);
 			return (NULL);
@@ -798,10 +806,33 @@ fattr_delete(const char *path)
  */
 int
 fattr_install(struct fattr *fa, const char *topath, const char *frompath)
+{
+
+	return (fattr_doinstall(fa, topath, frompath, -1));
+}
+
+/*
+ * Like fattr_install(), but the new file is the one open on "fd", which
+ * has usually been created without a name with O_TMPFILE.  Its attributes
+ * are set through the descriptor and it is then linked to "topath".  If
+ * "topath" exists, the file is linked to "temppath" first and renamed over
+ * it, so the replacement is still atomic.
+ */
+int
+fattr_installfd(struct fattr *fa, const char *topath, const char *temppath,
+    int fd)
+{
+
+	return (fattr_doinstall(fa, topath, temppath, fd));
+}
+
+static int
+fattr_doinstall(struct fattr *fa, const char *topath, const char *frompath,
+    int fd)
 {
 	struct timeval tv[2];
 	struct fattr *old;
-	int error, inplace, mask;
+	int error, exists, inplace, mask, saved_errno;
 	mode_t modemask, newmode;
 	uid_t uid;
 	gid_t gid;
@@ -813,12 +844,13 @@ fattr_install(struct fattr *fa, const char *topath, const char *frompath)
 		modemask = FA_PERMMASK;
 
 	inplace = 0;
-	if (frompath == NULL) {
+	if (frompath == NULL && fd == -1) {
 		/* Changing attributes in place. */
 		frompath = topath;
 		inplace = 1;
 	}
 	old = fattr_frompath(topath, FATTR_NOFOLLOW);
+	exists = (old != NULL);
 	if (old != NULL) {
 		if (inplace && fattr_equal(fa, old)) {
 			fattr_free(old);
@@ -860,6 +892,7 @@ fattr_install(struct fattr *fa, const char *topath, const char *frompath)
 				error = unlink(topath);
 			if (error)
 				goto bad;
+			exists = 0;
 		}
 	}
 
@@ -869,7 +902,10 @@ fattr_install(struct fattr *fa, const char *topath, const char *frompath)
 		gettimeofday(tv, NULL);		/* Access time. */
 		tv[1].tv_sec = fa->modtime;	/* Modification time. */
 		tv[1].tv_usec = 0;
-		error = utimes(frompath, tv);
+		if (fd != -1)
+			error = futimes(fd, tv);
+		else
+			error = utimes(frompath, tv);
 		if (error)
 			goto bad;
 	}
@@ -880,7 +916,10 @@ fattr_install(struct fattr *fa, const char *topath, const char *frompath)
 			uid = fa->uid;
 		if (mask & FA_GROUP)
 			gid = fa->gid;
-		error = chown(frompath, uid, gid);
+		if (fd != -1)
+			error = fchown(fd, uid, gid);
+		else
+			error = chown(frompath, uid, gid);
 		if (error) {
 			goto bad;
 		}
@@ -892,12 +931,31 @@ fattr_install(struct fattr *fa, const char *topath, const char *frompath)
 			newmode |= (old->mode & ~modemask);
 			newmode &= (FA_SETIDMASK | FA_PERMMASK);
 		}
-		error = chmod(frompath, newmode);
+		if (fd != -1)
+			error = fchmod(fd, newmode);
+		else
+			error = chmod(frompath, newmode);
 		if (error)
 			goto bad;
 	}
 
-	if (!inplace) {
+	if (fd != -1) {
+		error = exists ? -1 : linkfd(fd, topath);
+		if (error && (exists || errno == EEXIST)) {
+			/* A link can't replace the target, a rename can. */
+			error = linkfd(fd, frompath);
+			if (!error) {
+				error = rename(frompath, topath);
+				if (error) {
+					saved_errno = errno;
+					(void)unlink(frompath);
+					errno = saved_errno;
+				}
+			}
+		}
+		if (error)
+			goto bad;
+	} else if (!inplace) {
 		error = rename(frompath, topath);
 		if (error)
 			goto bad;
@@ -90,6 +90,7 @@ struct fattr	*fattr_new(int, time_t);
 struct fattr	*fattr_default(int);
 struct fattr	*fattr_fromstat(struct stat *);
 struct fattr	*fattr_frompath(const char *, int);
+struct fattr	*fattr_frompathat(int, const char *, int);
 struct fattr	*fattr_fromfd(int);
 struct fattr	*fattr_decode(char *);
 struct fattr	*fattr_forcheckout(const struct fattr *, mode_t);
@@ -107,6 +108,8 @@ void		 fattr_override(struct fattr *, const struct fattr *, int);
 int		 fattr_makenode(const struct fattr *, const char *);
 int		 fattr_delete(const char *path);
 int		 fattr_install(struct fattr *, const char *, const char *);
+int		 fattr_installfd(struct fattr *, const char *, const char *,
+		     int);
 int		 fattr_equal(const struct fattr *, const struct fattr *);
 void		 fattr_free(struct fattr *);
 int		 fattr_supported(int);
@@ -0,0 +1,551 @@
+/*-
+ * Copyright (c) 2012, Maxime Henrion <mux@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hashcache.h"
+#include "misc.h"
+#include "proto.h"
+#include "stream.h"
+
+/*
+ * A persistent cache of file checksums, so that we don't need to read
+ * files that haven't changed since the last time we computed their MD5
+ * checksum or their rsync block signatures.  Entries are keyed by path
+ * and are only valid as long as the device, inode number, size,
+ * modification time and change time of the file are the same; since
+ * the change time can't be set from userland, a file can't be modified
+ * without us noticing.
+ *
+ * The cache lives in the collection directory, next to the list file.
+ * Each line holds one entry:
+ *
+ *   E path dev ino size mtime mtimensec ctime ctimensec md5 blocksize
+ *     [rsum md5 ...]
+ *
+ * where md5 is "-" if unknown, and blocksize is 0 if there are no block
+ * signatures.  The detailer and the updater may use the same cache
+ * concurrently.
+ */
+
+#define	HASHCACHE_VERSION	1
+#define	HASHCACHE_MINBUCKETS	256
+
+struct hashent {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	char md5[MD5_DIGEST_SIZE];
+	size_t blocksize;
+	char *blocks;
+	int used;
+	struct hashent *next;
+};
+
+struct hashcache {
+	pthread_mutex_t lock;
+	char *path;
+	struct hashent **buckets;
+	size_t nbuckets;
+	size_t nents;
+	int dirty;
+};
+
+static struct hashcache	*hashcache_new(const char *);
+static uint32_t		 hashcache_hash(const char *);
+static struct hashent	*hashcache_lookup(struct hashcache *, const char *,
+			     const struct stat *);
+static struct hashent	*hashcache_insert(struct hashcache *, const char *,
+			     const struct stat *);
+static void		 hashcache_remove(struct hashcache *, struct hashent *);
+static void		 hashcache_grow(struct hashcache *);
+static int		 hashcache_match(struct hashent *, const struct stat *);
+static void		 hashcache_setkey(struct hashent *, const struct stat *);
+static int		 hashcache_read(struct hashcache *, struct stream *);
+static int		 hashcache_getnum(char **, unsigned long long *);
+static void		 hashent_free(struct hashent *);
+
+/*
+ * Load the cache from the file at "path".  If it doesn't exist or can't
+ * be parsed, we just start with an empty cache.
+ */
+struct hashcache *
+hashcache_open(const char *path)
+{
+	struct hashcache *hc;
+	struct stream *rd;
+
+	hc = hashcache_new(path);
+	rd = stream_open_mmap(path);
+	if (rd == NULL)
+		return (hc);
+	if (hashcache_read(hc, rd) == -1) {
+		lprintf(2, "Ignoring invalid checksum cache \"%s\"\n", path);
+		hashcache_free(hc);
+		hc = hashcache_new(path);
+		hc->dirty = 1;
+	}
+	stream_close(rd);
+	return (hc);
+}
+
+static struct hashcache *
+hashcache_new(const char *path)
+{
+	struct hashcache *hc;
+
+	hc = xmalloc(sizeof(struct hashcache));
+	pthread_mutex_init(&hc->lock, NULL);
+	hc->path = xstrdup(path);
+	hc->nbuckets = HASHCACHE_MINBUCKETS;
+	hc->buckets = xmalloc(hc->nbuckets * sizeof(struct hashent *));
+	memset(hc->buckets, 0, hc->nbuckets * sizeof(struct hashent *));
+	hc->nents = 0;
+	hc->dirty = 0;
+	return (hc);
+}
+
+static int
+hashcache_read(struct hashcache *hc, struct stream *rd)
+{
+	struct hashent *e;
+	struct stat sb;
+	unsigned long long dev, ino, size, mtime, mnsec, ctime, cnsec, bsize;
+	char *blocks, *line, *md5, *path;
+	int version;
+
+	line = stream_getln(rd, NULL);
+	if (line == NULL || proto_get_char(&line) != 'V' ||
+	    proto_get_int(&line, &version, 10) != 0 || line != NULL ||
+	    version != HASHCACHE_VERSION)
+		return (-1);
+	while ((line = stream_getln(rd, NULL)) != NULL) {
+		if (proto_get_char(&line) != 'E')
+			return (-1);
+		path = proto_get_ascii(&line);
+		if (path == NULL || hashcache_getnum(&line, &dev) ||
+		    hashcache_getnum(&line, &ino) ||
+		    hashcache_getnum(&line, &size) ||
+		    hashcache_getnum(&line, &mtime) ||
+		    hashcache_getnum(&line, &mnsec) ||
+		    hashcache_getnum(&line, &ctime) ||
+		    hashcache_getnum(&line, &cnsec))
+			return (-1);
+		md5 = proto_get_ascii(&line);
+		if (md5 == NULL || hashcache_getnum(&line, &bsize))
+			return (-1);
+		if (strcmp(md5, "-") != 0 && strlen(md5) != MD5_DIGEST_SIZE - 1)
+			return (-1);
+		blocks = line;
+		if ((bsize == 0) != (blocks == NULL))
+			return (-1);
+		memset(&sb, 0, sizeof(sb));
+		sb.st_dev = dev;
+		sb.st_ino = ino;
+		sb.st_size = size;
+		sb.st_mtim.tv_sec = mtime;
+		sb.st_mtim.tv_nsec = mnsec;
+		sb.st_ctim.tv_sec = ctime;
+		sb.st_ctim.tv_nsec = cnsec;
+		e = hashcache_insert(hc, path, &sb);
+		if (strcmp(md5, "-") != 0)
+			strcpy(e->md5, md5);
+		if (blocks != NULL) {
+			e->blocksize = bsize;
+			e->blocks = xstrdup(blocks);
+		}
+		e->used = 0;
+	}
+	if (!stream_eof(rd))
+		return (-1);
+	hc->dirty = 0;
+	return (0);
+}
+
+/*
+ * Write the cache back if it has changed.  The entries that haven't been
+ * looked at during this run are checked against the file system first,
+ * to weed out the ones for files that have been changed or removed.
+ */
+int
+hashcache_save(struct hashcache *hc)
+{
+	struct hashent *e, *next;
+	struct stream *wr;
+	struct stat sb;
+	time_t now;
+	char *tmp;
+	size_t i;
+	int error, saved_errno;
+
+	pthread_mutex_lock(&hc->lock);
+	for (i = 0; i < hc->nbuckets; i++) {
+		for (e = hc->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			if (e->used)
+				continue;
+			if (stat(e->path, &sb) == -1 ||
+			    !hashcache_match(e, &sb))
+				hashcache_remove(hc, e);
+		}
+	}
+	if (!hc->dirty) {
+		pthread_mutex_unlock(&hc->lock);
+		return (0);
+	}
+	tmp = tempname(hc->path);
+	wr = stream_open_file(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (wr == NULL) {
+		pthread_mutex_unlock(&hc->lock);
+		free(tmp);
+		return (-1);
+	}
+	now = time(NULL);
+	error = proto_printf(wr, "V %d\n", HASHCACHE_VERSION);
+	for (i = 0; i < hc->nbuckets && !error; i++) {
+		for (e = hc->buckets[i]; e != NULL && !error; e = e->next) {
+			/*
+			 * If the file changed during the last second, it
+			 * could change again without its timestamps being
+			 * different, so we can't trust the entry.
+			 */
+			if (e->ctime.tv_sec >= now - 1 ||
+			    e->mtime.tv_sec >= now - 1)
+				continue;
+			error = proto_printf(wr, "E %s ", e->path);
+			if (!error)
+				error = stream_printf(wr,
+				    "%llu %llu %lld %lld %ld %lld %ld %s %zu",
+				    (unsigned long long)e->dev,
+				    (unsigned long long)e->ino,
+				    (long long)e->size,
+				    (long long)e->mtime.tv_sec, e->mtime.tv_nsec,
+				    (long long)e->ctime.tv_sec, e->ctime.tv_nsec,
+				    e->md5[0] != '\0' ? e->md5 : "-",
+				    e->blocks != NULL ? e->blocksize : 0) < 0;
+			if (!error && e->blocks != NULL)
+				error = proto_printf(wr, " %S", e->blocks);
+			if (!error)
+				error = proto_printf(wr, "\n");
+		}
+	}
+	if (!error)
+		hc->dirty = 0;
+	pthread_mutex_unlock(&hc->lock);
+	saved_errno = errno;
+	if (stream_close(wr) != 0 && !error) {
+		saved_errno = errno;
+		error = -1;
+	}
+	if (!error && rename(tmp, hc->path) == -1) {
+		saved_errno = errno;
+		error = -1;
+	}
+	if (error)
+		unlink(tmp);
+	free(tmp);
+	errno = saved_errno;
+	return (error ? -1 : 0);
+}
+
+void
+hashcache_free(struct hashcache *hc)
+{
+	struct hashent *e, *next;
+	size_t i;
+
+	for (i = 0; i < hc->nbuckets; i++) {
+		for (e = hc->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			hashent_free(e);
+		}
+	}
+	pthread_mutex_destroy(&hc->lock);
+	free(hc->buckets);
+	free(hc->path);
+	free(hc);
+}
+
+/*
+ * Returns true if the two attributes are for the same version of the
+ * same file, as far as the cache can tell.
+ */
+int
+hashcache_samefile(const struct stat *sb1, const struct stat *sb2)
+{
+
+	return (sb1->st_dev == sb2->st_dev && sb1->st_ino == sb2->st_ino &&
+	    sb1->st_size == sb2->st_size &&
+	    sb1->st_mtim.tv_sec == sb2->st_mtim.tv_sec &&
+	    sb1->st_mtim.tv_nsec == sb2->st_mtim.tv_nsec &&
+	    sb1->st_ctim.tv_sec == sb2->st_ctim.tv_sec &&
+	    sb1->st_ctim.tv_nsec == sb2->st_ctim.tv_nsec);
+}
+
+/*
+ * Look up the MD5 checksum of a file.  Returns 0 and copies it to "md5"
+ * if the cache holds one for this version of the file, -1 otherwise.
+ */
+int
+hashcache_getmd5(struct hashcache *hc, const char *path,
+    const struct stat *sb, char *md5)
+{
+	struct hashent *e;
+	int error;
+
+	error = -1;
+	pthread_mutex_lock(&hc->lock);
+	e = hashcache_lookup(hc, path, sb);
+	if (e != NULL && e->md5[0] != '\0') {
+		memcpy(md5, e->md5, MD5_DIGEST_SIZE);
+		error = 0;
+	}
+	pthread_mutex_unlock(&hc->lock);
+	return (error);
+}
+
+void
+hashcache_putmd5(struct hashcache *hc, const char *path,
+    const struct stat *sb, const char *md5)
+{
+	struct hashent *e;
+
+	pthread_mutex_lock(&hc->lock);
+	e = hashcache_lookup(hc, path, sb);
+	if (e == NULL)
+		e = hashcache_insert(hc, path, sb);
+	if (strcmp(e->md5, md5) != 0) {
+		memcpy(e->md5, md5, MD5_DIGEST_SIZE);
+		hc->dirty = 1;
+	}
+	pthread_mutex_unlock(&hc->lock);
+}
+
+/*
+ * Look up the rsync block signatures of a file.  They are returned as
+ * a malloc'ed string of space separated "rsum md5" pairs, in the same
+ * format as in the protocol, or NULL if the cache doesn't hold any for
+ * this version of the file.
+ */
+char *
+hashcache_getblocks(struct hashcache *hc, const char *path,
+    const struct stat *sb, size_t *blocksize)
+{
+	struct hashent *e;
+	char *blocks;
+
+	blocks = NULL;
+	pthread_mutex_lock(&hc->lock);
+	e = hashcache_lookup(hc, path, sb);
+	if (e != NULL && e->blocks != NULL) {
+		*blocksize = e->blocksize;
+		blocks = xstrdup(e->blocks);
+	}
+	pthread_mutex_unlock(&hc->lock);
+	return (blocks);
+}
+
+void
+hashcache_putblocks(struct hashcache *hc, const char *path,
+    const struct stat *sb, size_t blocksize, const char *blocks)
+{
+	struct hashent *e;
+
+	pthread_mutex_lock(&hc->lock);
+	e = hashcache_lookup(hc, path, sb);
+	if (e == NULL)
+		e = hashcache_insert(hc, path, sb);
+	if (e->blocks == NULL || e->blocksize != blocksize ||
+	    strcmp(e->blocks, blocks) != 0) {
+		free(e->blocks);
+		e->blocks = xstrdup(blocks);
+		e->blocksize = blocksize;
+		hc->dirty = 1;
+	}
+	pthread_mutex_unlock(&hc->lock);
+}
+
+/* FNV-1a hash of the pathname. */
+static uint32_t
+hashcache_hash(const char *path)
+{
+	const unsigned char *cp;
+	uint32_t hash;
+
+	hash = 2166136261U;
+	for (cp = (const unsigned char *)path; *cp != '\0'; cp++) {
+		hash ^= *cp;
+		hash *= 16777619U;
+	}
+	return (hash);
+}
+
+/*
+ * Find the entry for "path" and make sure it is still valid.  Stale
+ * entries are removed on the spot.  The lock must be held.
+ */
+static struct hashent *
+hashcache_lookup(struct hashcache *hc, const char *path,
+    const struct stat *sb)
+{
+	struct hashent *e;
+
+	e = hc->buckets[hashcache_hash(path) & (hc->nbuckets - 1)];
+	while (e != NULL && strcmp(e->path, path) != 0)
+		e = e->next;
+	if (e == NULL)
+		return (NULL);
+	if (!hashcache_match(e, sb)) {
+		hashcache_remove(hc, e);
+		hc->dirty = 1;
+		return (NULL);
+	}
+	e->used = 1;
+	return (e);
+}
+
+/* Add an empty entry for "path", there must not be one already. */
+static struct hashent *
+hashcache_insert(struct hashcache *hc, const char *path,
+    const struct stat *sb)
+{
+	struct hashent *e;
+	size_t i;
+
+	if (hc->nents >= hc->nbuckets)
+		hashcache_grow(hc);
+	e = xmalloc(sizeof(struct hashent));
+	e->path = xstrdup(path);
+	hashcache_setkey(e, sb);
+	e->md5[0] = '\0';
+	e->blocksize = 0;
+	e->blocks = NULL;
+	e->used = 1;
+	i = hashcache_hash(path) & (hc->nbuckets - 1);
+	e->next = hc->buckets[i];
+	hc->buckets[i] = e;
+	hc->nents++;
+	hc->dirty = 1;
+	return (e);
+}
+
+static void
+hashcache_remove(struct hashcache *hc, struct hashent *e)
+{
+	struct hashent **ep;
+
+	ep = &hc->buckets[hashcache_hash(e->path) & (hc->nbuckets - 1)];
+	while (*ep != e)
+		ep = &(*ep)->next;
+	*ep = e->next;
+	hashent_free(e);
+	hc->nents--;
+	hc->dirty = 1;
+}
+
+/* Double the number of buckets. */
+static void
+hashcache_grow(struct hashcache *hc)
+{
+	struct hashent **buckets, *e, *next;
+	size_t i, j, nbuckets;
+
+	nbuckets = hc->nbuckets * 2;
+	buckets = xmalloc(nbuckets * sizeof(struct hashent *));
+	memset(buckets, 0, nbuckets * sizeof(struct hashent *));
+	for (i = 0; i < hc->nbuckets; i++) {
+		for (e = hc->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			j = hashcache_hash(e->path) & (nbuckets - 1);
+			e->next = buckets[j];
+			buckets[j] = e;
+		}
+	}
+	free(hc->buckets);
+	hc->buckets = buckets;
+	hc->nbuckets = nbuckets;
+}
+
+static int
+hashcache_match(struct hashent *e, const struct stat *sb)
+{
+
+	return (e->dev == sb->st_dev && e->ino == sb->st_ino &&
+	    e->size == sb->st_size &&
+	    e->mtime.tv_sec == sb->st_mtim.tv_sec &&
+	    e->mtime.tv_nsec == sb->st_mtim.tv_nsec &&
+	    e->ctime.tv_sec == sb->st_ctim.tv_sec &&
+	    e->ctime.tv_nsec == sb->st_ctim.tv_nsec);
+}
+
+static void
+hashcache_setkey(struct hashent *e, const struct stat *sb)
+{
+
+	e->dev = sb->st_dev;
+	e->ino = sb->st_ino;
+	e->size = sb->st_size;
+	e->mtime = sb->st_mtim;
+	e->ctime = sb->st_ctim;
+}
+
+static int
+hashcache_getnum(char **s, unsigned long long *val)
+{
+	char *cp, *end;
+
+	cp = proto_get_ascii(s);
+	if (cp == NULL)
+		return (-1);
+	errno = 0;
+	*val = strtoull(cp, &end, 10);
+	if (errno || *end != '\0')
+		return (-1);
+	return (0);
+}
+
+static void
+hashent_free(struct hashent *e)
+{
+
+	free(e->blocks);
+	free(e->path);
+	free(e);
+}
@@ -0,0 +1,48 @@
+/*-
+ * Copyright (c) 2012, Maxime Henrion <mux@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef _HASHCACHE_H_
+#define _HASHCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct hashcache;
+
+struct hashcache	*hashcache_open(const char *);
+int			 hashcache_save(struct hashcache *);
+void			 hashcache_free(struct hashcache *);
+int			 hashcache_samefile(const struct stat *,
+			     const struct stat *);
+int			 hashcache_getmd5(struct hashcache *, const char *,
+			     const struct stat *, char *);
+void			 hashcache_putmd5(struct hashcache *, const char *,
+			     const struct stat *, const char *);
+char			*hashcache_getblocks(struct hashcache *, const char *,
+			     const struct stat *, size_t *);
+void			 hashcache_putblocks(struct hashcache *, const char *,
+			     const struct stat *, size_t, const char *);
+
+#endif /* !_HASHCACHE_H_ */
@@ -0,0 +1,357 @@
+/*-
+ * Copyright (c) 2012, Maxime Henrion <mux@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hasher.h"
+#include "misc.h"
+#include "queue.h"
+
+/*
+ * A small pool of threads computing MD5 checksums of files, or of byte
+ * ranges of files.  Jobs are handed out in the order they have been
+ * submitted, but they may complete in any order; the caller waits for
+ * each of them individually, which lets it hash many files in parallel
+ * while still using the results in order.
+ *
+ * A job can also follow a file that is still being written: the writer
+ * tells the hasher how much of the file is ready with hashjob_extend(),
+ * and the checksum is computed in parallel, trailing the writer.
+ */
+
+#define	HASHER_MAXTHREADS	8
+#define	HASHER_BUFSIZE		(64 * 1024)
+
+struct hashjob {
+	struct hasher *hasher;
+	char *path;
+	off_t off;
+	off_t len;			/* Until EOF if negative. */
+	off_t size;			/* Number of bytes hashed. */
+	struct stat sb;			/* The file when it was opened. */
+	char md5[MD5_DIGEST_SIZE];
+	int follow;			/* The file is still growing. */
+	int final;			/* No more hashjob_extend() calls. */
+	int done;
+	int error;
+	STAILQ_ENTRY(hashjob) next;
+};
+
+struct hasher {
+	pthread_mutex_t lock;
+	pthread_cond_t newjob;
+	pthread_cond_t jobdone;
+	pthread_cond_t jobgrown;
+	STAILQ_HEAD(, hashjob) jobs;
+	int shutdown;
+	int nthreads;
+	pthread_t *threads;
+};
+
+static struct hashjob	*hasher_queue(struct hasher *, const char *, off_t,
+			     off_t, int);
+static void		*hasher_loop(void *);
+static int		 hasher_hash(struct hashjob *);
+static off_t		 hasher_waitdata(struct hashjob *);
+
+/*
+ * Create a hasher with "nthreads" threads, or as many threads as there
+ * are processors if it is 0.  Returns NULL if no thread could be started.
+ */
+struct hasher *
+hasher_new(int nthreads)
+{
+	struct hasher *h;
+	long ncpu;
+	int error, i;
+
+	if (nthreads <= 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? (int)min(ncpu, HASHER_MAXTHREADS) : 1;
+	}
+	h = xmalloc(sizeof(struct hasher));
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->newjob, NULL);
+	pthread_cond_init(&h->jobdone, NULL);
+	pthread_cond_init(&h->jobgrown, NULL);
+	STAILQ_INIT(&h->jobs);
+	h->shutdown = 0;
+	h->threads = xmalloc(nthreads * sizeof(pthread_t));
+	for (i = 0; i < nthreads; i++) {
+		error = pthread_create(&h->threads[i], NULL, hasher_loop, h);
+		if (error)
+			break;
+	}
+	h->nthreads = i;
+	if (h->nthreads == 0) {
+		hasher_free(h);
+		return (NULL);
+	}
+	return (h);
+}
+
+/* Stop the threads.  All the jobs must have been waited for. */
+void
+hasher_free(struct hasher *h)
+{
+	int i;
+
+	pthread_mutex_lock(&h->lock);
+	assert(STAILQ_EMPTY(&h->jobs));
+	h->shutdown = 1;
+	pthread_cond_broadcast(&h->newjob);
+	pthread_mutex_unlock(&h->lock);
+	for (i = 0; i < h->nthreads; i++)
+		pthread_join(h->threads[i], NULL);
+	pthread_cond_destroy(&h->jobgrown);
+	pthread_cond_destroy(&h->jobdone);
+	pthread_cond_destroy(&h->newjob);
+	pthread_mutex_destroy(&h->lock);
+	free(h->threads);
+	free(h);
+}
+
+/*
+ * Queue a job to compute the MD5 checksum of "len" bytes of the file at
+ * "path", starting at offset "off".  If "len" is negative, the checksum
+ * covers everything up to the end of the file.
+ */
+struct hashjob *
+hasher_submit(struct hasher *h, const char *path, off_t off, off_t len)
+{
+
+	return (hasher_queue(h, path, off, len, 0));
+}
+
+/*
+ * Queue a job to compute the MD5 checksum of a file that is still being
+ * written.  The hasher doesn't read past what has been announced with
+ * hashjob_extend(), and the job completes once the last call to it has
+ * been made and everything has been hashed.
+ */
+struct hashjob *
+hasher_follow(struct hasher *h, const char *path)
+{
+
+	return (hasher_queue(h, path, 0, 0, 1));
+}
+
+/*
+ * Tell the hasher that the first "size" bytes of the file followed by
+ * "job" are ready.  If "final" is set, the file is complete.
+ */
+void
+hashjob_extend(struct hashjob *job, off_t size, int final)
+{
+	struct hasher *h;
+
+	h = job->hasher;
+	pthread_mutex_lock(&h->lock);
+	assert(job->follow && !job->final);
+	if (size > job->len)
+		job->len = size;
+	job->final = final;
+	pthread_cond_broadcast(&h->jobgrown);
+	pthread_mutex_unlock(&h->lock);
+}
+
+static struct hashjob *
+hasher_queue(struct hasher *h, const char *path, off_t off, off_t len,
+    int follow)
+{
+	struct hashjob *job;
+
+	job = xmalloc(sizeof(struct hashjob));
+	job->hasher = h;
+	job->path = xstrdup(path);
+	job->off = off;
+	job->len = len;
+	job->size = 0;
+	job->follow = follow;
+	job->final = 0;
+	job->done = 0;
+	job->error = 0;
+	pthread_mutex_lock(&h->lock);
+	STAILQ_INSERT_TAIL(&h->jobs, job, next);
+	pthread_cond_signal(&h->newjob);
+	pthread_mutex_unlock(&h->lock);
+	return (job);
+}
+
+/*
+ * Wait for a job to complete and free it.  On success, the checksum is
+ * stored in "md5", which must point to a buffer of at least
+ * MD5_DIGEST_SIZE bytes, the number of bytes hashed in "sizep" and the
+ * attributes of the file before it was read in "sbp", if they aren't
+ * NULL.  Otherwise, -1 is returned and errno is set.
+ */
+int
+hashjob_wait(struct hashjob *job, char *md5, off_t *sizep,
+    struct stat *sbp)
+{
+	struct hasher *h;
+	int error;
+
+	h = job->hasher;
+	pthread_mutex_lock(&h->lock);
+	while (!job->done)
+		pthread_cond_wait(&h->jobdone, &h->lock);
+	pthread_mutex_unlock(&h->lock);
+	error = job->error;
+	if (!error) {
+		memcpy(md5, job->md5, MD5_DIGEST_SIZE);
+		if (sizep != NULL)
+			*sizep = job->size;
+		if (sbp != NULL)
+			*sbp = job->sb;
+	}
+	free(job->path);
+	free(job);
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+	return (0);
+}
+
+const char *
+hashjob_path(struct hashjob *job)
+{
+
+	return (job->path);
+}
+
+static void *
+hasher_loop(void *arg)
+{
+	struct hasher *h;
+	struct hashjob *job;
+	int error;
+
+	h = arg;
+	pthread_mutex_lock(&h->lock);
+	for (;;) {
+		while (STAILQ_EMPTY(&h->jobs) && !h->shutdown)
+			pthread_cond_wait(&h->newjob, &h->lock);
+		if (STAILQ_EMPTY(&h->jobs))
+			break;
+		job = STAILQ_FIRST(&h->jobs);
+		STAILQ_REMOVE_HEAD(&h->jobs, next);
+		pthread_mutex_unlock(&h->lock);
+		error = hasher_hash(job);
+		pthread_mutex_lock(&h->lock);
+		job->error = error;
+		job->done = 1;
+		pthread_cond_broadcast(&h->jobdone);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return (NULL);
+}
+
+/* Do the actual work for a job, returning an errno value. */
+static int
+hasher_hash(struct hashjob *job)
+{
+	MD5_CTX ctx;
+	char *buf;
+	off_t len, off;
+	ssize_t n;
+	size_t resid;
+	int error, fd;
+
+	fd = open(job->path, O_RDONLY);
+	if (fd == -1)
+		return (errno);
+	/*
+	 * Taken before reading, so that if the file changes while we are
+	 * hashing it, it won't match this anymore.
+	 */
+	if (fstat(fd, &job->sb) == -1) {
+		error = errno;
+		close(fd);
+		return (error);
+	}
+	buf = xmalloc(HASHER_BUFSIZE);
+	MD5_Init(&ctx);
+	off = job->off;
+	len = job->follow ? hasher_waitdata(job) : job->len;
+	error = 0;
+	for (;;) {
+		resid = HASHER_BUFSIZE;
+		if (len >= 0) {
+			if (job->size == len && job->follow)
+				len = hasher_waitdata(job);
+			if (job->size == len)
+				break;
+			resid = min((off_t)resid, len - job->size);
+		}
+		n = pread(fd, buf, resid, off);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			error = errno;
+			break;
+		}
+		if (n == 0)
+			break;
+		MD5_Update(&ctx, buf, n);
+		job->size += n;
+		off += n;
+	}
+	free(buf);
+	close(fd);
+	if (!error)
+		MD5_End(job->md5, &ctx);
+	return (error);
+}
+
+/*
+ * Wait until there is something more to hash in the file followed by
+ * "job", or until it is complete, and return how much of it is ready.
+ */
+static off_t
+hasher_waitdata(struct hashjob *job)
+{
+	struct hasher *h;
+	off_t len;
+
+	h = job->hasher;
+	pthread_mutex_lock(&h->lock);
+	while (job->len == job->size && !job->final)
+		pthread_cond_wait(&h->jobgrown, &h->lock);
+	len = job->len;
+	pthread_mutex_unlock(&h->lock);
+	return (len);
+}
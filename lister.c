@@ -33,6 +33,7 @@
 
 #include "attrstack.h"
 #include "config.h"
+#include "dircache.h"
 #include "fattr.h"
 #include "globtree.h"
 #include "lister.h"
@@ -49,6 +50,7 @@
 struct lister {
 	struct config *config;
 	struct stream *wr;
+	struct dircache *dircache;	/* For the current collection. */
 	char *errmsg;
 };
 
@@ -64,6 +66,7 @@ static int	lister_dodead(struct lister *, struct coll *,
 		    struct statusrec *);
 static int	lister_dorcs(struct lister *, struct coll *,
 		    struct statusrec *, int);
+static struct fattr	*lister_getattr(struct lister *, const char *, int);
 
 void *
 lister(void *arg)
@@ -76,6 +79,7 @@ lister(void *arg)
 	l = &lbuf;
 	l->config = args->config;
 	l->wr = args->wr;
+	l->dircache = NULL;
 	l->errmsg = NULL;
 
 #ifdef LISTER_DEBUG
@@ -110,12 +114,15 @@ lister_batch(struct lister *l)
 {
 	struct config *config;
 	struct stream *wr;
+	struct stream_zopts zopts;
 	struct status *st;
 	struct coll *coll;
 	int error;
 
 	config = l->config;
 	wr = l->wr;
+	zopts.threaded = config->zthreaded;
+	zopts.backlog = (stream_backlogfn_t *)chan_backlog;
 	STAILQ_FOREACH(coll, &config->colls, co_next) {
 		if (coll->co_options & CO_SKIP)
 			continue;
@@ -127,9 +134,14 @@ lister_batch(struct lister *l)
 		if (error)
 			return (LISTER_ERR_WRITE);
 		stream_flush(wr);
-		if (coll->co_options & CO_COMPRESS)
-			stream_filter_start(wr, STREAM_FILTER_ZLIB, NULL);
+		if (coll->co_options & CO_COMPRESS) {
+			zopts.level = coll->co_zlevel;
+			stream_filter_start(wr, STREAM_FILTER_ZLIB, &zopts);
+		}
+		l->dircache = dircache_new();
 		error = lister_coll(l, coll, st);
+		dircache_free(l->dircache);
+		l->dircache = NULL;
 		status_close(st, NULL);
 		if (error)
 			return (error);
@@ -247,7 +259,7 @@ lister_dodirdown(struct lister *l, struct coll *coll, struct statusrec *sr,
 		fa = fattr_new(FT_DIRECTORY, -1);
 	} else {
 		xasprintf(&path, "%s/%s", coll->co_prefix, sr->sr_file);
-		fa = fattr_frompath(path, FATTR_NOFOLLOW);
+		fa = lister_getattr(l, path, FATTR_NOFOLLOW);
 		if (fa == NULL) {
 			/* The directory doesn't exist, prune
 			 * everything below it. */
@@ -255,7 +267,7 @@ lister_dodirdown(struct lister *l, struct coll *coll, struct statusrec *sr,
 			return (1);
 		}
 		if (fattr_type(fa) == FT_SYMLINK) {
-			fa2 = fattr_frompath(path, FATTR_FOLLOW);
+			fa2 = lister_getattr(l, path, FATTR_FOLLOW);
 			if (fa2 != NULL && fattr_type(fa2) == FT_DIRECTORY) {
 				/* XXX - When not in checkout mode, CVSup warns
 				 * here about the file being a symlink to a
@@ -352,7 +364,7 @@ lister_dofile(struct lister *l, struct coll *coll, struct statusrec *sr)
 			free(spath);
 			return (LISTER_ERR_STATUS);
 		}
-		rfa = fattr_frompath(path, FATTR_NOFOLLOW);
+		rfa = lister_getattr(l, path, FATTR_NOFOLLOW);
 		free(path);
 		if (rfa == NULL) {
 			/*
@@ -424,7 +436,7 @@ lister_dodead(struct lister *l, struct coll *coll, struct statusrec *sr)
 			free(spath);
 			return (LISTER_ERR_STATUS);
 		}
-		fa = fattr_frompath(path, FATTR_NOFOLLOW);
+		fa = lister_getattr(l, path, FATTR_NOFOLLOW);
 		free(path);
 		if (fa != NULL && fattr_type(fa) != FT_DIRECTORY) {
 			/*
@@ -488,7 +500,7 @@ lister_dorcs(struct lister *l, struct coll *coll, struct statusrec *sr,
 			free(spath);
 			return (LISTER_ERR_STATUS);
 		}
-		fa = fattr_frompath(path, FATTR_NOFOLLOW);
+		fa = lister_getattr(l, path, FATTR_NOFOLLOW);
 		free(path);
 		if (fa == NULL) {
 			/*
@@ -531,3 +543,24 @@ lister_dorcs(struct lister *l, struct coll *coll, struct statusrec *sr,
 		return (LISTER_ERR_WRITE);
 	return (0);
 }
+
+/*
+ * Get the attributes of a file relative to its directory in the cache.
+ * The updater may have removed and recreated that directory since we
+ * opened it, so if the file can't be found, make sure that isn't why.
+ */
+static struct fattr *
+lister_getattr(struct lister *l, const char *path, int nofollow)
+{
+	struct fattr *fa;
+	const char *name;
+	int dirfd;
+
+	dirfd = dircache_lookup(l->dircache, path, &name);
+	fa = fattr_frompathat(dirfd, name, nofollow);
+	if (fa == NULL && errno == ENOENT && dircache_stale(l->dircache)) {
+		dirfd = dircache_lookup(l->dircache, path, &name);
+		fa = fattr_frompathat(dirfd, name, nofollow);
+	}
+	return (fa);
+}
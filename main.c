@@ -40,6 +40,7 @@
 #include "config.h"
 #include "fattr.h"
 #include "misc.h"
+#include "mux.h"
 #include "proto.h"
 #include "stream.h"
 
@@ -81,13 +82,19 @@ usage(char *argv0)
 	    "Lock file during update; fail if already locked");
 	lprintf(-1, USAGE_OPTFMT, "-L n",
 	    "Verbosity level (0..2, default 1)");
+	lprintf(-1, USAGE_OPTFMT, "-M backend",
+	    "Multiplexer backend: \"threads\" (default) or \"evloop\"");
 	lprintf(-1, USAGE_OPTFMT, "-p port",
 	    "Alternate server port (default 5999)");
 	lprintf(-1, USAGE_OPTFMT, "-r n",
 	    "Maximum retries on transient errors (default unlimited)");
 	lprintf(-1, USAGE_OPTFMT, "-s",
 	    "Don't stat client files; trust the checkouts file");
+	lprintf(-1, USAGE_OPTFMT, "-t",
+	    "Run compression on separate threads");
 	lprintf(-1, USAGE_OPTFMT, "-v", "Print version and exit");
+	lprintf(-1, USAGE_OPTFMT, "-W size",
+	    "Multiplexer window size in KB (default autotuned)");
 	lprintf(-1, USAGE_OPTFMT, "-z", "Enable compression for all "
 	    "collections");
 	lprintf(-1, USAGE_OPTFMT, "-Z", "Disable compression for all "
@@ -107,7 +114,8 @@ main(int argc, char *argv[])
 	struct stream *lock;
 	char *argv0, *file, *lockfile;
 	int family, error, lockfd, lflag, overridemask;
-	int c, i, deletelim, port, retries, status, reqauth;
+	int c, i, deletelim, port, retries, status, reqauth, winsize;
+	int muxbackend, zthreaded;
 	time_t nexttry;
 
 	error = 0;
@@ -125,9 +133,12 @@ main(int argc, char *argv[])
 	override = coll_new(NULL);
 	overridemask = 0;
 	reqauth = 0;
+	winsize = 0;
+	muxbackend = MUX_BACKEND_THREADS;
+	zthreaded = 0;
 
 	while ((c = getopt(argc, argv,
-	    "146aA:b:c:d:gh:i:kl:L:p:P:r:svzZ")) != -1) {
+	    "146aA:b:c:d:gh:i:kl:L:M:p:P:r:stvW:zZ")) != -1) {
 		switch (c) {
 		case '1':
 			retries = 0;
@@ -220,6 +231,17 @@ main(int argc, char *argv[])
 				return (1);
 			}
 			break;
+		case 'M':
+			if (strcmp(optarg, "threads") == 0)
+				muxbackend = MUX_BACKEND_THREADS;
+			else if (strcmp(optarg, "evloop") == 0)
+				muxbackend = MUX_BACKEND_EVLOOP;
+			else {
+				lprintf(-1, "Invalid multiplexer backend\n");
+				usage(argv0);
+				return (1);
+			}
+			break;
 		case 'p':
 			/* Use specified server port. */
 			error = asciitoint(optarg, &port, 0);
@@ -258,6 +280,10 @@ main(int argc, char *argv[])
 			override->co_options |= CO_TRUSTSTATUSFILE;
 			overridemask |= CO_TRUSTSTATUSFILE;
 			break;
+		case 't':
+			/* Run zlib on separate threads. */
+			zthreaded = 1;
+			break;
 		case 'v':
 			lprintf(0, "CVSup client written in C\n");
 			lprintf(0, "Software version: %s\n", PROTO_SWVER);
@@ -265,6 +291,15 @@ main(int argc, char *argv[])
 			    PROTO_MAJ, PROTO_MIN);
 			return (0);
 			break;
+		case 'W':
+			error = asciitoint(optarg, &winsize, 0);
+			if (error || winsize <= 0 ||
+			    winsize > MUX_MAXWINSIZE / 1024) {
+				lprintf(-1, "Invalid window size\n");
+				usage(argv0);
+				return (1);
+			}
+			break;
 		case 'z':
 			/* Force compression on all collections. */
 			override->co_options |= CO_COMPRESS;
@@ -307,6 +342,9 @@ main(int argc, char *argv[])
 		config->laddrlen = laddrlen;
 	}
 	config->deletelim = deletelim;
+	config->winsize = (size_t)winsize * 1024;
+	config->muxbackend = muxbackend;
+	config->zthreaded = zthreaded;
 	config->reqauth = reqauth;
 	lprintf(2, "Connecting to %s\n", config->host);
 
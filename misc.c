@@ -58,6 +58,9 @@ struct backoff_timer {
 	float jitter;
 };
 
+/* Read size used by MD5_File(), large enough to keep syscalls cheap. */
+#define	MD5_FILE_BUFSIZE	(64 * 1024)
+
 static void	bt_update(struct backoff_timer *);
 static void	bt_addjitter(struct backoff_timer *);
 
@@ -109,7 +112,7 @@ lprintf(int level, const char *fmt, ...)
 int
 MD5_File(char *path, char *md, off_t *sizep)
 {
-	char buf[1024];
+	char *buf;
 	MD5_CTX ctx;
 	off_t size;
 	ssize_t n;
@@ -118,12 +121,14 @@ MD5_File(char *path, char *md, off_t *sizep)
 	fd = open(path, O_RDONLY);
 	if (fd == -1)
 		return (-1);
+	buf = xmalloc(MD5_FILE_BUFSIZE);
 	size = 0;
 	MD5_Init(&ctx);
-	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+	while ((n = read(fd, buf, MD5_FILE_BUFSIZE)) > 0) {
 		MD5_Update(&ctx, buf, n);
 		size += n;
 	}
+	free(buf);
 	close(fd);
 	if (n == -1)
 		return (-1);
@@ -421,6 +426,82 @@ tempname(const char *path)
 	return (temp);
 }
 
+/*
+ * Flush the contents of the file at "path" to stable storage.  If
+ * "dataonly" is set, only the metadata needed to read the data back is
+ * flushed, as with fdatasync(2).
+ */
+int
+syncfile(const char *path, int dataonly)
+{
+	int error, fd, saved_errno;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if (dataonly)
+		error = fdatasync(fd);
+	else
+		error = fsync(fd);
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return (error);
+}
+
+/* Make the directory entry for "path" stable. */
+int
+syncdir(const char *path)
+{
+	char *dir, *cp;
+	int error;
+
+	dir = xstrdup(path);
+	cp = strrchr(dir, '/');
+	if (cp == NULL) {
+		free(dir);
+		dir = xstrdup(".");
+	} else if (cp == dir) {
+		cp[1] = '\0';
+	} else {
+		*cp = '\0';
+	}
+	error = syncfile(dir, 0);
+	free(dir);
+	return (error);
+}
+
+/*
+ * Return a path that refers to the file open on "fd", even if it has no
+ * name.  This needs the Linux /proc file system.
+ */
+char *
+fdpath(int fd)
+{
+	char *path;
+
+	xasprintf(&path, "/proc/self/fd/%d", fd);
+	return (path);
+}
+
+/*
+ * Give a name to the file open on "fd", which may be an anonymous file
+ * created with O_TMPFILE.  Like link(2), this fails if "path" exists.
+ */
+int
+linkfd(int fd, const char *path)
+{
+	char *from;
+	int error, saved_errno;
+
+	from = fdpath(fd);
+	error = linkat(AT_FDCWD, from, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+	saved_errno = errno;
+	free(from);
+	errno = saved_errno;
+	return (error);
+}
+
 void *
 xmalloc(size_t size)
 {
@@ -130,6 +130,10 @@ char		*path_prefix(char *);
 char		*path_first(char *);
 int		 mkdirhier(char *, mode_t);
 char		*tempname(const char *);
+int		 syncfile(const char *, int);
+int		 syncdir(const char *);
+char		*fdpath(int);
+int		 linkfd(int, const char *);
 void		*xmalloc(size_t);
 void		*xrealloc(void *, size_t);
 char		*xstrdup(const char *);
@@ -28,10 +28,22 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -127,18 +139,74 @@ struct mux_header {
 #define	CF_DATA			0x10
 #define	CF_CLOSE		0x20
 
-#define	CHAN_SBSIZE		(16 * 1024)	/* Send buffer size. */
-#define	CHAN_RBSIZE		(16 * 1024)	/* Receive buffer size. */
-#define	CHAN_MAXSEGSIZE		1024		/* Maximum segment size. */
+#define	CHAN_SBSIZE		(16 * 1024)	/* Initial send buffer size. */
+#define	CHAN_RBSIZE		(16 * 1024)	/* Initial receive buffer size. */
+#define	CHAN_MAXBUFSIZE		MUX_MAXWINSIZE	/* Autotuning limit. */
+#define	CHAN_MAXSEGSIZE		65535		/* Maximum segment size. */
+#define	CHAN_DEFRTT		100000		/* Fallback RTT (usecs). */
+#define	CHAN_WINDELAY		20000		/* Window update delay (usecs). */
+
+/* Size of the receiver's staging buffer, enough for two full frames. */
+#define	RECEIVER_BUFSIZE	(2 * (MUX_DATAHDRSZ + CHAN_MAXSEGSIZE))
+
+/* Maximum number of iovecs the sender gathers for a single writev(). */
+#if defined(IOV_MAX) && IOV_MAX < 128
+#define	SENDER_MAXIOV		IOV_MAX
+#else
+#define	SENDER_MAXIOV		128
+#endif
+
+/* Per-channel statistics, reported by mux_report(). */
+struct chan_stats {
+	off_t		bytes_sent;
+	off_t		bytes_recv;
+	unsigned long	segs_sent;
+	unsigned long	segs_recv;
+	unsigned long	winsent;
+	unsigned long	winsuppressed;
+	size_t		recv_hiwat;	/* Receive buffer high-water mark. */
+	struct timeval	rdblocked;	/* Reader waiting for data. */
+	struct timeval	wrblocked;	/* Writer waiting for buffer space. */
+	struct timeval	winstalled;	/* Data pending on a closed window. */
+};
 
-/* Circular buffer. */
+/*
+ * Circular buffer, used as a single-producer/single-consumer ring.  The
+ * producer only writes "in" and the free space after it, the consumer
+ * only "out" and the bytes before "in", and both indexes are accessed
+ * atomically so that neither side needs the channel lock to move data.
+ * See buf_enter() for how the autotuning code grows it.
+ */
 struct buf {
 	uint8_t *data;
 	size_t size;
 	size_t in;
 	size_t out;
+	int growing;		/* Being grown, under the channel lock. */
+	int busy;		/* In use by the side that doesn't grow it. */
+};
+
+/*
+ * Eventcount for the thread waiting on one side of a buffer.  A waiter
+ * calls waitq_prepare(), checks its condition again, and only then goes
+ * to sleep in waitq_wait(), so a waitq_wakeup() coming in between isn't
+ * lost.  Wakeups cost a single atomic load when nobody waits.
+ */
+struct waitq {
+	unsigned int	seq;
+	unsigned int	waiters;
+#ifndef __linux__
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+#endif
 };
 
+/*
+ * The channel lock protects everything but the data in the buffers.
+ * The fields that chan_read() and chan_write() look at without it are
+ * only written with atomic stores: the state, recvseq, recvadv,
+ * windelayed and sendpend.
+ */
 struct chan {
 	int		flags;
 	int		state;
@@ -147,22 +215,43 @@ struct chan {
 
 	/* Receiver state variables. */
 	struct buf	*recvbuf;
-	pthread_cond_t	rdready;
+	struct waitq	rdwait;		/* Reader waiting for data. */
+	pthread_cond_t	rdready;	/* For chan_accept() and chan_wait(). */
 	uint32_t	recvseq;
 	uint16_t	recvmss;
 
+	/* Delayed window updates. */
+	uint32_t	recvadv;	/* Last window we advertised. */
+	int		windelayed;
+	struct timeval	windeadline;
+	unsigned long	winskipped;	/* Suppressed without the lock. */
+
+	/* Statistics. */
+	struct chan_stats stats;
+	int		stalled;
+	struct timeval	stallstart;
+
+	/* Receive window autotuning. */
+	struct timeval	rttstart;
+	size_t		rttbytes;
+	long		rtt;
+
 	/* Sender state variables. */
 	struct buf	*sendbuf;
-	pthread_cond_t	wrready;
+	struct waitq	wrwait;		/* Writer waiting for space. */
+	pthread_cond_t	wrready;	/* For chan_connect(). */
 	uint32_t	sendseq;
 	uint32_t	sendwin;
 	uint16_t	sendmss;
+	size_t		sendpend;	/* Bytes queued by the sender. */
 };
 
 struct mux {
 	int		closed;
 	int		status;
 	int		socket;
+	size_t		winsize;	/* Fixed window, or 0 to autotune. */
+	struct timeval	started;
 	pthread_mutex_t	lock;
 	pthread_cond_t	done;
 	struct chan	*channels[MUX_MAXCHAN];
@@ -175,9 +264,18 @@ struct mux {
 	int		sender_waiting;
 	int		sender_ready;
 	int		sender_lastid;
+	int		sender_delayed;
+	struct timeval	sender_deadline;
 
 	/* Receiver thread data. */
 	pthread_t	receiver;
+	uint8_t		*receiver_buf;
+
+	/* Event loop data, only used by MUX_BACKEND_EVLOOP. */
+	int		backend;
+	int		evloop_wakefd[2];	/* Read and write ends. */
+	int		evloop_pollfd;
+	int		evloop_out;
 };
 
 static int		 sock_writev(int, struct iovec *, int);
@@ -185,7 +283,9 @@ static int		 sock_write(int, void *, size_t);
 static ssize_t		 sock_read(int, void *, size_t);
 static int		 sock_readwait(int, void *, size_t);
 
-static int		 mux_init(struct mux *);
+static struct mux	*mux_new(int, int, size_t);
+static int		 mux_init(struct mux *, int);
+static long		 mux_rtt(struct mux *);
 static void		 mux_lock(struct mux *);
 static void		 mux_unlock(struct mux *);
 
@@ -196,21 +296,58 @@ static void		 chan_lock(struct chan *);
 static void		 chan_unlock(struct chan *);
 static int		 chan_insert(struct mux *, struct chan *);
 static void		 chan_free(struct chan *);
+static void		 chan_setstate(struct chan *, int);
+static void		 chan_waitstat(struct chan *, struct waitq *,
+			     unsigned int, struct timeval *);
+static void		 chan_unstall(struct chan *);
+static int		 chan_rcvtune(struct chan *, size_t);
+static void		 chan_sndtune(struct chan *);
+static int		 chan_winupdate(struct chan *);
+static int		 chan_winskip(struct chan *);
 
 static struct buf	*buf_new(size_t);
 static size_t		 buf_count(struct buf *);
 static size_t		 buf_avail(struct buf *);
-static void		 buf_get(struct buf *, void *, size_t);
-static void		 buf_put(struct buf *, const void *, size_t);
+static void		 buf_copyout(struct buf *, size_t, void *, size_t);
+static void		 buf_copyin(struct buf *, size_t, const void *, size_t);
+static void		 buf_less(struct buf *, size_t);
+static void		 buf_more(struct buf *, size_t);
+static void		 buf_grow(struct buf *, size_t);
+static int		 buf_trygrow(struct buf *, size_t);
+static int		 buf_enter(struct buf *);
+static void		 buf_leave(struct buf *);
+static size_t		 buf_newsize(size_t, size_t);
 static void		 buf_free(struct buf *);
 
+static void		 waitq_init(struct waitq *);
+static void		 waitq_fini(struct waitq *);
+static unsigned int	 waitq_prepare(struct waitq *);
+static void		 waitq_cancel(struct waitq *);
+static void		 waitq_wait(struct waitq *, unsigned int);
+static void		 waitq_wakeup(struct waitq *);
+
 static void		 sender_wakeup(struct mux *);
 static void		*sender_loop(void *);
+static int		 sender_gather(struct mux *, int, int,
+			     struct mux_header *, struct iovec *);
+static int		 sender_frame(struct chan *, int, int,
+			     struct mux_header *, struct iovec *);
+static void		 sender_release(struct mux *);
 static int		 sender_waitforwork(struct mux *, int *);
 static int		 sender_scan(struct mux *, int *);
 static void		 sender_cleanup(void *);
 
 static void		*receiver_loop(void *);
+static ssize_t		 receiver_frame(struct mux *, const uint8_t *, size_t);
+static int		 receiver_process(struct mux *, size_t *);
+
+static int		 evloop_init(struct mux *);
+static void		 evloop_fini(struct mux *);
+static void		*evloop_loop(void *);
+static int		 evloop_wait(struct mux *, int, int, int *);
+static int		 evloop_write(struct mux *, struct iovec *, int *, int);
+static void		 evloop_wakeup(struct mux *);
+static void		 evloop_drain(struct mux *);
 
 static int
 sock_writev(int s, struct iovec *iov, int iovcnt)
@@ -300,41 +437,95 @@ mux_unlock(struct mux *m)
 	assert(!error);
 }
 
-/* Create a TCP multiplexer on the given socket. */
+/*
+ * Create a TCP multiplexer on the given socket.  The "backend" parameter
+ * selects how the socket is driven: MUX_BACKEND_THREADS uses a sender
+ * and a receiver thread doing blocking I/O, while MUX_BACKEND_EVLOOP
+ * uses a single thread running an event loop on the non-blocking socket.
+ *
+ * If "winsize" is not 0, it is used as a fixed size for the channel
+ * buffers, and thus for the window we advertise.  Otherwise, the buffers
+ * are grown as needed to match the bandwidth-delay product of the
+ * connection.
+ */
+struct mux *
+mux_open(int sock, int backend, size_t winsize, struct chan **chan)
+{
+	struct mux *m;
+	struct chan *chan0;
+	int error;
+
+	m = mux_new(sock, backend, winsize);
+	error = mux_init(m, 0);
+	if (error)
+		goto bad;
+	chan0 = chan_connect(m, 0);
+	if (chan0 == NULL)
+		goto bad;
+	*chan = chan0;
+	return (m);
+bad:
+	mux_shutdown(m, NULL, STATUS_FAILURE);
+	(void)mux_close(m);
+	return (NULL);
+}
+
+/*
+ * Same as mux_open(), but for the server end of the connection: wait for
+ * the client to start the multiplexer and to connect to channel 0.  This
+ * is not used by csup itself, but allows running both ends of a
+ * multiplexer in the same process for testing and benchmarking.
+ */
 struct mux *
-mux_open(int sock, struct chan **chan)
+mux_accept(int sock, int backend, size_t winsize, struct chan **chan)
 {
 	struct mux *m;
 	struct chan *chan0;
 	int error;
 
+	m = mux_new(sock, backend, winsize);
+	error = mux_init(m, 1);
+	if (error)
+		goto bad;
+	chan0 = chan_accept(m, 0);
+	if (chan0 == NULL)
+		goto bad;
+	*chan = chan0;
+	return (m);
+bad:
+	mux_shutdown(m, NULL, STATUS_FAILURE);
+	(void)mux_close(m);
+	return (NULL);
+}
+
+static struct mux *
+mux_new(int sock, int backend, size_t winsize)
+{
+	struct mux *m;
+
 	m = xmalloc(sizeof(struct mux));
 	memset(m->channels, 0, sizeof(m->channels));
 	m->nchans = 0;
 	m->closed = 0;
 	m->status = -1;
 	m->socket = sock;
+	m->winsize = min(winsize, MUX_MAXWINSIZE);
+	gettimeofday(&m->started, NULL);
 
 	m->sender_waiting = 0;
 	m->sender_lastid = 0;
 	m->sender_ready = 0;
+	m->sender_delayed = 0;
+	m->receiver_buf = xmalloc(RECEIVER_BUFSIZE);
+	m->backend = backend;
+	m->evloop_wakefd[0] = m->evloop_wakefd[1] = -1;
+	m->evloop_pollfd = -1;
+	m->evloop_out = 0;
 	pthread_mutex_init(&m->lock, NULL);
 	pthread_cond_init(&m->done, NULL);
 	pthread_cond_init(&m->sender_newwork, NULL);
 	pthread_cond_init(&m->sender_started, NULL);
-
-	error = mux_init(m);
-	if (error)
-		goto bad;
-	chan0 = chan_connect(m, 0);
-	if (chan0 == NULL)
-		goto bad;
-	*chan = chan0;
 	return (m);
-bad:
-	mux_shutdown(m, NULL, STATUS_FAILURE);
-	(void)mux_close(m);
-	return (NULL);
 }
 
 int
@@ -346,18 +537,100 @@ mux_close(struct mux *m)
 	assert(m->closed);
 	for (i = 0; i < m->nchans; i++) {
 		chan = m->channels[i];
-		if (chan != NULL)
-			chan_free(chan);
+		if (chan == NULL)
+			continue;
+		chan_free(chan);
 	}
 	pthread_cond_destroy(&m->sender_started);
 	pthread_cond_destroy(&m->sender_newwork);
 	pthread_cond_destroy(&m->done);
 	pthread_mutex_destroy(&m->lock);
+	evloop_fini(m);
+	free(m->receiver_buf);
 	status = m->status;
 	free(m);
 	return (status);
 }
 
+/*
+ * Print the statistics of every channel at the given verbosity level.
+ * This can be called at any time, notably from the signal handling
+ * thread while the multiplexer is running.
+ */
+void
+mux_report(struct mux *m, int level)
+{
+	struct chan_stats st;
+	struct timeval now, uptime;
+	struct chan *chan;
+	size_t rbsize, sbsize;
+	int i;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &m->started, &uptime);
+	mux_lock(m);
+	lprintf(level, "Multiplexer statistics after %ld.%03lds:\n",
+	    (long)uptime.tv_sec, (long)uptime.tv_usec / 1000);
+	for (i = 0; i < m->nchans; i++) {
+		chan = m->channels[i];
+		chan_lock(chan);
+		st = chan->stats;
+		st.winsuppressed += __atomic_load_n(&chan->winskipped,
+		    __ATOMIC_RELAXED);
+		if (chan->stalled) {
+			/* Account for the ongoing stall as well. */
+			timersub(&now, &chan->stallstart, &uptime);
+			timeradd(&st.winstalled, &uptime, &st.winstalled);
+		}
+		rbsize = chan->recvbuf->size;
+		sbsize = chan->sendbuf->size;
+		chan_unlock(chan);
+		lprintf(level, "  Channel %d: sent %lld bytes in %lu segments, "
+		    "received %lld bytes in %lu segments\n", i,
+		    (long long)st.bytes_sent, st.segs_sent,
+		    (long long)st.bytes_recv, st.segs_recv);
+		lprintf(level, "  Channel %d: %lu window updates sent, "
+		    "%lu delayed or suppressed\n", i, st.winsent,
+		    st.winsuppressed);
+		lprintf(level, "  Channel %d: receive buffer %lu bytes "
+		    "(high-water mark %lu), send buffer %lu bytes\n", i,
+		    (unsigned long)rbsize, (unsigned long)st.recv_hiwat,
+		    (unsigned long)sbsize);
+		lprintf(level, "  Channel %d: blocked %ld.%03lds reading, "
+		    "%ld.%03lds writing, %ld.%03lds on the peer's window\n", i,
+		    (long)st.rdblocked.tv_sec,
+		    (long)st.rdblocked.tv_usec / 1000,
+		    (long)st.wrblocked.tv_sec,
+		    (long)st.wrblocked.tv_usec / 1000,
+		    (long)st.winstalled.tv_sec,
+		    (long)st.winstalled.tv_usec / 1000);
+	}
+	mux_unlock(m);
+}
+
+/*
+ * Return the number of data segments sent and received so far on all
+ * the channels, for benchmarking purposes.
+ */
+void
+mux_segments(struct mux *m, unsigned long *sent, unsigned long *recv)
+{
+	struct chan *chan;
+	int i;
+
+	*sent = 0;
+	*recv = 0;
+	mux_lock(m);
+	for (i = 0; i < m->nchans; i++) {
+		chan = m->channels[i];
+		chan_lock(chan);
+		*sent += chan->stats.segs_sent;
+		*recv += chan->stats.segs_recv;
+		chan_unlock(chan);
+	}
+	mux_unlock(m);
+}
+
 /* Close a channel. */
 int
 chan_close(struct chan *chan)
@@ -365,10 +638,10 @@ chan_close(struct chan *chan)
 
 	chan_lock(chan);
 	if (chan->state == CS_ESTABLISHED) {
-		chan->state = CS_WRCLOSED;
+		chan_setstate(chan, CS_WRCLOSED);
 		chan->flags |= CF_CLOSE;
 	} else if (chan->state == CS_RDCLOSED) {
-		chan->state = CS_CLOSED;
+		chan_setstate(chan, CS_CLOSED);
 		chan->flags |= CF_CLOSE;
 	} else if (chan->state == CS_WRCLOSED || chan->state == CS_CLOSED) {
 		chan_unlock(chan);
@@ -382,6 +655,21 @@ chan_close(struct chan *chan)
 	return (0);
 }
 
+/*
+ * Returns how full the send buffer of the channel is, in percent.  If
+ * it stays mostly full, the network link is what limits the throughput.
+ */
+int
+chan_backlog(struct chan *chan)
+{
+	int pct;
+
+	chan_lock(chan);
+	pct = buf_count(chan->sendbuf) * 100 / chan->sendbuf->size;
+	chan_unlock(chan);
+	return (pct);
+}
+
 void
 chan_wait(struct chan *chan)
 {
@@ -405,7 +693,7 @@ chan_listen(struct mux *m)
 		chan_lock(chan);
 		if (chan->state == CS_UNUSED) {
 			mux_unlock(m);
-			chan->state = CS_LISTENING;
+			chan_setstate(chan, CS_LISTENING);
 			chan_unlock(chan);
 			return (i);
 		}
@@ -437,38 +725,73 @@ chan_accept(struct mux *m, int id)
 	return (chan);
 }
 
-/* Read bytes from a channel. */
+/*
+ * Read bytes from a channel.
+ *
+ * Each channel has exactly one reader and one writer, and the receive
+ * and send buffers are single-producer/single-consumer rings, so as long
+ * as there is data to read or room to write, chan_read() and chan_write()
+ * copy the bytes and publish the new index without taking the channel
+ * lock.  They only take it to look at the channel state before going to
+ * sleep on their wait queue, and the threads at the other end of the
+ * buffers only wake them up when it stops being empty or full.
+ */
 ssize_t
 chan_read(struct chan *chan, void *buf, size_t size)
 {
-	char *cp;
+	struct buf *rbuf;
+	unsigned int key;
 	size_t count, n;
+	int skip, state, wakeup;
 
-	cp = buf;
-	chan_lock(chan);
+	rbuf = chan->recvbuf;
 	for (;;) {
-		if (chan->state == CS_RDCLOSED || chan->state == CS_CLOSED) {
+		if (!buf_enter(rbuf)) {
+			/* Wait for the receiver to be done growing it. */
+			chan_lock(chan);
 			chan_unlock(chan);
+			continue;
+		}
+		/* Hand out what we still have before reporting EOF. */
+		count = buf_count(rbuf);
+		if (count > 0)
+			break;
+		buf_leave(rbuf);
+		key = waitq_prepare(&chan->rdwait);
+		chan_lock(chan);
+		count = buf_count(rbuf);
+		state = chan->state;
+		chan_unlock(chan);
+		if (count > 0) {
+			waitq_cancel(&chan->rdwait);
+			continue;
+		}
+		if (state == CS_RDCLOSED || state == CS_CLOSED) {
+			waitq_cancel(&chan->rdwait);
 			return (0);
 		}
-		if (chan->state != CS_ESTABLISHED &&
-		    chan->state != CS_WRCLOSED) {
-			chan_unlock(chan);
+		if (state != CS_ESTABLISHED && state != CS_WRCLOSED) {
+			waitq_cancel(&chan->rdwait);
 			errno = EBADF;
 			return (-1);
 		}
-		count = buf_count(chan->recvbuf);
-		if (count > 0)
-			break;
-		pthread_cond_wait(&chan->rdready, &chan->lock);
+		chan_waitstat(chan, &chan->rdwait, key,
+		    &chan->stats.rdblocked);
 	}
 	n = min(count, size);
-	buf_get(chan->recvbuf, cp, n);
-	chan->recvseq += n;
-	chan->flags |= CF_WINDOW;
+	buf_copyout(rbuf, rbuf->out, buf, n);
+	buf_less(rbuf, n);
+	__atomic_store_n(&chan->recvseq, chan->recvseq + n, __ATOMIC_SEQ_CST);
+	skip = chan_winskip(chan);
+	buf_leave(rbuf);
+	if (skip)
+		return (n);
+	chan_lock(chan);
+	wakeup = chan_winupdate(chan);
 	chan_unlock(chan);
-	/* We need to wake up the sender so that it sends a window update. */
-	sender_wakeup(chan->mux);
+	/* We may need to wake up the sender to send a window update. */
+	if (wakeup)
+		sender_wakeup(chan->mux);
 	return (n);
 }
 
@@ -476,31 +799,61 @@ chan_read(struct chan *chan, void *buf, size_t size)
 ssize_t
 chan_write(struct chan *chan, const void *buf, size_t size)
 {
+	struct buf *sbuf;
 	const char *cp;
+	unsigned int key;
 	size_t avail, n, pos;
+	int idle, state;
 
 	pos = 0;
 	cp = buf;
-	chan_lock(chan);
+	sbuf = chan->sendbuf;
 	while (pos < size) {
-		for (;;) {
-			if (chan->state != CS_ESTABLISHED &&
-			    chan->state != CS_RDCLOSED) {
-				chan_unlock(chan);
-				errno = EPIPE;
-				return (-1);
-			}
-			avail = buf_avail(chan->sendbuf);
-			if (avail > 0)
-				break;
-			pthread_cond_wait(&chan->wrready, &chan->lock);
+		state = __atomic_load_n(&chan->state, __ATOMIC_ACQUIRE);
+		if (state != CS_ESTABLISHED && state != CS_RDCLOSED) {
+			errno = EPIPE;
+			return (-1);
+		}
+		if (!buf_enter(sbuf)) {
+			/* Wait for the sender to be done growing it. */
+			chan_lock(chan);
+			chan_unlock(chan);
+			continue;
+		}
+		avail = buf_avail(sbuf);
+		if (avail == 0) {
+			buf_leave(sbuf);
+			key = waitq_prepare(&chan->wrwait);
+			chan_lock(chan);
+			avail = buf_avail(sbuf);
+			state = chan->state;
+			chan_unlock(chan);
+			if (avail == 0 && (state == CS_ESTABLISHED ||
+			    state == CS_RDCLOSED))
+				chan_waitstat(chan, &chan->wrwait, key,
+				    &chan->stats.wrblocked);
+			else
+				waitq_cancel(&chan->wrwait);
+			continue;
 		}
 		n = min(avail, size - pos);
-		buf_put(chan->sendbuf, cp + pos, n);
+		buf_copyin(sbuf, sbuf->in, cp + pos, n);
+		buf_more(sbuf, n);
+		/*
+		 * The sender only needs to be woken up if it had nothing
+		 * left to send; otherwise it will notice the new bytes
+		 * on its own once it's done with the previous ones.  We
+		 * look at the buffer after publishing them, so either we
+		 * see that the sender caught up, or its next scan sees
+		 * our bytes.
+		 */
+		idle = (buf_count(sbuf) - n ==
+		    __atomic_load_n(&chan->sendpend, __ATOMIC_SEQ_CST));
+		buf_leave(sbuf);
 		pos += n;
+		if (idle)
+			sender_wakeup(chan->mux);
 	}
-	chan_unlock(chan);
-	sender_wakeup(chan->mux);
 	return (size);
 }
 
@@ -518,7 +871,7 @@ chan_connect(struct mux *m, int id)
 		chan_unlock(chan);
 		return (NULL);
 	}
-	chan->state = CS_CONNECTING;
+	chan_setstate(chan, CS_CONNECTING);
 	chan->flags |= CF_CONNECT;
 	chan_unlock(chan);
 	sender_wakeup(m);
@@ -587,24 +940,82 @@ chan_new(struct mux *m)
 	chan->state = CS_UNUSED;
 	chan->flags = 0;
 	chan->mux = m;
-	chan->sendbuf = buf_new(CHAN_SBSIZE);
+	chan->sendbuf = buf_new(m->winsize != 0 ? m->winsize : CHAN_SBSIZE);
 	chan->sendseq = 0;
 	chan->sendwin = 0;
 	chan->sendmss = 0;
-	chan->recvbuf = buf_new(CHAN_RBSIZE);
+	chan->sendpend = 0;
+	chan->recvbuf = buf_new(m->winsize != 0 ? m->winsize : CHAN_RBSIZE);
 	chan->recvseq = 0;
 	chan->recvmss = CHAN_MAXSEGSIZE;
+	chan->recvadv = 0;
+	chan->windelayed = 0;
+	chan->winskipped = 0;
+	memset(&chan->stats, 0, sizeof(chan->stats));
+	chan->stalled = 0;
+	gettimeofday(&chan->rttstart, NULL);
+	chan->rttbytes = 0;
+	chan->rtt = CHAN_DEFRTT;
 	pthread_mutex_init(&chan->lock, NULL);
 	pthread_cond_init(&chan->rdready, NULL);
 	pthread_cond_init(&chan->wrready, NULL);
+	waitq_init(&chan->rdwait);
+	waitq_init(&chan->wrwait);
 	return (chan);
 }
 
+/*
+ * Change the state of a locked channel.  The reader and the writer may
+ * be waiting for it on their wait queue rather than on the condition
+ * variables.
+ */
+static void
+chan_setstate(struct chan *chan, int state)
+{
+
+	__atomic_store_n(&chan->state, state, __ATOMIC_RELEASE);
+	waitq_wakeup(&chan->rdwait);
+	waitq_wakeup(&chan->wrwait);
+}
+
+/*
+ * Wait on one of the channel's wait queues, accounting for the time
+ * spent blocked.  The channel must not be locked.
+ */
+static void
+chan_waitstat(struct chan *chan, struct waitq *wq, unsigned int key,
+    struct timeval *total)
+{
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	waitq_wait(wq, key);
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &end);
+	chan_lock(chan);
+	timeradd(total, &end, total);
+	chan_unlock(chan);
+}
+
+/* The peer has opened its window again after we ran out of it. */
+static void
+chan_unstall(struct chan *chan)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &chan->stallstart, &now);
+	timeradd(&chan->stats.winstalled, &now, &chan->stats.winstalled);
+	chan->stalled = 0;
+}
+
 /* Free any resources associated with a channel. */
 static void
 chan_free(struct chan *chan)
 {
 
+	waitq_fini(&chan->rdwait);
+	waitq_fini(&chan->wrwait);
 	pthread_cond_destroy(&chan->rdready);
 	pthread_cond_destroy(&chan->wrready);
 	pthread_mutex_destroy(&chan->lock);
@@ -613,6 +1024,130 @@ chan_free(struct chan *chan)
 	free(chan);
 }
 
+/*
+ * Receive window autotuning, loosely modeled after the dynamic
+ * right-sizing done by TCP stacks.  We count the bytes that arrived
+ * during about one round-trip time, and if that gets close to the
+ * window we advertise, the window is what limits our throughput so
+ * we grow the receive buffer to twice that amount.
+ *
+ * This has to be called with the channel locked.  Returns 1 if the
+ * window has grown and needs to be sent.
+ */
+static int
+chan_rcvtune(struct chan *chan, size_t len)
+{
+	struct timeval now;
+	struct buf *buf;
+	size_t need;
+	long elapsed;
+	int grown;
+
+	buf = chan->recvbuf;
+	if (chan->mux->winsize != 0 || buf->size >= CHAN_MAXBUFSIZE)
+		return (0);
+	chan->rttbytes += len;
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - chan->rttstart.tv_sec) * 1000000 +
+	    (now.tv_usec - chan->rttstart.tv_usec);
+	if (elapsed < chan->rtt)
+		return (0);
+	/* Scale down to one RTT worth of data if we've been idle. */
+	need = (double)chan->rttbytes * chan->rtt / elapsed * 2;
+	grown = 0;
+	if (need > buf->size) {
+		/* Try again with the next segment if the reader is busy. */
+		if (!buf_trygrow(buf, buf_newsize(buf->size, need)))
+			return (0);
+		chan->flags |= CF_WINDOW;
+		grown = 1;
+	}
+	chan->rttbytes = 0;
+	chan->rttstart = now;
+	chan->rtt = mux_rtt(chan->mux);
+	return (grown);
+}
+
+/*
+ * Decide whether the reader has freed enough space in the receive
+ * buffer to be worth a window update.  Like TCP does to avoid the
+ * silly window syndrome, we wait until the window can be moved by
+ * half the buffer or a full segment, whichever is smaller.  Smaller
+ * updates are delayed for at most CHAN_WINDELAY, so that a peer
+ * waiting on a closed window doesn't stall.  Has to be called with
+ * the channel locked, and returns 1 if the sender needs a wakeup.
+ */
+static int
+chan_winupdate(struct chan *chan)
+{
+	struct timeval delay;
+	uint32_t incr;
+
+	if (chan->flags & CF_WINDOW)
+		return (0);
+	incr = chan->recvseq + chan->recvbuf->size - chan->recvadv;
+	if (incr >= min(chan->recvbuf->size / 2, chan->recvmss)) {
+		chan->flags |= CF_WINDOW;
+		return (1);
+	}
+	chan->stats.winsuppressed++;
+	if (chan->windelayed)
+		return (0);
+	/* Let the sender know it has a timer to arm. */
+	gettimeofday(&chan->windeadline, NULL);
+	delay.tv_sec = 0;
+	delay.tv_usec = CHAN_WINDELAY;
+	timeradd(&chan->windeadline, &delay, &chan->windeadline);
+	__atomic_store_n(&chan->windelayed, 1, __ATOMIC_SEQ_CST);
+	return (1);
+}
+
+/*
+ * Called by the reader without the lock after it has updated recvseq,
+ * while it's still in the receive buffer.  Returns 1 if chan_winupdate()
+ * would only suppress the update because a delayed one is already due,
+ * so that the reader doesn't need the lock.  The sender clears windelayed
+ * before reading recvseq to advertise the window, so either it sees our
+ * bytes, or we see that the update is gone and take the lock.
+ */
+static int
+chan_winskip(struct chan *chan)
+{
+	uint32_t incr;
+
+	if (!__atomic_load_n(&chan->windelayed, __ATOMIC_SEQ_CST))
+		return (0);
+	incr = chan->recvseq + chan->recvbuf->size -
+	    __atomic_load_n(&chan->recvadv, __ATOMIC_RELAXED);
+	if (incr >= min(chan->recvbuf->size / 2, chan->recvmss))
+		return (0);
+	__atomic_fetch_add(&chan->winskipped, 1, __ATOMIC_RELAXED);
+	return (1);
+}
+
+/*
+ * Since we don't keep unacknowledged data around, the send buffer
+ * doesn't need to cover the whole window, but letting it follow
+ * the peer's window allows the writers to queue enough data to
+ * build full-sized segments.  This has to be called by the sender
+ * thread with the channel locked, for the same reasons as above.
+ */
+static void
+chan_sndtune(struct chan *chan)
+{
+	struct buf *buf;
+	uint32_t winsize;
+
+	buf = chan->sendbuf;
+	if (chan->mux->winsize != 0 || buf->size >= CHAN_MAXBUFSIZE)
+		return;
+	winsize = chan->sendwin - chan->sendseq;
+	/* Try again with the next segment if the writer is busy. */
+	if (winsize > buf->size &&
+	    buf_trygrow(buf, buf_newsize(buf->size, winsize)))
+		waitq_wakeup(&chan->wrwait);
+}
+
 /* Insert the new channel in the channel list. */
 static int
 chan_insert(struct mux *m, struct chan *chan)
@@ -639,22 +1174,57 @@ chan_insert(struct mux *m, struct chan *chan)
  * the receiver and sender threads.
  */
 static int
-mux_init(struct mux *m)
+mux_init(struct mux *m, int server)
 {
 	struct mux_header mh;
 	int error;
 
-	mh.type = MUX_STARTUPREQ;
-	mh.mh_startup.version = htons(MUX_PROTOVER);
-	error = sock_write(m->socket, &mh, MUX_STARTUPHDRSZ);
-	if (error)
-		return (-1);
-	error = sock_readwait(m->socket, &mh, MUX_STARTUPHDRSZ);
-	if (error)
-		return (-1);
-	if (mh.type != MUX_STARTUPREP ||
-	    ntohs(mh.mh_startup.version) != MUX_PROTOVER)
-		return (-1);
+	if (server) {
+		error = sock_readwait(m->socket, &mh, MUX_STARTUPHDRSZ);
+		if (error)
+			return (-1);
+		if (mh.type != MUX_STARTUPREQ ||
+		    ntohs(mh.mh_startup.version) != MUX_PROTOVER)
+			return (-1);
+		/*
+		 * Channel 0 must be listening before the client gets our
+		 * reply, since it will connect to it right away.
+		 */
+		if (chan_listen(m) != 0)
+			return (-1);
+		mh.type = MUX_STARTUPREP;
+		mh.mh_startup.version = htons(MUX_PROTOVER);
+		error = sock_write(m->socket, &mh, MUX_STARTUPHDRSZ);
+		if (error)
+			return (-1);
+	} else {
+		mh.type = MUX_STARTUPREQ;
+		mh.mh_startup.version = htons(MUX_PROTOVER);
+		error = sock_write(m->socket, &mh, MUX_STARTUPHDRSZ);
+		if (error)
+			return (-1);
+		error = sock_readwait(m->socket, &mh, MUX_STARTUPHDRSZ);
+		if (error)
+			return (-1);
+		if (mh.type != MUX_STARTUPREP ||
+		    ntohs(mh.mh_startup.version) != MUX_PROTOVER)
+			return (-1);
+	}
+	if (m->backend == MUX_BACKEND_EVLOOP) {
+		error = evloop_init(m);
+		if (error)
+			return (-1);
+		/*
+		 * The event loop thread plays both roles.  It always scans
+		 * for work before going to sleep, so we don't need to wait
+		 * for it to be ready like we do for the sender thread.
+		 */
+		error = pthread_create(&m->receiver, NULL, evloop_loop, m);
+		if (error)
+			return (-1);
+		m->sender = m->receiver;
+		return (0);
+	}
 	mux_lock(m);
 	error = pthread_create(&m->sender, NULL, sender_loop, m);
 	if (error) {
@@ -676,6 +1246,25 @@ mux_init(struct mux *m)
 	return (0);
 }
 
+/* Return the round-trip time of the connection, in microseconds. */
+static long
+mux_rtt(struct mux *m)
+{
+#if defined(TCP_INFO) && (defined(__linux__) || defined(__FreeBSD__))
+	struct tcp_info ti;
+	socklen_t len;
+	int error;
+
+	len = sizeof(ti);
+	error = getsockopt(m->socket, IPPROTO_TCP, TCP_INFO, &ti, &len);
+	if (!error && ti.tcpi_rtt > 0)
+		return (ti.tcpi_rtt);
+#else
+	(void)m;
+#endif
+	return (CHAN_DEFRTT);
+}
+
 /*
  * Close all the channels, terminate the sender and receiver thread.
  * This is an important function because it is used every time we need
@@ -711,7 +1300,10 @@ mux_shutdown(struct mux *m, const char *errmsg, int status)
 	sender = m->sender;
 	receiver = m->receiver;
 	if (errmsg != NULL) {
-		if (pthread_equal(self, receiver))
+		if (pthread_equal(self, receiver) &&
+		    m->backend == MUX_BACKEND_EVLOOP)
+			name = "Event loop";
+		else if (pthread_equal(self, receiver))
 			name = "Receiver";
 		else if (pthread_equal(self, sender))
 			name = "Sender";
@@ -728,7 +1320,7 @@ mux_shutdown(struct mux *m, const char *errmsg, int status)
 			chan = m->channels[i];
 			chan_lock(chan);
 			if (chan->state != CS_UNUSED) {
-				chan->state = CS_CLOSED;
+				chan_setstate(chan, CS_CLOSED);
 				chan->flags = 0;
 				pthread_cond_broadcast(&chan->rdready);
 				pthread_cond_broadcast(&chan->wrready);
@@ -744,7 +1336,7 @@ mux_shutdown(struct mux *m, const char *errmsg, int status)
 		pthread_join(receiver, &val);
 		assert(val == PTHREAD_CANCELED);
 	}
-	if (!pthread_equal(self, sender)) {
+	if (!pthread_equal(self, sender) && !pthread_equal(sender, receiver)) {
 		ret = pthread_cancel(sender);
 		assert(!ret);
 		pthread_join(sender, &val);
@@ -766,87 +1358,204 @@ sender_wakeup(struct mux *m)
 	 * signal; if he wasn't waiting then he won't go to sleep
 	 * before having sent what we want him to.
 	 */
-	if (waiting)
-		pthread_cond_signal(&m->sender_newwork);
+	if (waiting) {
+		if (m->backend == MUX_BACKEND_EVLOOP)
+			evloop_wakeup(m);
+		else
+			pthread_cond_signal(&m->sender_newwork);
+	}
 }
 
 static void *
 sender_loop(void *arg)
 {
-	struct iovec iov[3];
-	struct mux_header mh;
+	struct iovec iov[SENDER_MAXIOV];
+	struct mux_header mh[SENDER_MAXIOV];
 	struct mux *m;
-	struct chan *chan;
-	struct buf *buf;
-	uint32_t winsize;
-	uint16_t hdrsize, size, len;
 	int error, id, iovcnt, what;
 
 	what = 0;	/* Appease GCC4 */
 	m = (struct mux *)arg;
 again:
 	id = sender_waitforwork(m, &what);
-	chan = chan_get(m, id);
-	hdrsize = size = 0;
-	switch (what) {
-	case CF_CONNECT:
-		mh.type = MUX_CONNECT;
-		mh.mh_connect.id = id;
-		mh.mh_connect.mss = htons(chan->recvmss);
-		mh.mh_connect.window = htonl(chan->recvseq +
-		    chan->recvbuf->size);
-		hdrsize = MUX_CONNECTHDRSZ;
-		break;
-	case CF_ACCEPT:
-		mh.type = MUX_ACCEPT;
-		mh.mh_accept.id = id;
-		mh.mh_accept.mss = htons(chan->recvmss);
-		mh.mh_accept.window = htonl(chan->recvseq +
-		    chan->recvbuf->size);
-		hdrsize = MUX_ACCEPTHDRSZ;
-		break;
+	iovcnt = sender_gather(m, id, what, mh, iov);
+	if (iovcnt > 0) {
+		error = sock_writev(m->socket, iov, iovcnt);
+		if (error)
+			goto bad;
+	}
+	sender_release(m);
+	goto again;
+bad:
+	if (error == EPIPE)
+		mux_shutdown(m, strerror(errno), STATUS_TRANSIENTFAILURE);
+	else
+		mux_shutdown(m, strerror(errno), STATUS_FAILURE);
+	return (NULL);
+}
+
+/*
+ * Gather all the pending work, starting with the frame sender_scan()
+ * returned, before doing any I/O, so that control frames and data for
+ * both channels go out with a single writev() call.  The iovecs and
+ * headers arrays must have room for SENDER_MAXIOV entries.  Returns
+ * the number of iovecs used.
+ */
+static int
+sender_gather(struct mux *m, int id, int what, struct mux_header *mh,
+    struct iovec *iov)
+{
+	struct chan *chan;
+	int iovcnt, n, nframes;
+
+	iovcnt = 0;
+	nframes = 0;
+	do {
+		chan = chan_get(m, id);
+		n = sender_frame(chan, id, what, &mh[nframes], iov + iovcnt);
+		chan_unlock(chan);
+		if (n > 0) {
+			iovcnt += n;
+			nframes++;
+		}
+		/* Leave room for a data frame wrapping around. */
+		if (iovcnt + 3 > SENDER_MAXIOV)
+			break;
+		mux_lock(m);
+		id = sender_scan(m, &what);
+		mux_unlock(m);
+	} while (id != -1);
+	return (iovcnt);
+}
+
+/* Release the send buffer space of the frames we have written. */
+static void
+sender_release(struct mux *m)
+{
+	struct chan *chan;
+	struct buf *buf;
+	size_t pend;
+	int i;
+
+	mux_lock(m);
+	for (i = 0; i < m->nchans; i++) {
+		chan = m->channels[i];
+		chan_lock(chan);
+		pend = chan->sendpend;
+		if (pend > 0) {
+			buf = chan->sendbuf;
+			buf_less(buf, pend);
+			__atomic_store_n(&chan->sendpend, 0, __ATOMIC_SEQ_CST);
+			/*
+			 * The writer can only be waiting if we were full,
+			 * which we check after publishing the space for the
+			 * same reasons as in chan_write().
+			 */
+			if (buf_avail(buf) == pend)
+				waitq_wakeup(&chan->wrwait);
+		}
+		chan_unlock(chan);
+	}
+	mux_unlock(m);
+}
+
+/*
+ * Build the frame corresponding to "what" for the given channel, and
+ * set up the iovecs to send it.  Returns the number of iovecs used,
+ * which is at most 3, or 0 if there was nothing to send after all.
+ * Has to be called with the channel locked.
+ */
+static int
+sender_frame(struct chan *chan, int id, int what, struct mux_header *mh,
+    struct iovec *iov)
+{
+	struct buf *buf;
+	uint32_t winsize;
+	size_t off;
+	uint16_t hdrsize, size, len;
+	int iovcnt;
+
+	hdrsize = size = 0;
+	switch (what) {
+	case CF_CONNECT:
+		mh->type = MUX_CONNECT;
+		mh->mh_connect.id = id;
+		mh->mh_connect.mss = htons(chan->recvmss);
+		__atomic_store_n(&chan->recvadv, __atomic_load_n(&chan->recvseq,
+		    __ATOMIC_SEQ_CST) + chan->recvbuf->size, __ATOMIC_RELAXED);
+		mh->mh_connect.window = htonl(chan->recvadv);
+		hdrsize = MUX_CONNECTHDRSZ;
+		break;
+	case CF_ACCEPT:
+		mh->type = MUX_ACCEPT;
+		mh->mh_accept.id = id;
+		mh->mh_accept.mss = htons(chan->recvmss);
+		__atomic_store_n(&chan->recvadv, __atomic_load_n(&chan->recvseq,
+		    __ATOMIC_SEQ_CST) + chan->recvbuf->size, __ATOMIC_RELAXED);
+		mh->mh_accept.window = htonl(chan->recvadv);
+		hdrsize = MUX_ACCEPTHDRSZ;
+		break;
 	case CF_RESET:
-		mh.type = MUX_RESET;
-		mh.mh_reset.id = id;
+		mh->type = MUX_RESET;
+		mh->mh_reset.id = id;
 		hdrsize = MUX_RESETHDRSZ;
 		break;
 	case CF_WINDOW:
-		mh.type = MUX_WINDOW;
-		mh.mh_window.id = id;
-		mh.mh_window.window = htonl(chan->recvseq +
-		    chan->recvbuf->size);
+		mh->type = MUX_WINDOW;
+		mh->mh_window.id = id;
+		/* Before reading recvseq, see chan_winskip(). */
+		__atomic_store_n(&chan->windelayed, 0, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&chan->recvadv, __atomic_load_n(&chan->recvseq,
+		    __ATOMIC_SEQ_CST) + chan->recvbuf->size, __ATOMIC_RELAXED);
+		chan->stats.winsent++;
+		mh->mh_window.window = htonl(chan->recvadv);
 		hdrsize = MUX_WINDOWHDRSZ;
 		break;
 	case CF_DATA:
-		mh.type = MUX_DATA;
-		mh.mh_data.id = id;
-		size = min(buf_count(chan->sendbuf), chan->sendmss);
+		/* We can't move the buffer with iovecs pointing into it. */
+		if (chan->sendpend == 0)
+			chan_sndtune(chan);
+		buf = chan->sendbuf;
+		size = min(buf_count(buf) - chan->sendpend, chan->sendmss);
 		winsize = chan->sendwin - chan->sendseq;
 		if (winsize < size)
 			size = winsize;
-		mh.mh_data.len = htons(size);
+		if (size == 0)
+			return (0);
+		mh->type = MUX_DATA;
+		mh->mh_data.id = id;
+		mh->mh_data.len = htons(size);
 		hdrsize = MUX_DATAHDRSZ;
 		break;
 	case CF_CLOSE:
-		mh.type = MUX_CLOSE;
-		mh.mh_close.id = id;
+		mh->type = MUX_CLOSE;
+		mh->mh_close.id = id;
 		hdrsize = MUX_CLOSEHDRSZ;
 		break;
 	}
+	/*
+	 * Older FreeBSD versions (and maybe other OSes) have the
+	 * iov_base field defined as char *.  Cast to char * to
+	 * silence a warning in this case.
+	 */
+	iov[0].iov_base = (char *)mh;
+	iov[0].iov_len = hdrsize;
+	iovcnt = 1;
 	if (size > 0) {
-		assert(mh.type == MUX_DATA);
+		assert(mh->type == MUX_DATA);
 		/*
-		 * Older FreeBSD versions (and maybe other OSes) have the
-		 * iov_base field defined as char *.  Cast to char * to
-		 * silence a warning in this case.
+		 * We access the buffer directly to avoid some copying.
+		 * Since we're the only thread sending bytes from the
+		 * buffer and modifying buf->out, it's safe to let the
+		 * channel be unlocked during I/O; the bytes we have
+		 * queued are accounted for in chan->sendpend so that
+		 * the writers don't overwrite them in the meantime.
 		 */
-		iov[0].iov_base = (char *)&mh;
-		iov[0].iov_len = hdrsize;
-		iovcnt = 1;
-		/* We access the buffer directly to avoid some copying. */
-		buf = chan->sendbuf;
-		len = min(size, buf->size + 1 - buf->out);
-		iov[iovcnt].iov_base = buf->data + buf->out;
+		off = buf->out + chan->sendpend;
+		if (off > buf->size)
+			off -= buf->size + 1;
+		len = min(size, buf->size + 1 - off);
+		iov[iovcnt].iov_base = buf->data + off;
 		iov[iovcnt].iov_len = len;
 		iovcnt++;
 		if (size > len) {
@@ -855,36 +1564,13 @@ again:
 			iov[iovcnt].iov_len = size - len;
 			iovcnt++;
 		}
-		/*
-		 * Since we're the only thread sending bytes from the
-		 * buffer and modifying buf->out, it's safe to unlock
-		 * here during I/O.  It avoids keeping the channel lock
-		 * too long, since write() might block.
-		 */
-		chan_unlock(chan);
-		error = sock_writev(m->socket, iov, iovcnt);
-		if (error)
-			goto bad;
-		chan_lock(chan);
 		chan->sendseq += size;
-		buf->out += size;
-		if (buf->out > buf->size)
-			buf->out -= buf->size + 1;
-		pthread_cond_signal(&chan->wrready);
-		chan_unlock(chan);
-	} else {
-		chan_unlock(chan);
-		error = sock_write(m->socket, &mh, hdrsize);
-		if (error)
-			goto bad;
+		__atomic_store_n(&chan->sendpend, chan->sendpend + size,
+		    __ATOMIC_SEQ_CST);
+		chan->stats.bytes_sent += size;
+		chan->stats.segs_sent++;
 	}
-	goto again;
-bad:
-	if (error == EPIPE)
-		mux_shutdown(m, strerror(errno), STATUS_TRANSIENTFAILURE);
-	else
-		mux_shutdown(m, strerror(errno), STATUS_FAILURE);
-	return (NULL);
+	return (iovcnt);
 }
 
 static void
@@ -899,6 +1585,7 @@ sender_cleanup(void *arg)
 static int
 sender_waitforwork(struct mux *m, int *what)
 {
+	struct timespec ts;
 	int id;
 
 	mux_lock(m);
@@ -909,7 +1596,15 @@ sender_waitforwork(struct mux *m, int *what)
 	}
 	while ((id = sender_scan(m, what)) == -1) {
 		m->sender_waiting = 1;
-		pthread_cond_wait(&m->sender_newwork, &m->lock);
+		if (m->sender_delayed) {
+			/* Wake up in time for the delayed window updates. */
+			ts.tv_sec = m->sender_deadline.tv_sec;
+			ts.tv_nsec = m->sender_deadline.tv_usec * 1000;
+			pthread_cond_timedwait(&m->sender_newwork, &m->lock,
+			    &ts);
+		} else {
+			pthread_cond_wait(&m->sender_newwork, &m->lock);
+		}
 	}
 	m->sender_waiting = 0;
 	pthread_cleanup_pop(1);
@@ -918,16 +1613,21 @@ sender_waitforwork(struct mux *m, int *what)
 
 /*
  * Scan for work to do for the sender.  Has to be called with
- * the multiplexer lock held.
+ * the multiplexer lock held.  If there is nothing to do but
+ * some window updates are being delayed, sender_delayed is set
+ * and sender_deadline tells when the first one is due.
  */
 static int
 sender_scan(struct mux *m, int *what)
 {
+	struct timeval now;
 	struct chan *chan;
-	int id;
+	int flags, havenow, id;
 
+	m->sender_delayed = 0;
 	if (m->nchans <= 0)
 		return (-1);
+	havenow = 0;
 	id = m->sender_lastid;
 	do {
 		id++;
@@ -936,22 +1636,50 @@ sender_scan(struct mux *m, int *what)
 		chan = m->channels[id];
 		chan_lock(chan);
 		if (chan->state != CS_UNUSED) {
+			if (chan->windelayed && !(chan->flags & CF_WINDOW)) {
+				if (!havenow) {
+					gettimeofday(&now, NULL);
+					havenow = 1;
+				}
+				if (!timercmp(&now, &chan->windeadline, <))
+					chan->flags |= CF_WINDOW;
+				else if (!m->sender_delayed ||
+				    timercmp(&chan->windeadline,
+				    &m->sender_deadline, <)) {
+					m->sender_deadline = chan->windeadline;
+					m->sender_delayed = 1;
+				}
+			}
 			if (chan->sendseq != chan->sendwin &&
-			    buf_count(chan->sendbuf) > 0)
+			    buf_count(chan->sendbuf) > chan->sendpend)
 				chan->flags |= CF_DATA;
-			if (chan->flags) {
+			else if (chan->sendseq == chan->sendwin &&
+			    buf_count(chan->sendbuf) > chan->sendpend &&
+			    !chan->stalled) {
+				gettimeofday(&chan->stallstart, NULL);
+				chan->stalled = 1;
+			}
+			/*
+			 * Don't send the close before all the data is out,
+			 * which may take a while if the peer's window is
+			 * full; its next window update will wake us up.
+			 */
+			flags = chan->flags;
+			if (buf_count(chan->sendbuf) > 0)
+				flags &= ~CF_CLOSE;
+			if (flags) {
 				/* By order of importance. */
-				if (chan->flags & CF_CONNECT)
+				if (flags & CF_CONNECT)
 					*what = CF_CONNECT;
-				else if (chan->flags & CF_ACCEPT)
+				else if (flags & CF_ACCEPT)
 					*what = CF_ACCEPT;
-				else if (chan->flags & CF_RESET)
+				else if (flags & CF_RESET)
 					*what = CF_RESET;
-				else if (chan->flags & CF_WINDOW)
+				else if (flags & CF_WINDOW)
 					*what = CF_WINDOW;
-				else if (chan->flags & CF_DATA)
+				else if (flags & CF_DATA)
 					*what = CF_DATA;
-				else if (chan->flags & CF_CLOSE)
+				else if (flags & CF_CLOSE)
 					*what = CF_CLOSE;
 				chan->flags &= ~*what;
 				chan_unlock(chan);
@@ -964,135 +1692,361 @@ sender_scan(struct mux *m, int *what)
 	return (-1);
 }
 
-/* Read the rest of a packet header depending on its type. */
-#define	SOCK_READREST(s, mh, hsize)	\
-    sock_readwait(s, (char *)&mh + sizeof(mh.type), (hsize) - sizeof(mh.type))
-
-void *
+static void *
 receiver_loop(void *arg)
 {
-	struct mux_header mh;
 	struct mux *m;
-	struct chan *chan;
-	struct buf *buf;
-	uint16_t size, len;
+	ssize_t n;
+	size_t count;
 	int error;
 
 	m = (struct mux *)arg;
-	while ((error = sock_readwait(m->socket, &mh.type,
-	    sizeof(mh.type))) == 0) {
-		switch (mh.type) {
-		case MUX_CONNECT:
-			error = SOCK_READREST(m->socket, mh, MUX_CONNECTHDRSZ);
-			if (error)
-				goto bad;
-			chan = chan_get(m, mh.mh_connect.id);
-			if (chan->state == CS_LISTENING) {
-				chan->state = CS_ESTABLISHED;
-				chan->sendmss = ntohs(mh.mh_connect.mss);
-				chan->sendwin = ntohl(mh.mh_connect.window);
-				chan->flags |= CF_ACCEPT;
-				pthread_cond_signal(&chan->rdready);
-			} else
-				chan->flags |= CF_RESET;
+	count = 0;
+	for (;;) {
+		/*
+		 * Read as much as we can in one go, and then process all
+		 * the complete frames we got.
+		 */
+		n = sock_read(m->socket, m->receiver_buf + count,
+		    RECEIVER_BUFSIZE - count);
+		if (n == 0)
+			errno = ECONNRESET;
+		if (n <= 0)
+			goto bad;
+		count += n;
+		error = receiver_process(m, &count);
+		if (error)
+			goto badproto;
+	}
+bad:
+	if (errno == ECONNRESET || errno == ECONNABORTED)
+		mux_shutdown(m, strerror(errno), STATUS_TRANSIENTFAILURE);
+	else
+		mux_shutdown(m, strerror(errno), STATUS_FAILURE);
+	return (NULL);
+badproto:
+	mux_shutdown(m, "Protocol error", STATUS_FAILURE);
+	return (NULL);
+}
+
+/*
+ * Process all the complete frames in the staging buffer, which holds
+ * "*count" bytes.  Any partial frame left at the end is moved to the
+ * start of the buffer and "*count" is updated accordingly.  Returns -1
+ * in case of a protocol error.
+ */
+static int
+receiver_process(struct mux *m, size_t *count)
+{
+	uint8_t *cp;
+	ssize_t n;
+
+	cp = m->receiver_buf;
+	while ((n = receiver_frame(m, cp, *count)) > 0) {
+		cp += n;
+		*count -= n;
+	}
+	if (n == -1)
+		return (-1);
+	if (*count > 0 && cp != m->receiver_buf)
+		memmove(m->receiver_buf, cp, *count);
+	return (0);
+}
+
+/*
+ * Process the frame at the start of the given bytes, copying its
+ * payload into the channel's receive buffer if it has one.  Returns
+ * the number of bytes consumed, 0 if the frame isn't complete yet,
+ * and -1 in case of a protocol error.
+ */
+static ssize_t
+receiver_frame(struct mux *m, const uint8_t *cp, size_t count)
+{
+	struct mux_header mh;
+	struct chan *chan;
+	struct buf *buf;
+	size_t hdrsize, hiwat;
+	uint16_t len;
+	int grown;
+
+	if (count == 0)
+		return (0);
+	switch (cp[0]) {
+	case MUX_CONNECT:
+		hdrsize = MUX_CONNECTHDRSZ;
+		break;
+	case MUX_ACCEPT:
+		hdrsize = MUX_ACCEPTHDRSZ;
+		break;
+	case MUX_RESET:
+		hdrsize = MUX_RESETHDRSZ;
+		break;
+	case MUX_DATA:
+		hdrsize = MUX_DATAHDRSZ;
+		break;
+	case MUX_WINDOW:
+		hdrsize = MUX_WINDOWHDRSZ;
+		break;
+	case MUX_CLOSE:
+		hdrsize = MUX_CLOSEHDRSZ;
+		break;
+	default:
+		return (-1);
+	}
+	if (count < hdrsize)
+		return (0);
+	memcpy(&mh, cp, hdrsize);
+	switch (mh.type) {
+	case MUX_CONNECT:
+		chan = chan_get(m, mh.mh_connect.id);
+		if (chan->state == CS_LISTENING) {
+			chan_setstate(chan, CS_ESTABLISHED);
+			chan->sendmss = ntohs(mh.mh_connect.mss);
+			chan->sendwin = ntohl(mh.mh_connect.window);
+			chan->flags |= CF_ACCEPT;
+			pthread_cond_signal(&chan->rdready);
+		} else
+			chan->flags |= CF_RESET;
+		chan_unlock(chan);
+		sender_wakeup(m);
+		break;
+	case MUX_ACCEPT:
+		chan = chan_get(m, mh.mh_accept.id);
+		if (chan->state == CS_CONNECTING) {
+			chan->sendmss = ntohs(mh.mh_accept.mss);
+			chan->sendwin = ntohl(mh.mh_accept.window);
+			chan_setstate(chan, CS_ESTABLISHED);
+			pthread_cond_signal(&chan->wrready);
+			chan_unlock(chan);
+		} else {
+			chan->flags |= CF_RESET;
 			chan_unlock(chan);
 			sender_wakeup(m);
-			break;
-		case MUX_ACCEPT:
-			error = SOCK_READREST(m->socket, mh, MUX_ACCEPTHDRSZ);
-			if (error)
-				goto bad;
-			chan = chan_get(m, mh.mh_accept.id);
-			if (chan->state == CS_CONNECTING) {
-				chan->sendmss = ntohs(mh.mh_accept.mss);
-				chan->sendwin = ntohl(mh.mh_accept.window);
-				chan->state = CS_ESTABLISHED;
-				pthread_cond_signal(&chan->wrready);
-				chan_unlock(chan);
-			} else {
-				chan->flags |= CF_RESET;
-				chan_unlock(chan);
-				sender_wakeup(m);
-			}
-			break;
-		case MUX_RESET:
-			error = SOCK_READREST(m->socket, mh, MUX_RESETHDRSZ);
-			if (error)
-				goto bad;
-			goto badproto;
-		case MUX_WINDOW:
-			error = SOCK_READREST(m->socket, mh, MUX_WINDOWHDRSZ);
-			if (error)
-				goto bad;
-			chan = chan_get(m, mh.mh_window.id);
-			if (chan->state == CS_ESTABLISHED ||
-			    chan->state == CS_RDCLOSED) {
-				chan->sendwin = ntohl(mh.mh_window.window);
-				chan_unlock(chan);
-				sender_wakeup(m);
-			} else {
-				chan_unlock(chan);
-			}
-			break;
-		case MUX_DATA:
-			error = SOCK_READREST(m->socket, mh, MUX_DATAHDRSZ);
-			if (error)
-				goto bad;
-			chan = chan_get(m, mh.mh_data.id);
-			len = ntohs(mh.mh_data.len);
-			buf = chan->recvbuf;
-			if ((chan->state != CS_ESTABLISHED &&
-			     chan->state != CS_WRCLOSED) ||
-			    (len > buf_avail(buf) ||
-			     len > chan->recvmss)) {
-				chan_unlock(chan);
-				goto badproto;
-				return (NULL);
-			}
+		}
+		break;
+	case MUX_RESET:
+		return (-1);
+	case MUX_WINDOW:
+		chan = chan_get(m, mh.mh_window.id);
+		/* We may still have data to send after closing. */
+		if (chan->state == CS_ESTABLISHED ||
+		    chan->state == CS_RDCLOSED ||
+		    chan->state == CS_WRCLOSED || chan->state == CS_CLOSED) {
+			chan->sendwin = ntohl(mh.mh_window.window);
+			if (chan->stalled && chan->sendwin != chan->sendseq)
+				chan_unstall(chan);
+			chan_unlock(chan);
+			sender_wakeup(m);
+		} else {
+			chan_unlock(chan);
+		}
+		break;
+	case MUX_DATA:
+		len = ntohs(mh.mh_data.len);
+		if (count < hdrsize + len)
+			return (0);
+		chan = chan_get(m, mh.mh_data.id);
+		buf = chan->recvbuf;
+		if ((chan->state != CS_ESTABLISHED &&
+		     chan->state != CS_WRCLOSED) ||
+		    (len > buf_avail(buf) ||
+		     len > chan->recvmss)) {
+			chan_unlock(chan);
+			return (-1);
+		}
+		grown = 0;
+		if (len > 0) {
+			chan->stats.bytes_recv += len;
+			chan->stats.segs_recv++;
+			hiwat = buf_count(buf) + len;
+			if (hiwat > chan->stats.recv_hiwat)
+				chan->stats.recv_hiwat = hiwat;
+			grown = chan_rcvtune(chan, len);
+		}
+		chan_unlock(chan);
+		if (len > 0) {
 			/*
-			 * Similarly to the sender code, it's safe to
-			 * unlock the channel here.
+			 * Like the writers, we copy the payload without the
+			 * lock, and only wake up the reader if the buffer
+			 * was empty before we published it.
 			 */
+			buf_copyin(buf, buf->in, cp + hdrsize, len);
+			buf_more(buf, len);
+			if (buf_count(buf) == len)
+				waitq_wakeup(&chan->rdwait);
+		}
+		if (grown)
+			sender_wakeup(m);
+		return (hdrsize + len);
+	case MUX_CLOSE:
+		chan = chan_get(m, mh.mh_close.id);
+		if (chan->state == CS_ESTABLISHED)
+			chan_setstate(chan, CS_RDCLOSED);
+		else if (chan->state == CS_WRCLOSED)
+			chan_setstate(chan, CS_CLOSED);
+		else {
 			chan_unlock(chan);
-			size = min(buf->size + 1 - buf->in, len);
-			error = sock_readwait(m->socket,
-			    buf->data + buf->in, size);
-			if (error)
-				goto bad;
-			if (len > size) {
-				/* Wrapping around. */
-				error = sock_readwait(m->socket,
-				    buf->data, len - size);
-				if (error)
-					goto bad;
+			return (-1);
+		}
+		pthread_cond_signal(&chan->rdready);
+		chan_unlock(chan);
+		break;
+	}
+	return (hdrsize);
+}
+
+/*
+ * Event loop backend.
+ *
+ * A single thread does the work of both the sender and the receiver
+ * threads on the non-blocking socket, using epoll(7) on Linux and
+ * poll(2) elsewhere.  It shares the frame building and parsing code
+ * with them, as well as the sender_waiting protocol: when it's about
+ * to sleep with nothing to send, sender_wakeup() pokes it through an
+ * eventfd(2), or a pipe on systems that don't have it.
+ */
+static int
+evloop_init(struct mux *m)
+{
+	int error, flags;
+#ifdef __linux__
+	struct epoll_event ev;
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd == -1)
+		return (-1);
+	m->evloop_wakefd[0] = m->evloop_wakefd[1] = fd;
+	m->evloop_pollfd = epoll_create(2);
+	if (m->evloop_pollfd == -1)
+		return (-1);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = m->socket;
+	error = epoll_ctl(m->evloop_pollfd, EPOLL_CTL_ADD, m->socket, &ev);
+	if (error)
+		return (-1);
+	ev.data.fd = fd;
+	error = epoll_ctl(m->evloop_pollfd, EPOLL_CTL_ADD, fd, &ev);
+	if (error)
+		return (-1);
+#else
+	int i;
+
+	error = pipe(m->evloop_wakefd);
+	if (error)
+		return (-1);
+	for (i = 0; i < 2; i++) {
+		flags = fcntl(m->evloop_wakefd[i], F_GETFL);
+		if (flags == -1)
+			return (-1);
+		error = fcntl(m->evloop_wakefd[i], F_SETFL, flags | O_NONBLOCK);
+		if (error)
+			return (-1);
+	}
+#endif
+	flags = fcntl(m->socket, F_GETFL);
+	if (flags == -1)
+		return (-1);
+	error = fcntl(m->socket, F_SETFL, flags | O_NONBLOCK);
+	return (error);
+}
+
+static void
+evloop_fini(struct mux *m)
+{
+
+	if (m->evloop_pollfd != -1)
+		close(m->evloop_pollfd);
+	if (m->evloop_wakefd[0] != -1)
+		close(m->evloop_wakefd[0]);
+	if (m->evloop_wakefd[1] != -1 &&
+	    m->evloop_wakefd[1] != m->evloop_wakefd[0])
+		close(m->evloop_wakefd[1]);
+}
+
+static void *
+evloop_loop(void *arg)
+{
+	struct iovec iov[SENDER_MAXIOV];
+	struct mux_header mh[SENDER_MAXIOV];
+	struct timeval now;
+	struct mux *m;
+	size_t count;
+	ssize_t n;
+	int error, id, iovcnt, iovpos, readable, timeout, waiting, what;
+
+	m = (struct mux *)arg;
+	count = 0;
+	iovcnt = 0;
+	iovpos = 0;
+	what = 0;
+	for (;;) {
+		timeout = -1;
+		waiting = 0;
+		/* Gather new frames once the previous ones are out. */
+		if (iovcnt == 0) {
+			mux_lock(m);
+			id = sender_scan(m, &what);
+			if (id == -1) {
+				m->sender_waiting = waiting = 1;
+				if (m->sender_delayed) {
+					gettimeofday(&now, NULL);
+					timersub(&m->sender_deadline, &now,
+					    &now);
+					if (now.tv_sec < 0)
+						timeout = 0;
+					else
+						timeout = now.tv_sec * 1000 +
+						    (now.tv_usec + 999) / 1000;
+				}
 			}
-			chan_lock(chan);
-			buf->in += len;
-			if (buf->in > buf->size)
-				buf->in -= buf->size + 1;
-			pthread_cond_signal(&chan->rdready);
-			chan_unlock(chan);
-			break;
-		case MUX_CLOSE:
-			error = SOCK_READREST(m->socket, mh, MUX_CLOSEHDRSZ);
+			mux_unlock(m);
+			if (id != -1) {
+				iovcnt = sender_gather(m, id, what, mh, iov);
+				iovpos = 0;
+				/* Nothing to send after all, look again. */
+				if (iovcnt == 0)
+					timeout = 0;
+			}
+		}
+		/* The socket is most likely writable, so try right away. */
+		if (iovcnt > 0) {
+			error = evloop_write(m, iov, &iovpos, iovcnt);
 			if (error)
 				goto bad;
-			chan = chan_get(m, mh.mh_close.id);
-			if (chan->state == CS_ESTABLISHED)
-				chan->state = CS_RDCLOSED;
-			else if (chan->state == CS_WRCLOSED)
-				chan->state = CS_CLOSED;
-			else
-				goto badproto;
-			pthread_cond_signal(&chan->rdready);
-			chan_unlock(chan);
-			break;
-		default:
-			goto badproto;
+			if (iovpos == iovcnt) {
+				sender_release(m);
+				iovcnt = 0;
+				/* There may be more work, don't sleep. */
+				timeout = 0;
+			}
+		}
+		error = evloop_wait(m, iovcnt > 0, timeout, &readable);
+		if (waiting) {
+			mux_lock(m);
+			m->sender_waiting = 0;
+			mux_unlock(m);
 		}
+		if (error)
+			goto bad;
+		if (!readable)
+			continue;
+		n = read(m->socket, m->receiver_buf + count,
+		    RECEIVER_BUFSIZE - count);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n == 0)
+			errno = ECONNRESET;
+		if (n <= 0)
+			goto bad;
+		count += n;
+		error = receiver_process(m, &count);
+		if (error)
+			goto badproto;
 	}
 bad:
-	if (errno == ECONNRESET || errno == ECONNABORTED)
+	if (errno == ECONNRESET || errno == ECONNABORTED || errno == EPIPE)
 		mux_shutdown(m, strerror(errno), STATUS_TRANSIENTFAILURE);
 	else
 		mux_shutdown(m, strerror(errno), STATUS_FAILURE);
@@ -1102,6 +2056,110 @@ badproto:
 	return (NULL);
 }
 
+/*
+ * Wait until the socket is readable, or writable if "wantout" is set,
+ * for at most "timeout" milliseconds (-1 meaning forever).  Wakeups
+ * coming from sender_wakeup() are consumed here.
+ */
+static int
+evloop_wait(struct mux *m, int wantout, int timeout, int *readable)
+{
+#ifdef __linux__
+	struct epoll_event ev, events[2];
+	int i, n;
+
+	if (wantout != m->evloop_out) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | (wantout ? EPOLLOUT : 0);
+		ev.data.fd = m->socket;
+		if (epoll_ctl(m->evloop_pollfd, EPOLL_CTL_MOD, m->socket,
+		    &ev) == -1)
+			return (-1);
+		m->evloop_out = wantout;
+	}
+	*readable = 0;
+	n = epoll_wait(m->evloop_pollfd, events, 2, timeout);
+	if (n == -1)
+		return (errno == EINTR ? 0 : -1);
+	for (i = 0; i < n; i++) {
+		if (events[i].data.fd != m->socket)
+			evloop_drain(m);
+		else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			*readable = 1;
+	}
+#else
+	struct pollfd pfd[2];
+	int n;
+
+	pfd[0].fd = m->socket;
+	pfd[0].events = POLLIN | (wantout ? POLLOUT : 0);
+	pfd[1].fd = m->evloop_wakefd[0];
+	pfd[1].events = POLLIN;
+	*readable = 0;
+	n = poll(pfd, 2, timeout);
+	if (n == -1)
+		return (errno == EINTR ? 0 : -1);
+	if (pfd[1].revents & POLLIN)
+		evloop_drain(m);
+	if (pfd[0].revents & (POLLIN | POLLERR | POLLHUP))
+		*readable = 1;
+#endif
+	return (0);
+}
+
+/*
+ * Write as much as the socket takes from the iovecs, starting at
+ * index "*pos", and update the iovecs and "*pos" accordingly.
+ */
+static int
+evloop_write(struct mux *m, struct iovec *iov, int *pos, int iovcnt)
+{
+	ssize_t n;
+
+	n = writev(m->socket, iov + *pos, iovcnt - *pos);
+	if (n == -1)
+		return (errno == EAGAIN || errno == EINTR ? 0 : -1);
+	while (*pos < iovcnt && (size_t)n >= iov[*pos].iov_len) {
+		n -= iov[*pos].iov_len;
+		(*pos)++;
+	}
+	if (n > 0) {
+		iov[*pos].iov_base = (char *)iov[*pos].iov_base + n;
+		iov[*pos].iov_len -= n;
+	}
+	return (0);
+}
+
+static void
+evloop_wakeup(struct mux *m)
+{
+#ifdef __linux__
+
+	(void)eventfd_write(m->evloop_wakefd[1], 1);
+#else
+	char c;
+
+	/* If the pipe is full, the event loop will wake up anyway. */
+	c = 0;
+	(void)write(m->evloop_wakefd[1], &c, 1);
+#endif
+}
+
+static void
+evloop_drain(struct mux *m)
+{
+#ifdef __linux__
+	eventfd_t val;
+
+	(void)eventfd_read(m->evloop_wakefd[0], &val);
+#else
+	char buf[64];
+
+	while (read(m->evloop_wakefd[0], buf, sizeof(buf)) > 0)
+		;
+#endif
+}
+
 /*
  * Circular buffers API.
  */
@@ -1116,6 +2174,8 @@ buf_new(size_t size)
 	buf->size = size;
 	buf->in = 0;
 	buf->out = 0;
+	buf->growing = 0;
+	buf->busy = 0;
 	return (buf);
 }
 
@@ -1131,12 +2191,14 @@ buf_free(struct buf *buf)
 static size_t
 buf_count(struct buf *buf)
 {
-	size_t count;
+	size_t count, in, out;
 
-	if (buf->in >= buf->out)
-		count = buf->in - buf->out;
+	in = __atomic_load_n(&buf->in, __ATOMIC_SEQ_CST);
+	out = __atomic_load_n(&buf->out, __ATOMIC_SEQ_CST);
+	if (in >= out)
+		count = in - out;
 	else
-		count = buf->size + 1 + buf->in - buf->out;
+		count = buf->size + 1 + in - out;
 	return (count);
 }
 
@@ -1144,57 +2206,250 @@ buf_count(struct buf *buf)
 static size_t
 buf_avail(struct buf *buf)
 {
-	size_t avail;
+	size_t avail, in, out;
 
-	if (buf->out > buf->in)
-		avail = buf->out - buf->in - 1;
+	in = __atomic_load_n(&buf->in, __ATOMIC_SEQ_CST);
+	out = __atomic_load_n(&buf->out, __ATOMIC_SEQ_CST);
+	if (out > in)
+		avail = out - in - 1;
 	else
-		avail = buf->size + buf->out - buf->in;
+		avail = buf->size + out - in;
 	return (avail);
 }
 
+/* Copy bytes into the buffer at the given offset, wrapping around. */
 static void
-buf_put(struct buf *buf, const void *data, size_t size)
+buf_copyin(struct buf *buf, size_t in, const void *data, size_t size)
 {
 	const char *cp;
 	size_t len;
 
 	assert(size > 0);
-	assert(buf_avail(buf) >= size);
 	cp = data;
-	len = buf->size + 1 - buf->in;
+	len = buf->size + 1 - in;
 	if (len < size) {
 		/* Wrapping around. */
-		memcpy(buf->data + buf->in, cp, len);
+		memcpy(buf->data + in, cp, len);
 		memcpy(buf->data, cp + len, size - len);
 	} else {
 		/* Not wrapping around. */
-		memcpy(buf->data + buf->in, cp, size);
+		memcpy(buf->data + in, cp, size);
+	}
+}
+
+/* Publish "size" bytes the producer has added to the buffer. */
+static void
+buf_more(struct buf *buf, size_t size)
+{
+	size_t in;
+
+	assert(buf_avail(buf) >= size);
+	in = buf->in + size;
+	if (in > buf->size)
+		in -= buf->size + 1;
+	__atomic_store_n(&buf->in, in, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The autotuning code grows a buffer from the thread at one end of it,
+ * with the channel locked, while the thread at the other end uses it
+ * without the lock between buf_enter() and buf_leave().  Each of them
+ * sets its own flag before looking at the other's, as in Dekker's
+ * algorithm, so they can't both get in.  Returns 0 if the buffer is
+ * being grown, in which case the caller waits for the channel lock and
+ * tries again.
+ */
+static int
+buf_enter(struct buf *buf)
+{
+
+	__atomic_store_n(&buf->busy, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&buf->growing, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&buf->busy, 0, __ATOMIC_RELEASE);
+		return (0);
 	}
-	buf->in += size;
-	if (buf->in > buf->size)
-		buf->in -= buf->size + 1;
+	return (1);
+}
+
+static void
+buf_leave(struct buf *buf)
+{
+
+	__atomic_store_n(&buf->busy, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Grow the buffer unless the other end is using it, see buf_enter().
+ * Has to be called with the channel locked.  Returns 1 if the buffer
+ * has been grown.
+ */
+static int
+buf_trygrow(struct buf *buf, size_t size)
+{
+	int busy;
+
+	__atomic_store_n(&buf->growing, 1, __ATOMIC_SEQ_CST);
+	busy = __atomic_load_n(&buf->busy, __ATOMIC_SEQ_CST);
+	if (!busy)
+		buf_grow(buf, size);
+	__atomic_store_n(&buf->growing, 0, __ATOMIC_RELEASE);
+	return (!busy);
+}
+
+/*
+ * Grow the buffer to the given size, preserving its contents.  The
+ * caller must make sure nobody is accessing the buffer concurrently.
+ */
+static void
+buf_grow(struct buf *buf, size_t size)
+{
+	uint8_t *data;
+	size_t count;
+
+	assert(size > buf->size);
+	data = xmalloc(size + 1);
+	count = buf_count(buf);
+	if (count > 0)
+		buf_copyout(buf, buf->out, data, count);
+	free(buf->data);
+	buf->data = data;
+	buf->size = size;
+	buf->in = count;
+	buf->out = 0;
+}
+
+/* Double "size" until it is at least "need", up to the autotuning limit. */
+static size_t
+buf_newsize(size_t size, size_t need)
+{
+
+	while (size < need && size < CHAN_MAXBUFSIZE)
+		size *= 2;
+	return (min(size, CHAN_MAXBUFSIZE));
 }
 
+/* Copy bytes out of the buffer from the given offset, wrapping around. */
 static void
-buf_get(struct buf *buf, void *data, size_t size)
+buf_copyout(struct buf *buf, size_t out, void *data, size_t size)
 {
 	char *cp;
 	size_t len;
 
 	assert(size > 0);
-	assert(buf_count(buf) >= size);
 	cp = data;
-	len = buf->size + 1 - buf->out;
+	len = buf->size + 1 - out;
 	if (len < size) {
 		/* Wrapping around. */
-		memcpy(cp, buf->data + buf->out, len);
+		memcpy(cp, buf->data + out, len);
 		memcpy(cp + len, buf->data, size - len);
 	} else {
 		/* Not wrapping around. */
-		memcpy(cp, buf->data + buf->out, size);
+		memcpy(cp, buf->data + out, size);
 	}
-	buf->out += size;
-	if (buf->out > buf->size)
-		buf->out -= buf->size + 1;
+}
+
+/* Release "size" bytes the consumer has removed from the buffer. */
+static void
+buf_less(struct buf *buf, size_t size)
+{
+	size_t out;
+
+	assert(buf_count(buf) >= size);
+	out = buf->out + size;
+	if (out > buf->size)
+		out -= buf->size + 1;
+	__atomic_store_n(&buf->out, out, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Wait queues API.
+ *
+ * On Linux, waiting is done with a futex(2) on the sequence number,
+ * elsewhere with a condition variable.
+ */
+
+static void
+waitq_init(struct waitq *wq)
+{
+
+	wq->seq = 0;
+	wq->waiters = 0;
+#ifndef __linux__
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+#endif
+}
+
+static void
+waitq_fini(struct waitq *wq)
+{
+
+#ifdef __linux__
+	(void)wq;
+#else
+	pthread_cond_destroy(&wq->cond);
+	pthread_mutex_destroy(&wq->lock);
+#endif
+}
+
+/*
+ * Announce that we are going to wait.  Returns the key to pass to
+ * waitq_wait() once the caller has checked its condition again.
+ */
+static unsigned int
+waitq_prepare(struct waitq *wq)
+{
+
+	__atomic_fetch_add(&wq->waiters, 1, __ATOMIC_SEQ_CST);
+	return (__atomic_load_n(&wq->seq, __ATOMIC_SEQ_CST));
+}
+
+/* The condition became true after waitq_prepare(), don't wait. */
+static void
+waitq_cancel(struct waitq *wq)
+{
+
+	__atomic_fetch_sub(&wq->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sleep unless waitq_wakeup() has been called since waitq_prepare()
+ * returned "key".  This may return early, the callers check again.
+ */
+static void
+waitq_wait(struct waitq *wq, unsigned int key)
+{
+
+#ifdef __linux__
+	(void)syscall(SYS_futex, &wq->seq, FUTEX_WAIT_PRIVATE, key, NULL,
+	    NULL, 0);
+#else
+	pthread_mutex_lock(&wq->lock);
+	while (__atomic_load_n(&wq->seq, __ATOMIC_SEQ_CST) == key)
+		pthread_cond_wait(&wq->cond, &wq->lock);
+	pthread_mutex_unlock(&wq->lock);
+#endif
+	__atomic_fetch_sub(&wq->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Wake up the waiters, if any.  This must be called after publishing
+ * the change they are waiting for.
+ */
+static void
+waitq_wakeup(struct waitq *wq)
+{
+
+	if (__atomic_load_n(&wq->waiters, __ATOMIC_SEQ_CST) == 0)
+		return;
+#ifdef __linux__
+	__atomic_fetch_add(&wq->seq, 1, __ATOMIC_SEQ_CST);
+	(void)syscall(SYS_futex, &wq->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+	    NULL, 0);
+#else
+	pthread_mutex_lock(&wq->lock);
+	__atomic_fetch_add(&wq->seq, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+#endif
 }
@@ -26,14 +26,25 @@
 #ifndef _MUX_H_
 #define _MUX_H_
 
+/* Upper bound for the channel buffers, and thus the advertised window. */
+#define	MUX_MAXWINSIZE		(16 * 1024 * 1024)
+
+/* Multiplexer backends. */
+#define	MUX_BACKEND_THREADS	0	/* Sender and receiver threads. */
+#define	MUX_BACKEND_EVLOOP	1	/* Single event loop thread. */
+
 struct mux;
 struct chan;
 
-struct mux	*mux_open(int, struct chan **);
+struct mux	*mux_open(int, int, size_t, struct chan **);
+struct mux	*mux_accept(int, int, size_t, struct chan **);
 void		 mux_shutdown(struct mux *, const char *, int);
 int		 mux_close(struct mux *);
+void		 mux_report(struct mux *, int);
+void		 mux_segments(struct mux *, unsigned long *, unsigned long *);
 
 void		 chan_wait(struct chan *);
+int		 chan_backlog(struct chan *);
 int		 chan_listen(struct mux *);
 struct chan	*chan_accept(struct mux *, int);
 ssize_t		 chan_read(struct chan *, void *, size_t);
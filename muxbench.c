@@ -0,0 +1,302 @@
+/*-
+ * Copyright (c) 2012, Maxime Henrion <mux@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Loopback benchmark for the multiplexer.  Both ends of a socketpair
+ * run a multiplexer, one of them pushes messages of a given size on
+ * channel 0 and the other one reads them back, measuring throughput and
+ * the one-way latency of each message.  This doesn't need a server, and
+ * is meant to evaluate changes to the multiplexer code in isolation.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "misc.h"
+#include "mux.h"
+
+#define	BENCH_DEFVOLUME		64		/* In megabytes. */
+
+int verbose = 0;
+
+struct bench {
+	int backend;
+	size_t winsize;
+	size_t msgsize;
+	size_t nmsgs;
+	int sock;
+	struct mux *mux;
+	struct chan *chan;
+};
+
+static void	 usage(char *);
+static double	 now(void);
+static void	*bench_accept(void *);
+static void	*bench_writer(void *);
+static int	 bench_cmp(const void *, const void *);
+static void	 bench_run(int, size_t, size_t, size_t);
+
+static void
+usage(char *argv0)
+{
+
+	fprintf(stderr, "Usage: %s [options] [msgsize ...]\n",
+	    basename(argv0));
+	fprintf(stderr, "  Options:\n");
+	fprintf(stderr, "    %-12s %s\n", "-M backend",
+	    "Multiplexer backend: \"threads\" (default) or \"evloop\"");
+	fprintf(stderr, "    %-12s %s\n", "-n volume",
+	    "Megabytes to transfer for each message size (default 64)");
+	fprintf(stderr, "    %-12s %s\n", "-v",
+	    "Print multiplexer statistics after each run");
+	fprintf(stderr, "    %-12s %s\n", "-W size",
+	    "Multiplexer window size in KB (default autotuned)");
+}
+
+/* Monotonic time in seconds. */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void *
+bench_accept(void *arg)
+{
+	struct bench *b;
+
+	b = arg;
+	b->mux = mux_accept(b->sock, b->backend, b->winsize, &b->chan);
+	return (NULL);
+}
+
+/*
+ * Write the messages, each of them starting with the time at which it
+ * was handed to the multiplexer if it's large enough to hold it.
+ */
+static void *
+bench_writer(void *arg)
+{
+	struct bench *b;
+	char *buf;
+	double t;
+	size_t i;
+
+	b = arg;
+	buf = xmalloc(b->msgsize);
+	memset(buf, 0, b->msgsize);
+	for (i = 0; i < b->nmsgs; i++) {
+		if (b->msgsize >= sizeof(t)) {
+			t = now();
+			memcpy(buf, &t, sizeof(t));
+		}
+		if (chan_write(b->chan, buf, b->msgsize) == -1)
+			err(1, "chan_write");
+	}
+	free(buf);
+	chan_close(b->chan);
+	return (NULL);
+}
+
+static int
+bench_cmp(const void *p1, const void *p2)
+{
+	double d1, d2;
+
+	d1 = *(const double *)p1;
+	d2 = *(const double *)p2;
+	if (d1 < d2)
+		return (-1);
+	return (d1 > d2);
+}
+
+static void
+bench_run(int backend, size_t winsize, size_t msgsize, size_t volume)
+{
+	struct bench client, server;
+	pthread_t thread;
+	unsigned long segs, unused;
+	double elapsed, start, t, *lat;
+	size_t i, nlat, off;
+	ssize_t n;
+	char *buf;
+	int error, sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		err(1, "socketpair");
+	memset(&client, 0, sizeof(client));
+	client.backend = backend;
+	client.winsize = winsize;
+	client.msgsize = msgsize;
+	client.nmsgs = volume / msgsize;
+	client.sock = sv[0];
+	server = client;
+	server.sock = sv[1];
+
+	/* The server end blocks until the client has started up. */
+	error = pthread_create(&thread, NULL, bench_accept, &server);
+	if (error)
+		errx(1, "pthread_create: %s", strerror(error));
+	client.mux = mux_open(client.sock, backend, winsize, &client.chan);
+	pthread_join(thread, NULL);
+	if (client.mux == NULL || server.mux == NULL)
+		errx(1, "Cannot open the multiplexer");
+
+	buf = xmalloc(msgsize);
+	lat = xmalloc(client.nmsgs * sizeof(*lat));
+	nlat = 0;
+	start = now();
+	error = pthread_create(&thread, NULL, bench_writer, &client);
+	if (error)
+		errx(1, "pthread_create: %s", strerror(error));
+	for (i = 0; i < client.nmsgs; i++) {
+		for (off = 0; off < msgsize; off += n) {
+			n = chan_read(server.chan, buf + off, msgsize - off);
+			if (n == -1)
+				err(1, "chan_read");
+			if (n == 0)
+				errx(1, "Premature EOF");
+		}
+		if (msgsize >= sizeof(t)) {
+			memcpy(&t, buf, sizeof(t));
+			lat[nlat++] = now() - t;
+		}
+	}
+	elapsed = now() - start;
+	pthread_join(thread, NULL);
+	chan_close(server.chan);
+	chan_wait(server.chan);
+	chan_wait(client.chan);
+	mux_segments(client.mux, &segs, &unused);
+
+	printf("%8lu %10.1f %10.0f %10.0f", (unsigned long)msgsize,
+	    (double)client.nmsgs * msgsize / elapsed / (1024 * 1024),
+	    segs / elapsed, client.nmsgs / elapsed);
+	if (nlat > 0) {
+		qsort(lat, nlat, sizeof(*lat), bench_cmp);
+		printf(" %10.1f %10.1f\n", lat[nlat / 2] * 1e6,
+		    lat[nlat * 99 / 100] * 1e6);
+	} else {
+		printf(" %10s %10s\n", "-", "-");
+	}
+	if (verbose >= 2) {
+		mux_report(client.mux, 2);
+		mux_report(server.mux, 2);
+	}
+
+	/* Both ends have to be stopped before closing the sockets. */
+	mux_shutdown(client.mux, NULL, STATUS_SUCCESS);
+	mux_shutdown(server.mux, NULL, STATUS_SUCCESS);
+	(void)mux_close(client.mux);
+	(void)mux_close(server.mux);
+	close(sv[0]);
+	close(sv[1]);
+	free(lat);
+	free(buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const size_t defsizes[] = { 64, 1024, 16384, 65536 };
+	char *argv0;
+	size_t winsize;
+	int backend, c, i, msgsize, volume, wsize;
+
+	argv0 = argv[0];
+	backend = MUX_BACKEND_THREADS;
+	volume = BENCH_DEFVOLUME;
+	wsize = 0;
+	while ((c = getopt(argc, argv, "M:n:vW:")) != -1) {
+		switch (c) {
+		case 'M':
+			if (strcmp(optarg, "threads") == 0)
+				backend = MUX_BACKEND_THREADS;
+			else if (strcmp(optarg, "evloop") == 0)
+				backend = MUX_BACKEND_EVLOOP;
+			else {
+				usage(argv0);
+				return (1);
+			}
+			break;
+		case 'n':
+			if (asciitoint(optarg, &volume, 0) || volume <= 0) {
+				usage(argv0);
+				return (1);
+			}
+			break;
+		case 'v':
+			/* Print the multiplexer statistics after each run. */
+			verbose = 2;
+			break;
+		case 'W':
+			if (asciitoint(optarg, &wsize, 0) || wsize <= 0 ||
+			    wsize > MUX_MAXWINSIZE / 1024) {
+				usage(argv0);
+				return (1);
+			}
+			break;
+		case '?':
+		default:
+			usage(argv0);
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	winsize = (size_t)wsize * 1024;
+
+	printf("%8s %10s %10s %10s %10s %10s\n", "msgsize", "MB/s",
+	    "frames/s", "msgs/s", "p50 (us)", "p99 (us)");
+	if (argc == 0) {
+		for (i = 0; i < (int)(sizeof(defsizes) / sizeof(defsizes[0])); i++)
+			bench_run(backend, winsize, defsizes[i],
+			    (size_t)volume * 1024 * 1024);
+		return (0);
+	}
+	for (i = 0; i < argc; i++) {
+		if (asciitoint(argv[i], &msgsize, 0) || msgsize <= 0) {
+			usage(argv0);
+			return (1);
+		}
+		bench_run(backend, winsize, msgsize,
+		    (size_t)volume * 1024 * 1024);
+	}
+	return (0);
+}
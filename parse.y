@@ -40,6 +40,7 @@
 %token DEFAULT
 %token <i> NAME
 %token <i> BOOLEAN
+%token <i> OPTVALUE
 %token EQUAL
 %token <str> STRING
 
@@ -78,6 +79,10 @@ options
 option
 	: BOOLEAN
 		{ coll_setopt($1, NULL); }
+	| OPTVALUE
+		{ coll_setopt($1, NULL); }
+	| OPTVALUE EQUAL STRING
+		{ coll_setopt($1, $3); }
 	| value
 	;
 
@@ -49,6 +49,7 @@
 #include "fattr.h"
 #include "fixups.h"
 #include "globtree.h"
+#include "hashcache.h"
 #include "keyword.h"
 #include "lister.h"
 #include "misc.h"
@@ -66,6 +67,13 @@ struct killer {
 	int killedby;
 };
 
+/* Signals asking for a report of the multiplexer statistics. */
+#ifdef SIGINFO
+#define	KILLER_ISREPORT(sig)	((sig) == SIGINFO || (sig) == SIGUSR1)
+#else
+#define	KILLER_ISREPORT(sig)	((sig) == SIGUSR1)
+#endif
+
 static void		 killer_init(struct killer *);
 static void		 killer_start(struct killer *, struct mux *);
 static void		*killer_run(void *);
@@ -77,6 +85,8 @@ static int		 proto_negproto(struct config *);
 static int		 proto_fileattr(struct config *);
 static int		 proto_xchgcoll(struct config *);
 static struct mux	*proto_mux(struct config *);
+static void		 proto_openhashes(struct config *);
+static void		 proto_closehashes(struct config *);
 
 static int		 proto_escape(struct stream *, const char *);
 static void		 proto_unescape(char *);
@@ -497,7 +507,8 @@ proto_mux(struct config *config)
 	lprintf(2, "Establishing multiplexed-mode data connection\n");
 	proto_printf(s, "MUX\n");
 	stream_flush(s);
-	m = mux_open(config->socket, &chan0);
+	m = mux_open(config->socket, config->muxbackend,
+	    config->winsize, &chan0);
 	if (m == NULL) {
 		lprintf(-1, "Cannot open the multiplexer\n");
 		return (NULL);
@@ -522,6 +533,50 @@ proto_mux(struct config *config)
 	return (m);
 }
 
+/*
+ * Load the checksum caches of the collections we are going to update.
+ */
+static void
+proto_openhashes(struct config *config)
+{
+	struct coll *coll;
+	char *path;
+
+	STAILQ_FOREACH(coll, &config->colls, co_next) {
+		if (coll->co_options & CO_SKIP)
+			continue;
+		path = coll_hashcachepath(coll);
+		coll->co_hashcache = hashcache_open(path);
+		free(path);
+	}
+}
+
+/*
+ * Write back the checksum caches.  Even if the update failed, what the
+ * caches hold is still valid since every entry is tied to the file's
+ * inode and timestamps, so we always save them.
+ */
+static void
+proto_closehashes(struct config *config)
+{
+	struct coll *coll;
+	char *path;
+
+	STAILQ_FOREACH(coll, &config->colls, co_next) {
+		if (coll->co_hashcache == NULL)
+			continue;
+		if (hashcache_save(coll->co_hashcache) == -1 &&
+		    errno != ENOENT) {
+			path = coll_hashcachepath(coll);
+			lprintf(-1, "Cannot save checksum cache \"%s\": %s\n",
+			    path, strerror(errno));
+			free(path);
+		}
+		hashcache_free(coll->co_hashcache);
+		coll->co_hashcache = NULL;
+	}
+}
+
 /*
  * Initializes the connection to the CVSup server, that is handle
  * the protocol negotiation, logging in, exchanging file attributes
@@ -568,6 +623,7 @@ proto_run(struct config *config)
 	config->server = NULL;
 	config->fixups = fixups_new();
 	killer_start(&killer, m);
+	proto_openhashes(config);
 
 	/* Start the worker threads. */
 	workers = threads_new();
@@ -620,6 +676,7 @@ proto_run(struct config *config)
 		}
 	}
 	threads_free(workers);
+	proto_closehashes(config);
 	if (status == STATUS_SUCCESS) {
 		lprintf(2, "Shutting down connection to server\n");
 		chan_close(config->chan0);
@@ -630,6 +687,8 @@ proto_run(struct config *config)
 	}
 	killer_stop(&killer);
 	fixups_free(config->fixups);
+	mux_report(m, 2);
+	stream_zreport(2);
 	status = mux_close(m);
 	if (status == STATUS_SUCCESS) {
 		lprintf(1, "Finished successfully\n");
@@ -937,6 +996,26 @@ proto_get_sizet(char **s, size_t *val, int base)
 	return (0);
 }
 
+/*
+ * Get an off_t token.
+ */
+int
+proto_get_off(char **s, off_t *val)
+{
+	long long tmp;
+	char *cp, *end;
+
+	cp = proto_get_ascii(s);
+	if (cp == NULL)
+		return (-1);
+	errno = 0;
+	tmp = strtoll(cp, &end, 10);
+	if (errno || *end != '\0')
+		return (-1);
+	*val = (off_t)tmp;
+	return (0);
+}
+
 /*
  * Get a time_t token.
  *
@@ -975,6 +1054,10 @@ killer_init(struct killer *k)
 	sigaddset(&k->sigset, SIGHUP);
 	sigaddset(&k->sigset, SIGTERM);
 	sigaddset(&k->sigset, SIGPIPE);
+	sigaddset(&k->sigset, SIGUSR1);
+#ifdef SIGINFO
+	sigaddset(&k->sigset, SIGINFO);
+#endif
 	pthread_sigmask(SIG_BLOCK, &k->sigset, NULL);
 }
 
@@ -1011,6 +1094,14 @@ again:
 			    STATUS_INTERRUPTED);
 			pthread_setcancelstate(old, NULL);
 		}
+	} else if (KILLER_ISREPORT(sig)) {
+		/*
+		 * mux_report() holds the multiplexer lock while printing,
+		 * so we can't get canceled in the middle of it either.
+		 */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+		mux_report(k->mux, 0);
+		pthread_setcancelstate(old, NULL);
 	}
 	goto again;
 	return (NULL);
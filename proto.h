@@ -44,6 +44,7 @@ int	 proto_get_char(char **);
 char	*proto_get_rest(char **);
 int	 proto_get_int(char **, int *, int);
 int	 proto_get_sizet(char **, size_t *, int);
+int	 proto_get_off(char **, off_t *);
 int	 proto_get_time(char **, time_t *);
 
 #endif /* !_PROTO_H_ */
@@ -29,24 +29,57 @@
 #include <sys/mman.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define	HAVE_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "misc.h"
 #include "rsyncfile.h"
+#include "stream.h"
 
 #define MINBLOCKSIZE 1024
-#define MAXBLOCKSIZE (16 * 1024)
-#define RECEIVEBUFFERSIZE (15 * 1024)
-#define BLOCKINFOSIZE 26
+#define MAXBLOCKSIZE (128 * 1024)
 #define SEARCHREGION 10
-#define MAXBLOCKS (RECEIVEBUFFERSIZE / BLOCKINFOSIZE)
 
 #define CHAR_OFFSET 3
 #define RSUM_SIZE 9
 
+/*
+ * Blocks are checksummed in chunks of this size, so that the data is
+ * still in the cache when we compute the rolling checksum after the MD5.
+ */
+#define CHUNKSIZE (8 * 1024)
+
+/*
+ * The rolling checksum adds up the bytes of the file as chars, which
+ * are signed on most platforms.  We have to do the same in the vector
+ * versions, or we would compute different sums than the scalar code.
+ */
+#if CHAR_MIN < 0
+#define	ROLLSUM_WIDEN(v)	_mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8)
+#define	ROLLSUM_WIDENHI(v)	_mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8)
+#define	ROLLSUM_WIDEN256(v)	_mm256_cvtepi8_epi16(v)
+#else
+#define	ROLLSUM_WIDEN(v)	_mm_unpacklo_epi8(v, _mm_setzero_si128())
+#define	ROLLSUM_WIDENHI(v)	_mm_unpackhi_epi8(v, _mm_setzero_si128())
+#define	ROLLSUM_WIDEN256(v)	_mm256_cvtepu8_epi16(v)
+#endif
+
+typedef rsync_rollsumfn_t rollsumfn_t;
+
 struct rsyncfile {
 	char *start;
 	char *buf;
@@ -56,14 +89,28 @@ struct rsyncfile {
 	int fd;
 
 	char *blockptr;
-	int blocknum;
+	off_t blocknum;
 	char blockmd5[MD5_DIGEST_SIZE];
 	char rsumstr[RSUM_SIZE];
 	uint32_t rsum;
 };
 
 static size_t		rsync_chooseblocksize(off_t);
-static uint32_t		rsync_rollsum(char *, size_t);
+static off_t		rsync_isqrt(off_t);
+static void		rsync_rollsum_init(void);
+static void		rsync_rollsum(const char *, size_t, uint32_t *,
+			    uint32_t *);
+static rollsumfn_t	rsync_rollsum_scalar;
+#if defined(HAVE_AVX2) || defined(__SSE2__)
+static rollsumfn_t	rsync_rollsum_sse2;
+#endif
+#ifdef HAVE_AVX2
+static rollsumfn_t	rsync_rollsum_avx2;
+#endif
+static void		rsync_hex(char *, uint32_t);
+
+static pthread_once_t	rollsum_once = PTHREAD_ONCE_INIT;
+static rollsumfn_t	*rollsum_fn = rsync_rollsum_scalar;
 
 /* Open a file and initialize variable for rsync operation. */
 struct rsyncfile *
@@ -81,23 +128,37 @@ rsync_open(char *path, size_t blocksize, int rdonly)
 	}
 	rf->fsize = st.st_size;
 
-	rf->fd = open(path, rdonly ? O_RDONLY : O_RDWR);
-	if (rf->fd < 0) {
+	/* We can't map files bigger than the address space. */
+	if ((uintmax_t)rf->fsize > SIZE_MAX) {
 		free(rf);
+		errno = EFBIG;
 		return (NULL);
 	}
-	rf->buf = mmap(0, rf->fsize, PROT_READ, MAP_SHARED, rf->fd, 0);
-	if (rf->buf == MAP_FAILED) {
-		close(rf->fd);
+
+	rf->fd = open(path, rdonly ? O_RDONLY : O_RDWR);
+	if (rf->fd < 0) {
 		free(rf);
 		return (NULL);
 	}
+	/* Empty files have no blocks, and mmap() won't map 0 bytes. */
+	if (rf->fsize == 0) {
+		rf->buf = NULL;
+	} else {
+		rf->buf = mmap(0, (size_t)rf->fsize, PROT_READ, MAP_SHARED,
+		    rf->fd, 0);
+		if (rf->buf == MAP_FAILED) {
+			close(rf->fd);
+			free(rf);
+			return (NULL);
+		}
+	}
 	rf->start = rf->buf;
 	rf->end = rf->buf + rf->fsize;
 	rf->blocksize = blocksize == 0 ? rsync_chooseblocksize(rf->fsize) :
 	    blocksize;
 	rf->blockptr = rf->buf;
 	rf->blocknum = 0;
+	pthread_once(&rollsum_once, rsync_rollsum_init);
 	return (rf);
 }
 
@@ -107,84 +168,315 @@ rsync_close(struct rsyncfile *rf)
 {
 	int error;
 
-	error = munmap(rf->buf, rf->fsize);
-	assert(!error);
+	if (rf->buf != NULL) {
+		error = munmap(rf->buf, (size_t)rf->fsize);
+		assert(!error);
+	}
 	error = close(rf->fd);
 	assert(!error);
 	free(rf);
 }
 
 /*
- * Choose the most appropriate block size for an rsync transfer. Modeled
- * algorithm after cvsup.
+ * Choose the most appropriate block size for an rsync transfer.  We
+ * use blocks of about sqrt(fsize) bytes, which keeps both the size of
+ * the block list we send and the amount of data sent again for each
+ * mismatching block growing as sqrt(fsize), within MINBLOCKSIZE and
+ * MAXBLOCKSIZE.  Like cvsup, we then look around that size for the one
+ * leaving the smallest partial block at the end of the file.
  */
 static size_t
 rsync_chooseblocksize(off_t fsize)
 {
-	size_t bestrem, blocksize, bs, hisearch, losearch, rem;
-
-	blocksize = fsize / MAXBLOCKS;
-	losearch = blocksize - SEARCHREGION;
-	hisearch = blocksize + SEARCHREGION;
+	size_t blocksize, bs, hisearch, losearch;
+	off_t bestrem, rem, target;
 
-	if (losearch < MINBLOCKSIZE) {
+	target = rsync_isqrt(fsize);
+	if (target < MINBLOCKSIZE + SEARCHREGION) {
 		losearch = MINBLOCKSIZE;
 		hisearch = losearch + (2 * SEARCHREGION);
-	} else if (hisearch > MAXBLOCKSIZE) {
+	} else if (target > MAXBLOCKSIZE - SEARCHREGION) {
 		hisearch = MAXBLOCKSIZE;
 		losearch = hisearch - (2 * SEARCHREGION);
+	} else {
+		losearch = (size_t)target - SEARCHREGION;
+		hisearch = (size_t)target + SEARCHREGION;
 	}
 
-	bestrem = MAXBLOCKSIZE;
-	for (bs = losearch; bs <= hisearch; bs++) {
+	blocksize = losearch;
+	bestrem = fsize % losearch;
+	for (bs = losearch + 1; bs <= hisearch && bestrem > 0; bs++) {
 		rem = fsize % bs;
 		if (rem < bestrem) {
 			bestrem = rem;
 			blocksize = bs;
 		}
 	}
-	return (bestrem);
+	return (blocksize);
+}
+
+/* Integer square root, rounded down. */
+static off_t
+rsync_isqrt(off_t n)
+{
+	off_t x, y;
+
+	if (n < 2)
+		return (n);
+	x = n;
+	y = (x + 1) / 2;
+	while (y < x) {
+		x = y;
+		y = (x + n / x) / 2;
+	}
+	return (x);
 }
 
-/* Get the next rsync block of a file. */
+/*
+ * Get the next rsync block of a file.  The MD5 and the rolling checksum
+ * of the block are computed in a single pass over the data.
+ */
 int
 rsync_nextblock(struct rsyncfile *rf)
 {
 	MD5_CTX ctx;
-	size_t blocksize;
+	size_t blocksize, len, off;
+	uint32_t a, b;
 
 	if (rf->blockptr >= rf->end)
 		return (0);
 	blocksize = min((size_t)(rf->end - rf->blockptr), rf->blocksize);
-	/* Calculate MD5 of the block. */
 	MD5_Init(&ctx);
-	MD5_Update(&ctx, rf->blockptr, blocksize);
+	a = b = 0;
+	for (off = 0; off < blocksize; off += len) {
+		len = min(blocksize - off, CHUNKSIZE);
+		MD5_Update(&ctx, rf->blockptr + off, len);
+		rsync_rollsum(rf->blockptr + off, len, &a, &b);
+	}
 	MD5_End(rf->blockmd5, &ctx);
-
-	rf->rsum = rsync_rollsum(rf->blockptr, blocksize);
-	snprintf(rf->rsumstr, RSUM_SIZE, "%x", rf->rsum);
+	rf->rsum = (b << 16) | a;
+	rsync_hex(rf->rsumstr, rf->rsum);
 	rf->blocknum++;
 	rf->blockptr += blocksize;
 	return (1);
 }
 
-/* Get the rolling checksum of a file. */
-static uint32_t
-rsync_rollsum(char *buf, size_t len)
+/* Pick the fastest implementation of the rolling checksum we can use. */
+static void
+rsync_rollsum_init(void)
+{
+
+#ifdef HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		rollsum_fn = rsync_rollsum_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		rollsum_fn = rsync_rollsum_sse2;
+#elif defined(__SSE2__)
+	rollsum_fn = rsync_rollsum_sse2;
+#endif
+}
+
+/*
+ * Return the i-th implementation of the rolling checksum that this CPU
+ * can run and its name, or NULL if there are no more.  The first one is
+ * the scalar version, which all the others have to agree with.  This is
+ * only meant for rsynctest.c.
+ */
+rollsumfn_t *
+rsync_rollsum_variant(int i, const char **name)
+{
+
+	if (i-- == 0) {
+		*name = "scalar";
+		return (rsync_rollsum_scalar);
+	}
+#ifdef HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2") && i-- == 0) {
+		*name = "sse2";
+		return (rsync_rollsum_sse2);
+	}
+	if (__builtin_cpu_supports("avx2") && i-- == 0) {
+		*name = "avx2";
+		return (rsync_rollsum_avx2);
+	}
+#elif defined(__SSE2__)
+	if (i-- == 0) {
+		*name = "sse2";
+		return (rsync_rollsum_sse2);
+	}
+#endif
+	return (NULL);
+}
+
+/*
+ * Update the rolling checksum "a" and "b" sums with the bytes in "buf".
+ * For n bytes x[0..n-1], each counted as x[i] + CHAR_OFFSET, this adds
+ * the sum of the bytes to "a", and the sum of (n - i) * x[i], plus n
+ * times the previous value of "a", to "b".
+ */
+static void
+rsync_rollsum(const char *buf, size_t len, uint32_t *ap, uint32_t *bp)
+{
+
+	rollsum_fn(buf, len, ap, bp);
+}
+
+static void
+rsync_rollsum_scalar(const char *buf, size_t len, uint32_t *ap, uint32_t *bp)
 {
+	const char *ptr, *limit;
 	uint32_t a, b;
-	char *ptr, *limit;
 
-	a = b = 0;
+	a = *ap;
+	b = *bp;
 	ptr = buf;
 	limit = buf + len;
-
 	while (ptr < limit) {
 		a += *ptr + CHAR_OFFSET;
 		b += a;
 		ptr++;
 	}
-	return ((b << 16) | a);
+	*ap = a;
+	*bp = b;
+}
+
+#if defined(HAVE_AVX2) || defined(__SSE2__)
+/*
+ * The vector versions add up the bytes and the weighted bytes of each
+ * chunk of 16 (or 32) bytes in separate 32 bits lanes, and keep track
+ * of the running sum of "a" at the start of each chunk in "vp", which
+ * is scaled by the chunk size when computing "b" in the end.  All the
+ * arithmetic is modulo 2^32, just like in the scalar version.
+ */
+#ifdef HAVE_AVX2
+__attribute__((target("sse2")))
+#endif
+static void
+rsync_rollsum_sse2(const char *buf, size_t len, uint32_t *ap, uint32_t *bp)
+{
+	uint32_t lanes[4];
+	__m128i hi, lo, ones, v, va, vb, vp, w0, w1;
+	uint64_t n;
+	uint32_t a, b, sa, sb, sp;
+	size_t i, nchunks;
+	int j;
+
+	nchunks = len / 16;
+	if (nchunks == 0) {
+		rsync_rollsum_scalar(buf, len, ap, bp);
+		return;
+	}
+	ones = _mm_set1_epi16(1);
+	w0 = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+	w1 = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+	va = vb = vp = _mm_setzero_si128();
+	for (i = 0; i < nchunks; i++) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i * 16));
+		lo = ROLLSUM_WIDEN(v);
+		hi = ROLLSUM_WIDENHI(v);
+		vp = _mm_add_epi32(vp, va);
+		va = _mm_add_epi32(va, _mm_add_epi32(_mm_madd_epi16(lo, ones),
+		    _mm_madd_epi16(hi, ones)));
+		vb = _mm_add_epi32(vb, _mm_add_epi32(_mm_madd_epi16(lo, w0),
+		    _mm_madd_epi16(hi, w1)));
+	}
+	sa = sb = sp = 0;
+	_mm_storeu_si128((__m128i *)lanes, va);
+	for (j = 0; j < 4; j++)
+		sa += lanes[j];
+	_mm_storeu_si128((__m128i *)lanes, vb);
+	for (j = 0; j < 4; j++)
+		sb += lanes[j];
+	_mm_storeu_si128((__m128i *)lanes, vp);
+	for (j = 0; j < 4; j++)
+		sp += lanes[j];
+	n = (uint64_t)nchunks * 16;
+	a = *ap;
+	b = *bp;
+	b += (uint32_t)n * a + sp * 16 + sb +
+	    (uint32_t)(n * (n + 1) / 2) * CHAR_OFFSET;
+	a += sa + (uint32_t)n * CHAR_OFFSET;
+	*ap = a;
+	*bp = b;
+	rsync_rollsum_scalar(buf + n, len - n, ap, bp);
+}
+#endif
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+static void
+rsync_rollsum_avx2(const char *buf, size_t len, uint32_t *ap, uint32_t *bp)
+{
+	uint32_t lanes[8];
+	__m256i hi, lo, ones, va, vb, vp, w0, w1;
+	__m128i v0, v1;
+	uint64_t n;
+	uint32_t a, b, sa, sb, sp;
+	size_t i, nchunks;
+	int j;
+
+	nchunks = len / 32;
+	if (nchunks == 0) {
+		rsync_rollsum_sse2(buf, len, ap, bp);
+		return;
+	}
+	ones = _mm256_set1_epi16(1);
+	w0 = _mm256_setr_epi16(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22,
+	    21, 20, 19, 18, 17);
+	w1 = _mm256_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4,
+	    3, 2, 1);
+	va = vb = vp = _mm256_setzero_si256();
+	for (i = 0; i < nchunks; i++) {
+		v0 = _mm_loadu_si128((const __m128i *)(buf + i * 32));
+		v1 = _mm_loadu_si128((const __m128i *)(buf + i * 32 + 16));
+		lo = ROLLSUM_WIDEN256(v0);
+		hi = ROLLSUM_WIDEN256(v1);
+		vp = _mm256_add_epi32(vp, va);
+		va = _mm256_add_epi32(va, _mm256_add_epi32(
+		    _mm256_madd_epi16(lo, ones), _mm256_madd_epi16(hi, ones)));
+		vb = _mm256_add_epi32(vb, _mm256_add_epi32(
+		    _mm256_madd_epi16(lo, w0), _mm256_madd_epi16(hi, w1)));
+	}
+	sa = sb = sp = 0;
+	_mm256_storeu_si256((__m256i *)lanes, va);
+	for (j = 0; j < 8; j++)
+		sa += lanes[j];
+	_mm256_storeu_si256((__m256i *)lanes, vb);
+	for (j = 0; j < 8; j++)
+		sb += lanes[j];
+	_mm256_storeu_si256((__m256i *)lanes, vp);
+	for (j = 0; j < 8; j++)
+		sp += lanes[j];
+	n = (uint64_t)nchunks * 32;
+	a = *ap;
+	b = *bp;
+	b += (uint32_t)n * a + sp * 32 + sb +
+	    (uint32_t)(n * (n + 1) / 2) * CHAR_OFFSET;
+	a += sa + (uint32_t)n * CHAR_OFFSET;
+	*ap = a;
+	*bp = b;
+	rsync_rollsum_sse2(buf + n, len - n, ap, bp);
+}
+#endif
+
+/* Format a checksum in hexadecimal, like printf("%x") would. */
+static void
+rsync_hex(char *s, uint32_t val)
+{
+	static const char hex[] = "0123456789abcdef";
+	char tmp[8];
+	int i;
+
+	i = 0;
+	do {
+		tmp[i++] = hex[val & 0xf];
+		val >>= 4;
+	} while (val != 0);
+	while (i > 0)
+		*s++ = tmp[--i];
+	*s = '\0';
 }
 
 /* Get running sum so far. */
@@ -218,3 +510,717 @@ rsync_filesize(struct rsyncfile *rf)
 
 	return (rf->fsize);
 }
+
+/*
+ * In-place updates.
+ *
+ * Instead of building the new version of a file in a temporary file,
+ * we can apply the server's instructions to the file itself, so that
+ * only the changed parts are written.  The instructions are first
+ * recorded as a list of operations, each of them writing a range of
+ * the new file either from a range of the old file (a copy), or from
+ * the literal data sent by the server, which is saved in a separate
+ * data file (a data operation).  Copies whose source and destination
+ * are the same are simply dropped.
+ *
+ * Since a copy may read a part of the file that another operation
+ * overwrites, the copies have to be done before the operations writing
+ * over their source.  We sort the operations topologically according to
+ * this constraint, and break the cycles by saving the source of one of
+ * the copies in the data file, turning it into a data operation.  The
+ * copies whose source and destination overlap are split into chunks
+ * that don't, so that they also fit in this scheme.
+ *
+ * To recover from an interruption, the sorted operations are written to
+ * a journal before touching the file, along with the number of the ones
+ * that are known to be complete, which is updated as we go.  It is only
+ * necessary to update it before running an operation that overwrites
+ * the source of one that has run since the last update: up to there,
+ * running again the operations following the last update gives the
+ * same result.  The next time the file is detailed, rsync_recover()
+ * finishes the job if a journal is found.
+ */
+#define	PATCH_PREFIX	"#cvs.csup-inplace."
+#define	PATCH_VERSION	1
+#define	PATCH_BUFSIZE	(1024 * 1024)
+#define	PATCH_MINSHIFT	(64 * 1024)	/* Smallest copy chunk. */
+#define	PATCH_DONEWIDTH	20
+
+#define	PATCHOP_COPY	'C'
+#define	PATCHOP_DATA	'D'
+
+struct patchop {
+	int type;
+	int sync;		/* Update the journal before running it. */
+	off_t dst;
+	off_t src;		/* In the file or in the data file. */
+	off_t len;
+};
+
+struct rsyncpatch {
+	char *path;
+	char *jpath;
+	char *dpath;
+	int fd;
+	ino_t ino;
+	off_t oldsize;
+	off_t newsize;
+	struct stream *data;
+	off_t datalen;
+	int jfd;
+	off_t doneoff;		/* Offset of the counter in the journal. */
+	int started;
+	struct patchop *ops;
+	size_t nops;
+	size_t maxops;
+};
+
+static char		*rsync_patch_path(const char *, const char *);
+static struct patchop	*rsync_patch_addop(struct rsyncpatch *, int, off_t,
+			    off_t, off_t);
+static int		 rsync_patch_save(struct rsyncpatch *, struct patchop *);
+static int		 rsync_patch_split(struct rsyncpatch *);
+static int		 rsync_patch_sort(struct rsyncpatch *);
+static int		 rsync_patch_journal(struct rsyncpatch *);
+static int		 rsync_patch_run(struct rsyncpatch *, size_t);
+static int		 rsync_patch_done(struct rsyncpatch *, size_t);
+static int		 rsync_patch_copyrange(int, off_t, int, off_t, off_t);
+static void		 rsync_patch_close(struct rsyncpatch *);
+
+/*
+ * Start an in-place update of the file at "path".  The literal data
+ * from the server is to be written to the stream returned by
+ * rsync_patch_data(), and recorded with rsync_patch_literal().
+ */
+struct rsyncpatch *
+rsync_patch_new(const char *path)
+{
+	struct rsyncpatch *p;
+	struct stat st;
+
+	p = xmalloc(sizeof(struct rsyncpatch));
+	memset(p, 0, sizeof(struct rsyncpatch));
+	p->jfd = -1;
+	p->fd = open(path, O_RDWR);
+	if (p->fd == -1) {
+		free(p);
+		return (NULL);
+	}
+	if (fstat(p->fd, &st) == -1) {
+		close(p->fd);
+		free(p);
+		return (NULL);
+	}
+	p->ino = st.st_ino;
+	p->oldsize = st.st_size;
+	p->path = xstrdup(path);
+	p->jpath = rsync_patch_path(path, "");
+	p->dpath = rsync_patch_path(path, ".data");
+	/*
+	 * A journal left over at this point is from an update that
+	 * rsync_recover() couldn't finish, and the server is now working
+	 * from what the file looks like, so forget about it.
+	 */
+	(void)unlink(p->jpath);
+	p->data = stream_open_file(p->dpath, O_RDWR | O_CREAT | O_TRUNC,
+	    0600);
+	if (p->data == NULL) {
+		rsync_patch_free(p);
+		return (NULL);
+	}
+	return (p);
+}
+
+struct stream *
+rsync_patch_data(struct rsyncpatch *p)
+{
+
+	return (p->data);
+}
+
+/*
+ * Record that what has been written to the data stream since the last
+ * call comes next in the new file.
+ */
+int
+rsync_patch_literal(struct rsyncpatch *p)
+{
+	off_t end;
+
+	if (stream_flush(p->data) != 0)
+		return (-1);
+	end = lseek(stream_fileno(p->data), 0, SEEK_CUR);
+	if (end == -1)
+		return (-1);
+	if (end > p->datalen) {
+		rsync_patch_addop(p, PATCHOP_DATA, p->newsize, p->datalen,
+		    end - p->datalen);
+		p->newsize += end - p->datalen;
+		p->datalen = end;
+	}
+	return (0);
+}
+
+/*
+ * Record that "len" bytes from offset "src" in the old file come next
+ * in the new file.  Like when copying from the file, the range stops at
+ * the end of the old file.
+ */
+int
+rsync_patch_copy(struct rsyncpatch *p, off_t src, off_t len)
+{
+	struct patchop *op;
+
+	if (rsync_patch_literal(p) == -1)
+		return (-1);
+	if (src >= p->oldsize)
+		return (0);
+	len = min(len, p->oldsize - src);
+	if (src != p->newsize) {
+		op = p->nops > 0 ? &p->ops[p->nops - 1] : NULL;
+		if (op != NULL && op->type == PATCHOP_COPY &&
+		    op->src + op->len == src && op->dst + op->len == p->newsize)
+			op->len += len;
+		else
+			rsync_patch_addop(p, PATCHOP_COPY, p->newsize, src, len);
+	}
+	p->newsize += len;
+	return (0);
+}
+
+/*
+ * Apply the recorded operations to the file.  On failure, if the file
+ * has already been modified, the journal is left behind so that the
+ * update can be finished later.
+ */
+int
+rsync_patch_apply(struct rsyncpatch *p)
+{
+
+	if (rsync_patch_literal(p) == -1)
+		return (-1);
+	if (rsync_patch_split(p) == -1 || rsync_patch_sort(p) == -1 ||
+	    rsync_patch_journal(p) == -1)
+		return (-1);
+	p->started = 1;
+	return (rsync_patch_run(p, 0));
+}
+
+/* Free the resources of an in-place update. */
+void
+rsync_patch_free(struct rsyncpatch *p)
+{
+
+	rsync_patch_close(p);
+	if (!p->started) {
+		if (p->jpath != NULL)
+			(void)unlink(p->jpath);
+		if (p->dpath != NULL)
+			(void)unlink(p->dpath);
+	}
+	free(p->ops);
+	free(p->dpath);
+	free(p->jpath);
+	free(p->path);
+	free(p);
+}
+
+/*
+ * Finish an in-place update of the file at "path" that was interrupted,
+ * if there is one.  Returns 0 if there was nothing to do or if it went
+ * fine, -1 otherwise.
+ */
+int
+rsync_recover(const char *path)
+{
+	struct rsyncpatch *p;
+	struct stream *rd;
+	struct patchop *op;
+	struct stat st;
+	unsigned long long ino;
+	long long done, dst, len, newsize, src;
+	char *line, type;
+	int error, sync, version;
+
+	p = xmalloc(sizeof(struct rsyncpatch));
+	memset(p, 0, sizeof(struct rsyncpatch));
+	p->fd = -1;
+	p->jfd = -1;
+	p->path = xstrdup(path);
+	p->jpath = rsync_patch_path(path, "");
+	p->dpath = rsync_patch_path(path, ".data");
+	rd = stream_open_file(p->jpath, O_RDONLY);
+	if (rd == NULL) {
+		/* There may be a data file from an aborted update. */
+		error = errno == ENOENT ? 0 : -1;
+		rsync_patch_free(p);
+		return (error);
+	}
+	lprintf(1, " Recovering interrupted update of %s\n", path);
+	/* The journal is only valid for the file it was written for. */
+	error = -1;
+	errno = EINVAL;
+	line = stream_getln(rd, NULL);
+	if (line == NULL || sscanf(line, "INPLACE %d %llu %lld", &version,
+	    &ino, &newsize) != 3 || version != PATCH_VERSION)
+		goto bad;
+	p->doneoff = strlen(line) + 1 + strlen("DONE ");
+	line = stream_getln(rd, NULL);
+	if (line == NULL || sscanf(line, "DONE %lld", &done) != 1)
+		goto bad;
+	while ((line = stream_getln(rd, NULL)) != NULL) {
+		if (strcmp(line, ".") == 0)
+			break;
+		if (sscanf(line, "%c %d %lld %lld %lld", &type, &sync, &dst,
+		    &src, &len) != 5 ||
+		    (type != PATCHOP_COPY && type != PATCHOP_DATA))
+			goto bad;
+		op = rsync_patch_addop(p, type, dst, src, len);
+		op->sync = sync;
+	}
+	if (line == NULL || done < 0 || (size_t)done > p->nops)
+		goto bad;
+	p->newsize = newsize;
+	p->fd = open(path, O_RDWR);
+	if (p->fd == -1 || fstat(p->fd, &st) == -1)
+		goto bad;
+	if (st.st_ino != (ino_t)ino) {
+		lprintf(-1, "Discarding stale journal \"%s\"\n", p->jpath);
+		error = 0;
+		goto bad;
+	}
+	p->data = stream_open_file(p->dpath, O_RDONLY);
+	p->jfd = open(p->jpath, O_WRONLY);
+	if (p->data == NULL || p->jfd == -1)
+		goto bad;
+	stream_close(rd);
+	p->started = 1;
+	error = rsync_patch_run(p, done);
+	rsync_patch_free(p);
+	return (error);
+bad:
+	stream_close(rd);
+	rsync_patch_free(p);
+	return (error);
+}
+
+/* Pathname of the journal or of the data file for "path". */
+static char *
+rsync_patch_path(const char *path, const char *suffix)
+{
+	const char *cp;
+	char *res;
+
+	cp = strrchr(path, '/');
+	if (cp == NULL)
+		xasprintf(&res, "%s%s%s", PATCH_PREFIX, path, suffix);
+	else
+		xasprintf(&res, "%.*s%s%s%s", (int)(cp - path + 1), path,
+		    PATCH_PREFIX, cp + 1, suffix);
+	return (res);
+}
+
+static struct patchop *
+rsync_patch_addop(struct rsyncpatch *p, int type, off_t dst, off_t src,
+    off_t len)
+{
+	struct patchop *op;
+
+	if (p->nops == p->maxops) {
+		p->maxops = p->maxops == 0 ? 64 : p->maxops * 2;
+		p->ops = xrealloc(p->ops, p->maxops * sizeof(struct patchop));
+	}
+	op = &p->ops[p->nops++];
+	op->type = type;
+	op->sync = 0;
+	op->dst = dst;
+	op->src = src;
+	op->len = len;
+	return (op);
+}
+
+/*
+ * Turn a copy into a data operation, by saving its source at the end of
+ * the data file.  This must be done before the file is modified.
+ */
+static int
+rsync_patch_save(struct rsyncpatch *p, struct patchop *op)
+{
+	int error;
+
+	error = rsync_patch_copyrange(p->fd, op->src,
+	    stream_fileno(p->data), p->datalen, op->len);
+	if (error)
+		return (-1);
+	op->type = PATCHOP_DATA;
+	op->src = p->datalen;
+	p->datalen += op->len;
+	return (0);
+}
+
+/*
+ * Split the copies whose source and destination overlap, or save them
+ * in the data file if that would give too many small chunks.
+ */
+static int
+rsync_patch_split(struct rsyncpatch *p)
+{
+	struct patchop *ops, *op;
+	off_t chunk, off, shift;
+	size_t i, nops;
+
+	ops = p->ops;
+	nops = p->nops;
+	p->ops = NULL;
+	p->nops = p->maxops = 0;
+	for (i = 0; i < nops; i++) {
+		op = &ops[i];
+		shift = op->src > op->dst ? op->src - op->dst :
+		    op->dst - op->src;
+		if (op->type != PATCHOP_COPY || shift >= op->len) {
+			rsync_patch_addop(p, op->type, op->dst, op->src,
+			    op->len);
+			continue;
+		}
+		if (shift < PATCH_MINSHIFT) {
+			if (rsync_patch_save(p, op) == -1) {
+				free(ops);
+				return (-1);
+			}
+			rsync_patch_addop(p, op->type, op->dst, op->src,
+			    op->len);
+			continue;
+		}
+		for (off = 0; off < op->len; off += chunk) {
+			chunk = min(shift, op->len - off);
+			rsync_patch_addop(p, PATCHOP_COPY, op->dst + off,
+			    op->src + off, chunk);
+		}
+	}
+	free(ops);
+	return (0);
+}
+
+/*
+ * Sort the operations so that every copy runs before the operations
+ * that overwrite its source, and decide where the journal needs to be
+ * updated.  The operations are in the order of their destination,
+ * which doesn't overlap, so we can find the ones writing over a given
+ * range with a binary search.
+ */
+static int
+rsync_patch_sort(struct rsyncpatch *p)
+{
+	struct patchop *op, *ops;
+	size_t *edges, *first, *indeg, *maxpred, *order, *pos, *queue;
+	size_t head, i, j, k, last, lo, hi, n, nedges, next, tail;
+	off_t end;
+	char *cut, *queued;
+	int pass;
+
+	n = p->nops;
+	if (n == 0)
+		return (0);
+	first = xmalloc((n + 1) * sizeof(size_t));
+	indeg = xmalloc(n * sizeof(size_t));
+	memset(indeg, 0, n * sizeof(size_t));
+	edges = NULL;
+	nedges = 0;
+	/* Build the graph in two passes, counting the edges first. */
+	for (pass = 0; pass < 2; pass++) {
+		nedges = 0;
+		for (i = 0; i < n; i++) {
+			first[i] = nedges;
+			op = &p->ops[i];
+			if (op->type != PATCHOP_COPY)
+				continue;
+			end = op->src + op->len;
+			lo = 0;
+			hi = n;
+			while (lo < hi) {
+				k = lo + (hi - lo) / 2;
+				if (p->ops[k].dst + p->ops[k].len <= op->src)
+					lo = k + 1;
+				else
+					hi = k;
+			}
+			for (j = lo; j < n && p->ops[j].dst < end; j++) {
+				if (j == i)
+					continue;
+				if (pass == 1) {
+					edges[nedges] = j;
+					indeg[j]++;
+				}
+				nedges++;
+			}
+		}
+		first[n] = nedges;
+		if (pass == 0)
+			edges = xmalloc(max(nedges, 1) * sizeof(size_t));
+	}
+
+	order = xmalloc(n * sizeof(size_t));
+	queue = xmalloc(n * sizeof(size_t));
+	cut = xmalloc(n);
+	queued = xmalloc(n);
+	memset(cut, 0, n);
+	memset(queued, 0, n);
+	head = tail = 0;
+	for (i = 0; i < n; i++) {
+		if (indeg[i] == 0) {
+			queue[tail++] = i;
+			queued[i] = 1;
+		}
+	}
+	next = 0;
+	for (k = 0; k < n; k++) {
+		while (head == tail) {
+			/* Only cycles are left, break one. */
+			while (queued[next] || cut[next] ||
+			    p->ops[next].type != PATCHOP_COPY)
+				next++;
+			if (rsync_patch_save(p, &p->ops[next]) == -1)
+				goto bad;
+			cut[next] = 1;
+			for (j = first[next]; j < first[next + 1]; j++) {
+				if (--indeg[edges[j]] == 0) {
+					queue[tail++] = edges[j];
+					queued[edges[j]] = 1;
+				}
+			}
+		}
+		i = queue[head++];
+		order[k] = i;
+		if (cut[i])
+			continue;
+		cut[i] = 1;
+		for (j = first[i]; j < first[i + 1]; j++) {
+			if (--indeg[edges[j]] == 0) {
+				queue[tail++] = edges[j];
+				queued[edges[j]] = 1;
+			}
+		}
+	}
+
+	/*
+	 * Now decide where to update the journal: before an operation
+	 * that must run after a copy which ran since the last update.
+	 * The copies turned into data operations don't count anymore.
+	 */
+	pos = indeg;
+	for (k = 0; k < n; k++)
+		pos[order[k]] = k;
+	maxpred = xmalloc(n * sizeof(size_t));
+	memset(queued, 0, n);
+	for (i = 0; i < n; i++) {
+		if (p->ops[i].type != PATCHOP_COPY)
+			continue;
+		for (j = first[i]; j < first[i + 1]; j++) {
+			if (!queued[edges[j]] || maxpred[edges[j]] < pos[i])
+				maxpred[edges[j]] = pos[i];
+			queued[edges[j]] = 1;
+		}
+	}
+	ops = xmalloc(n * sizeof(struct patchop));
+	last = 0;
+	for (k = 0; k < n; k++) {
+		i = order[k];
+		ops[k] = p->ops[i];
+		if (queued[i] && maxpred[i] >= last) {
+			ops[k].sync = 1;
+			last = k;
+		}
+	}
+	free(maxpred);
+	free(p->ops);
+	p->ops = ops;
+	p->maxops = n;
+	free(queued);
+	free(cut);
+	free(queue);
+	free(order);
+	free(edges);
+	free(indeg);
+	free(first);
+	return (0);
+bad:
+	free(queued);
+	free(cut);
+	free(queue);
+	free(order);
+	free(edges);
+	free(indeg);
+	free(first);
+	return (-1);
+}
+
+/* Write the journal, and make sure it is on disk with the data file. */
+static int
+rsync_patch_journal(struct rsyncpatch *p)
+{
+	struct stream *wr;
+	struct patchop *op;
+	size_t i;
+	int error;
+
+	if (fsync(stream_fileno(p->data)) == -1)
+		return (-1);
+	wr = stream_open_file(p->jpath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (wr == NULL)
+		return (-1);
+	error = stream_printf(wr, "INPLACE %d %llu %lld\n", PATCH_VERSION,
+	    (unsigned long long)p->ino, (long long)p->newsize) < 0;
+	if (!error) {
+		error = stream_flush(wr) != 0;
+		p->doneoff = lseek(stream_fileno(wr), 0, SEEK_CUR) +
+		    strlen("DONE ");
+	}
+	if (!error)
+		error = stream_printf(wr, "DONE %0*d\n", PATCH_DONEWIDTH,
+		    0) < 0;
+	for (i = 0; i < p->nops && !error; i++) {
+		op = &p->ops[i];
+		error = stream_printf(wr, "%c %d %lld %lld %lld\n", op->type,
+		    op->sync, (long long)op->dst, (long long)op->src,
+		    (long long)op->len) < 0;
+	}
+	if (!error)
+		error = stream_printf(wr, ".\n") < 0;
+	if (!error)
+		error = stream_flush(wr) != 0 ||
+		    fsync(stream_fileno(wr)) == -1;
+	if (!error)
+		p->jfd = dup(stream_fileno(wr));
+	stream_close(wr);
+	if (error || p->jfd == -1 || syncdir(p->jpath) == -1) {
+		(void)unlink(p->jpath);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Run the operations starting with the one at index "start", then set
+ * the size of the file and remove the journal.
+ */
+static int
+rsync_patch_run(struct rsyncpatch *p, size_t start)
+{
+	struct patchop *op;
+	size_t i;
+	int error, fd;
+
+	for (i = start; i < p->nops; i++) {
+		op = &p->ops[i];
+		if (op->sync && i > start && rsync_patch_done(p, i) == -1)
+			return (-1);
+		fd = op->type == PATCHOP_COPY ? p->fd : stream_fileno(p->data);
+		error = rsync_patch_copyrange(fd, op->src, p->fd, op->dst,
+		    op->len);
+		if (error)
+			return (-1);
+	}
+	if (ftruncate(p->fd, p->newsize) == -1 || fsync(p->fd) == -1)
+		return (-1);
+	rsync_patch_close(p);
+	(void)unlink(p->jpath);
+	(void)unlink(p->dpath);
+	return (0);
+}
+
+/* Record in the journal that the first "count" operations are done. */
+static int
+rsync_patch_done(struct rsyncpatch *p, size_t count)
+{
+	char buf[PATCH_DONEWIDTH + 1];
+	ssize_t n;
+
+	if (fdatasync(p->fd) == -1)
+		return (-1);
+	snprintf(buf, sizeof(buf), "%0*lld", PATCH_DONEWIDTH,
+	    (long long)count);
+	n = pwrite(p->jfd, buf, PATCH_DONEWIDTH, p->doneoff);
+	if (n != PATCH_DONEWIDTH)
+		return (-1);
+	return (fdatasync(p->jfd));
+}
+
+/*
+ * Copy "len" bytes from offset "src" in "fromfd" to offset "dst" in
+ * "tofd", which may be the same file as long as the ranges don't
+ * overlap.  Returns 0 on success, -1 otherwise.
+ */
+static int
+rsync_patch_copyrange(int fromfd, off_t src, int tofd, off_t dst, off_t len)
+{
+	char *buf;
+	ssize_t n, nw;
+	size_t chunk;
+#ifdef __linux__
+	loff_t from, to;
+
+	from = src;
+	to = dst;
+	while (len > 0) {
+		chunk = min(len, PATCH_BUFSIZE);
+		n = copy_file_range(fromfd, &from, tofd, &to, chunk, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EXDEV && errno != EINVAL &&
+			    errno != ENOSYS && errno != EOPNOTSUPP)
+				return (-1);
+			break;
+		}
+		if (n == 0) {
+			/* Short source, like when splicing from it. */
+			return (0);
+		}
+		len -= n;
+	}
+	if (len == 0)
+		return (0);
+	src = from;
+	dst = to;
+#endif
+	buf = xmalloc(PATCH_BUFSIZE);
+	n = 0;
+	while (len > 0) {
+		chunk = min(len, PATCH_BUFSIZE);
+		n = pread(fromfd, buf, chunk, src);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		nw = pwrite(tofd, buf, n, dst);
+		if (nw == -1 && errno == EINTR)
+			continue;
+		if (nw != n) {
+			free(buf);
+			return (-1);
+		}
+		src += n;
+		dst += n;
+		len -= n;
+	}
+	free(buf);
+	return (n == -1 ? -1 : 0);
+}
+
+static void
+rsync_patch_close(struct rsyncpatch *p)
+{
+
+	if (p->data != NULL) {
+		stream_close(p->data);
+		p->data = NULL;
+	}
+	if (p->jfd != -1) {
+		close(p->jfd);
+		p->jfd = -1;
+	}
+	if (p->fd != -1) {
+		close(p->fd);
+		p->fd = -1;
+	}
+}
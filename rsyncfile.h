@@ -26,7 +26,12 @@
 #ifndef _RSYNCFILE_H_
 #define _RSYNCFILE_H_
 
+#include <sys/types.h>
+#include <stdint.h>
+
 struct rsyncfile;
+struct rsyncpatch;
+struct stream;
 
 struct rsyncfile	*rsync_open(char *, size_t, int);
 int			 rsync_nextblock(struct rsyncfile *);
@@ -36,4 +41,17 @@ void			 rsync_close(struct rsyncfile *);
 size_t			 rsync_blocksize(struct rsyncfile *);
 off_t			 rsync_filesize(struct rsyncfile *);
 
+struct rsyncpatch	*rsync_patch_new(const char *);
+struct stream		*rsync_patch_data(struct rsyncpatch *);
+int			 rsync_patch_literal(struct rsyncpatch *);
+int			 rsync_patch_copy(struct rsyncpatch *, off_t, off_t);
+int			 rsync_patch_apply(struct rsyncpatch *);
+void			 rsync_patch_free(struct rsyncpatch *);
+int			 rsync_recover(const char *);
+
+/* For rsynctest.c. */
+typedef void		 rsync_rollsumfn_t(const char *, size_t, uint32_t *,
+			     uint32_t *);
+rsync_rollsumfn_t	*rsync_rollsum_variant(int, const char **);
+
 #endif /* !_RSYNCFILE_H_ */
@@ -0,0 +1,538 @@
+/*-
+ * Copyright (c) 2012, Maxime Henrion <mux@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the rsync code, run with "make test".  The files are created
+ * sparse in a temporary directory, so that the block size selection can
+ * be checked up to very large sizes without using any disk space.
+ *
+ * The in-place updates are tested with random patches, the expected
+ * result being built in memory at the same time.  To test the recovery,
+ * the patch is applied in a child process whose file size limit makes
+ * it fail as soon as it writes past the end of the old file, and the
+ * journal it leaves behind is then replayed with rsync_recover().
+ *
+ * The vector versions of the rolling checksum are compared with the
+ * scalar one on random bytes, at all the lengths around their chunk
+ * sizes and from unaligned addresses.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "rsyncfile.h"
+#include "stream.h"
+
+/* Those have to match the limits in rsyncfile.c. */
+#define	TEST_MINBLOCKSIZE	1024
+#define	TEST_MAXBLOCKSIZE	(128 * 1024)
+#define	TEST_SEARCHREGION	10
+
+/* Files up to this size get their blocks counted by reading them. */
+#define	TEST_MAXREAD		(8 * 1024 * 1024)
+
+/* Must match the naming of the in-place update files in rsyncfile.c. */
+#define	TEST_JOURNAL		"#cvs.csup-inplace.patch"
+#define	TEST_DATA		"#cvs.csup-inplace.patch.data"
+
+#define	TEST_PATCHRUNS		100	/* Random patches of each kind. */
+#define	TEST_MAXOLD		(1024 * 1024)
+#define	TEST_MAXPARTS		16
+#define	TEST_MAXLITERAL		8192
+
+#define	KB			((off_t)1024)
+#define	MB			(1024 * KB)
+#define	GB			(1024 * MB)
+
+int verbose = 0;
+
+static char	*tmpdir;
+static int	 failures;
+static int	 interrupted;
+
+static void	 check(int, const char *, ...) __printflike(2, 3);
+static char	*test_path(const char *);
+static int	 test_mkfile(const char *, off_t);
+static off_t	 test_isqrt(off_t);
+static void	 test_blocksize(off_t);
+static void	 test_fill(char *, off_t);
+static off_t	 test_mkpatch(struct rsyncpatch *, off_t, const char *, off_t,
+		     char *, off_t);
+static int	 test_cmpfile(const char *, off_t, const char *, off_t);
+static void	 test_patch(unsigned int, off_t, int);
+static void	 test_rollsum(void);
+static int	 test_rollsum_cmp(rsync_rollsumfn_t *, const char *,
+		     const char *, size_t, size_t, uint32_t, uint32_t);
+
+static void
+check(int ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ok)
+		return;
+	failures++;
+	printf("FAIL: ");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+static char *
+test_path(const char *name)
+{
+	char *path;
+
+	xasprintf(&path, "%s/%s", tmpdir, name);
+	return (path);
+}
+
+/* Create a sparse file of the given size. */
+static int
+test_mkfile(const char *path, off_t size)
+{
+	int error, fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return (-1);
+	error = ftruncate(fd, size);
+	close(fd);
+	return (error);
+}
+
+static off_t
+test_isqrt(off_t n)
+{
+	off_t x;
+
+	x = 0;
+	while ((x + 1) * (x + 1) <= n)
+		x++;
+	return (x);
+}
+
+/*
+ * Check the block size chosen for a file of the given size: it has to be
+ * within the protocol limits and close to sqrt(size), and the block count
+ * and offsets computed from it must not overflow.
+ */
+static void
+test_blocksize(off_t size)
+{
+	struct rsyncfile *rf;
+	off_t nblocks, count, target;
+	size_t bs;
+	char *path;
+
+	path = test_path("blocksize");
+	if (test_mkfile(path, size) == -1) {
+		printf("skipping size %lld: %s\n", (long long)size,
+		    strerror(errno));
+		free(path);
+		return;
+	}
+	rf = rsync_open(path, 0, 1);
+	if (rf == NULL && errno == EFBIG && (uintmax_t)size > SIZE_MAX) {
+		printf("skipping size %lld: %s\n", (long long)size,
+		    strerror(errno));
+		unlink(path);
+		free(path);
+		return;
+	}
+	check(rf != NULL, "size %lld: rsync_open: %s", (long long)size,
+	    strerror(errno));
+	if (rf == NULL) {
+		unlink(path);
+		free(path);
+		return;
+	}
+	check(rsync_filesize(rf) == size, "size %lld: file size %lld",
+	    (long long)size, (long long)rsync_filesize(rf));
+	bs = rsync_blocksize(rf);
+	target = test_isqrt(size);
+	if (target < TEST_MINBLOCKSIZE)
+		target = TEST_MINBLOCKSIZE;
+	if (target > TEST_MAXBLOCKSIZE)
+		target = TEST_MAXBLOCKSIZE;
+	check(bs >= TEST_MINBLOCKSIZE && bs <= TEST_MAXBLOCKSIZE,
+	    "size %lld: block size %lu out of bounds", (long long)size,
+	    (unsigned long)bs);
+	check((off_t)bs >= target - 2 * TEST_SEARCHREGION &&
+	    (off_t)bs <= target + 2 * TEST_SEARCHREGION,
+	    "size %lld: block size %lu too far from %lld", (long long)size,
+	    (unsigned long)bs, (long long)target);
+
+	/* Computed the way the updater does, with 64-bit offsets. */
+	nblocks = size == 0 ? 0 : (size - 1) / (off_t)bs + 1;
+	check(nblocks == 0 || ((nblocks - 1) * (off_t)bs < size &&
+	    nblocks * (off_t)bs >= size),
+	    "size %lld: %lld blocks of %lu bytes", (long long)size,
+	    (long long)nblocks, (unsigned long)bs);
+	check(nblocks <= size / TEST_MINBLOCKSIZE + 1,
+	    "size %lld: too many blocks (%lld)", (long long)size,
+	    (long long)nblocks);
+	if (size <= TEST_MAXREAD) {
+		count = 0;
+		while (rsync_nextblock(rf))
+			count++;
+		check(count == nblocks, "size %lld: read %lld blocks, "
+		    "expected %lld", (long long)size, (long long)count,
+		    (long long)nblocks);
+	}
+	printf("size %lld: %lld blocks of %lu bytes\n", (long long)size,
+	    (long long)nblocks, (unsigned long)bs);
+	rsync_close(rf);
+	unlink(path);
+	free(path);
+}
+
+static void
+test_fill(char *buf, off_t len)
+{
+	off_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = random() & 0xff;
+}
+
+/*
+ * Record a random patch in "p", which is then applied, and build the
+ * expected result in "new".  The old file is "old" starting at offset
+ * "base", the part before it being left alone.  If "p" is NULL, only
+ * the expected result is computed.  Returns the size of the result
+ * after "base", or -1 if the update failed.
+ */
+static off_t
+test_mkpatch(struct rsyncpatch *p, off_t base, const char *old, off_t oldsize,
+    char *new, off_t newmax)
+{
+	off_t len, newsize, src;
+	int i, nparts;
+
+	newsize = 0;
+	if (p != NULL && base > 0 && rsync_patch_copy(p, 0, base) == -1)
+		return (-1);
+	nparts = 1 + random() % TEST_MAXPARTS;
+	for (i = 0; i < nparts; i++) {
+		switch (random() % 4) {
+		case 0:
+			/* Literal data from the server. */
+			len = 1 + random() % TEST_MAXLITERAL;
+			len = min(len, newmax - newsize);
+			test_fill(new + newsize, len);
+			if (p != NULL && stream_write(rsync_patch_data(p),
+			    new + newsize, len) != len)
+				return (-1);
+			newsize += len;
+			continue;
+		case 1:
+			/* A block moved by less than the smallest chunk. */
+			src = newsize + random() % 8192 - 4096;
+			break;
+		case 2:
+			/* A block moved by a few chunks. */
+			src = newsize + random() % (4 * 64 * 1024) -
+			    2 * 64 * 1024;
+			break;
+		default:
+			/* A block from anywhere in the file. */
+			src = random() % oldsize;
+			break;
+		}
+		if (src < 0 || src >= oldsize)
+			src = random() % oldsize;
+		len = 1 + random() % (oldsize / 2);
+		len = min(len, oldsize - src);
+		len = min(len, newmax - newsize);
+		memcpy(new + newsize, old + src, len);
+		if (p != NULL && rsync_patch_copy(p, base + src, len) == -1)
+			return (-1);
+		newsize += len;
+	}
+	if (p != NULL && rsync_patch_apply(p) == -1)
+		return (-1);
+	return (newsize);
+}
+
+/* Returns 0 if the file is "len" bytes from "buf" after "base". */
+static int
+test_cmpfile(const char *path, off_t base, const char *buf, off_t len)
+{
+	struct stat sb;
+	char *data;
+	ssize_t n;
+	int fd, same;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if (fstat(fd, &sb) == -1 || sb.st_size != base + len) {
+		close(fd);
+		return (-1);
+	}
+	data = xmalloc(len + 1);
+	n = pread(fd, data, len, base);
+	close(fd);
+	same = n == len && memcmp(data, buf, len) == 0;
+	free(data);
+	return (same ? 0 : -1);
+}
+
+/*
+ * Apply a random patch to a file holding random data at "base", and
+ * check the result.  If "crash" is set, the update is interrupted.
+ */
+static void
+test_patch(unsigned int seed, off_t base, int crash)
+{
+	struct rsyncpatch *p;
+	struct rlimit rl;
+	struct stat sb;
+	char *data, *journal, *new, *old, *path;
+	off_t newmax, newsize, oldsize;
+	pid_t pid;
+	long state;
+	int fd, status;
+
+	path = test_path("patch");
+	journal = test_path(TEST_JOURNAL);
+	data = test_path(TEST_DATA);
+	srandom(seed);
+	oldsize = TEST_MAXOLD / 4 + random() % TEST_MAXOLD;
+	old = xmalloc(oldsize);
+	test_fill(old, oldsize);
+	newmax = 2 * oldsize;
+	new = xmalloc(newmax);
+	state = random();
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || pwrite(fd, old, oldsize, base) != oldsize)
+		err(1, "%s", path);
+	close(fd);
+
+	if (!crash) {
+		p = rsync_patch_new(path);
+		check(p != NULL, "seed %u: rsync_patch_new: %s", seed,
+		    strerror(errno));
+		if (p == NULL)
+			goto done;
+		srandom(state);
+		newsize = test_mkpatch(p, base, old, oldsize, new, newmax);
+		check(newsize != -1, "seed %u: in-place update failed: %s",
+		    seed, strerror(errno));
+		rsync_patch_free(p);
+		if (newsize == -1)
+			goto done;
+	} else {
+		pid = fork();
+		if (pid == -1)
+			err(1, "fork");
+		if (pid == 0) {
+			/* Fail the first write past the end of the file. */
+			rl.rlim_cur = rl.rlim_max = base + oldsize;
+			if (setrlimit(RLIMIT_FSIZE, &rl) == -1)
+				_exit(3);
+			signal(SIGXFSZ, SIG_IGN);
+			p = rsync_patch_new(path);
+			if (p == NULL)
+				_exit(3);
+			srandom(state);
+			if (test_mkpatch(p, base, old, oldsize, new,
+			    newmax) == -1)
+				_exit(2);
+			rsync_patch_free(p);
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) == -1)
+			err(1, "waitpid");
+		check(WIFEXITED(status) && WEXITSTATUS(status) != 3,
+		    "seed %u: child failed", seed);
+		srandom(state);
+		newsize = test_mkpatch(NULL, base, old, oldsize, new, newmax);
+		if (stat(journal, &sb) == 0) {
+			interrupted++;
+			check(rsync_recover(path) == 0,
+			    "seed %u: rsync_recover: %s", seed,
+			    strerror(errno));
+		} else if (WIFEXITED(status) && WEXITSTATUS(status) == 2) {
+			/* It failed before touching the file. */
+			check(test_cmpfile(path, base, old, oldsize) == 0,
+			    "seed %u: file modified without a journal",
+			    seed);
+			goto done;
+		}
+	}
+	check(test_cmpfile(path, base, new, newsize) == 0,
+	    "seed %u: wrong result after %s update", seed,
+	    crash ? "interrupted" : "in-place");
+	check(stat(journal, &sb) == -1 && stat(data, &sb) == -1,
+	    "seed %u: update files left behind", seed);
+done:
+	unlink(data);
+	unlink(journal);
+	unlink(path);
+	free(new);
+	free(old);
+	free(data);
+	free(journal);
+	free(path);
+}
+
+/*
+ * Run one vector version of the rolling checksum and the scalar one over
+ * the same bytes from the same starting sums, and report any difference.
+ */
+static int
+test_rollsum_cmp(rsync_rollsumfn_t *fn, const char *name, const char *buf,
+    size_t off, size_t len, uint32_t a0, uint32_t b0)
+{
+	rsync_rollsumfn_t *scalar;
+	const char *sname;
+	uint32_t a, b, sa, sb;
+
+	scalar = rsync_rollsum_variant(0, &sname);
+	sa = a = a0;
+	sb = b = b0;
+	scalar(buf + off, len, &sa, &sb);
+	fn(buf + off, len, &a, &b);
+	check(a == sa && b == sb, "rollsum %s: offset %lu, length %lu: "
+	    "got %08x %08x instead of %08x %08x", name, (unsigned long)off,
+	    (unsigned long)len, a, b, sa, sb);
+	return (a == sa && b == sb);
+}
+
+/*
+ * Make sure that the vector versions of the rolling checksum compute the
+ * same sums as the scalar one.  The bytes are random, so about half of
+ * them have the high bit set and are negative where char is signed; the
+ * lengths cover all the tails left by 16 and 32-byte chunks.
+ */
+static void
+test_rollsum(void)
+{
+	static const size_t biglens[] = { 1024, 8 * KB + 37, 128 * KB };
+	rsync_rollsumfn_t *fn;
+	const char *name;
+	char *buf, *ones;
+	size_t buflen, len, off;
+	int i, k, ok;
+
+	buflen = 128 * KB + 64;
+	buf = xmalloc(buflen);
+	ones = xmalloc(buflen);
+	srandom(1);
+	for (off = 0; off < buflen; off++)
+		buf[off] = random();
+	memset(ones, 0xff, buflen);
+	for (i = 1; (fn = rsync_rollsum_variant(i, &name)) != NULL; i++) {
+		ok = 1;
+		for (off = 0; off < 32 && ok; off++) {
+			for (len = 0; len <= 100 && ok; len++) {
+				/* Start from both zero and random sums. */
+				ok = test_rollsum_cmp(fn, name, buf, off, len,
+				    0, 0);
+				if (ok)
+					ok = test_rollsum_cmp(fn, name, buf,
+					    off, len, random(), random());
+			}
+		}
+		/* Long runs of 0xff bytes give the largest sums. */
+		for (k = 0; k < (int)(sizeof(biglens) / sizeof(biglens[0]));
+		    k++) {
+			test_rollsum_cmp(fn, name, buf, 3, biglens[k], 0, 0);
+			test_rollsum_cmp(fn, name, ones, 3, biglens[k], 0, 0);
+		}
+	}
+	printf("rollsum: %d vector version(s) checked\n", i - 1);
+	free(ones);
+	free(buf);
+}
+
+int
+main(void)
+{
+	static const off_t sizes[] = {
+		0, 1, 1023, 1024, 1025, 64 * KB,
+		MB - 1, MB, MB + 1, 8 * MB,
+		2 * GB - 1, 2 * GB, 4 * GB - 1, 4 * GB, 4 * GB + 1,
+		16 * GB - 1, 16 * GB, 16 * GB + 1, 100 * GB
+	};
+	const char *dir;
+	char *template;
+	size_t i;
+	unsigned int seed;
+
+	dir = getenv("TMPDIR");
+	if (dir == NULL)
+		dir = "/tmp";
+	xasprintf(&template, "%s/rsynctest.XXXXXX", dir);
+	tmpdir = mkdtemp(template);
+	if (tmpdir == NULL)
+		err(1, "mkdtemp");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		test_blocksize(sizes[i]);
+
+	for (seed = 0; seed < TEST_PATCHRUNS; seed++) {
+		test_patch(seed, 0, 0);
+		test_patch(seed, 0, 1);
+	}
+	/* A few with offsets that don't fit in 32 bits. */
+	for (seed = 0; seed < 4; seed++) {
+		test_patch(seed, 4 * GB + 12345, 0);
+		test_patch(seed, 4 * GB + 12345, 1);
+	}
+	printf("in-place: %d updates, %d interrupted and recovered\n",
+	    2 * (TEST_PATCHRUNS + 4), interrupted);
+	check(interrupted > 0, "no in-place update got interrupted");
+
+	test_rollsum();
+
+	rmdir(tmpdir);
+	free(template);
+	if (failures > 0) {
+		printf("%d test(s) failed\n", failures);
+		return (1);
+	}
+	printf("All tests passed\n");
+	return (0);
+}
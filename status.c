@@ -84,6 +84,7 @@ struct status {
 	int linenum;
 	int depth;
 	int dirty;
+	int sync;
 };
 
 static void
@@ -526,7 +527,7 @@ status_open(struct coll *coll, time_t scantime, char **errmsg)
 	int error, rv;
 
 	path = coll_statuspath(coll);
-	file = stream_open_file(path, O_RDONLY);
+	file = stream_open_mmap(path);
 	if (file == NULL) {
 		if (errno != ENOENT) {
 			xasprintf(errmsg, "Could not open \"%s\": %s\n",
@@ -580,6 +581,7 @@ status_open(struct coll *coll, time_t scantime, char **errmsg)
 		}
 		if (scantime != st->scantime)
 			st->dirty = 1;
+		st->sync = (coll->co_durability == DURABILITY_BATCH);
 		error = proto_printf(st->wr, "F %d %t\n", STATUS_VERSION,
 		    scantime);
 		if (error) {
@@ -852,6 +854,24 @@ status_close(struct status *st, char **errmsg)
 				}
 			}
 
+			/*
+			 * In batch durability mode, the updates of the
+			 * collection have been synced already, so the new
+			 * status file must reach the disk before it replaces
+			 * the old one.
+			 */
+			if (st->sync) {
+				error = stream_flush(st->wr);
+				if (!error)
+					error = fsync(stream_fileno(st->wr));
+				if (error) {
+					st->error = STATUS_ERR_WRITE;
+					st->suberror = errno;
+					*errmsg = status_errmsg(st);
+					goto bad;
+				}
+			}
+
 			/* Rename tempfile. */
 			error = rename(st->tempfile, st->path);
 			if (error) {
@@ -860,6 +880,8 @@ status_close(struct status *st, char **errmsg)
 				*errmsg = status_errmsg(st);
 				goto bad;
 			}
+			if (st->sync)
+				(void)syncdir(st->path);
 		} else {
 			/* Just discard the tempfile. */
 			unlink(st->tempfile);
@@ -25,14 +25,21 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <assert.h>
 #include <zlib.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -70,8 +77,19 @@ typedef enum {
 /*
  * This is because buf_new() will always allocate size + 1 bytes,
  * so our buffer sizes will still be power of 2 values.
+ *
+ * Streams on top of memory buffers use small buffers, while those doing
+ * actual I/O on files or on the network start with larger ones.  These
+ * can then grow up to STREAM_MAXBUFSIZ if the stream keeps filling or
+ * draining its whole buffer, which happens with large sequential
+ * transfers, where fewer and larger system calls pay off.
  */
-#define	STREAM_BUFSIZ	1023
+#define	STREAM_BUFSIZ		1023
+#define	STREAM_IOBUFSIZ		(64 * 1024 - 1)
+#define	STREAM_MAXBUFSIZ	(1024 * 1024 - 1)
+
+/* Number of consecutive full buffers before growing them. */
+#define	STREAM_GROWSTREAK	4
 
 struct buf {
 	char *buf;
@@ -90,6 +108,11 @@ struct stream {
 	stream_writefn_t *writefn;
 	stream_closefn_t *closefn;
 	int eof;
+	size_t maxbufsize;
+	int rdstreak;
+	int wrstreak;
+	void *map;			/* Mapping backing rdbuf, if any. */
+	size_t maplen;
 	struct stream_filter *filter;
 	void *fdata;
 #ifdef DEBUG
@@ -121,6 +144,14 @@ static void		 buf_less(struct buf *, size_t);
 static void		 buf_grow(struct buf *, size_t);
 
 /* Internal stream functions. */
+static struct stream	*stream_new(stream_readfn_t *, stream_writefn_t *,
+			     stream_closefn_t *, size_t, size_t);
+static void		 stream_adapt(struct stream *, struct buf *, int *);
+static int		 stream_israw(struct stream *);
+static int		 stream_hasmode(int);
+static stream_readfn_t	 stream_read_mmap;
+static off_t		 stream_splice_fd(struct stream *, struct stream *,
+			     off_t);
 static ssize_t		 stream_fill(struct stream *);
 static ssize_t		 stream_fill_default(struct stream *, struct buf *);
 static int		 stream_flush_int(struct stream *, stream_flush_t);
@@ -135,12 +166,59 @@ static void		 stream_filter_fini(struct stream *);
 /* The zlib stream filter declarations. */
 #define	ZFILTER_EOF	1				/* Got Z_STREAM_END. */
 
+/*
+ * With the "auto" compression level, the level is reconsidered every
+ * ZFILTER_SAMPLE bytes of input, based on the time spent compressing
+ * and writing, and on how full the output buffer is.
+ */
+#define	ZFILTER_SAMPLE	(256 * 1024)
+#define	ZFILTER_LOWAT	25				/* In percent. */
+#define	ZFILTER_HIWAT	75
+
 struct zfilter {
 	int flags;
 	struct buf *rdbuf;
 	struct buf *wrbuf;
 	z_stream *rdstate;
 	z_stream *wrstate;
+	struct zpipe *rdpipe;
+	struct zpipe *wrpipe;
+	int level;
+	int autolevel;
+	stream_backlogfn_t *backlog;
+	size_t sampled;
+	struct timeval cputime;
+	struct timeval iotime;
+};
+
+/* Totals for all the zlib filters, for stream_zreport(). */
+static pthread_mutex_t	zstats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t		zstats_rdin, zstats_rdout;
+static uint64_t		zstats_wrin, zstats_wrout;
+
+/*
+ * When the zlib filter is threaded, each direction of the stream gets
+ * a pipeline thread that does the actual compression work.  The slots
+ * form a queue of buffers holding uncompressed data, which the stream
+ * fills and the writer thread compresses and writes out, or which the
+ * reader thread fills and the stream consumes.
+ */
+#define	ZPIPE_NSLOTS	4
+
+struct zpipe {
+	struct stream *stream;
+	struct zfilter *zf;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct buf *slots[ZPIPE_NSLOTS];
+	stream_flush_t how[ZPIPE_NSLOTS];
+	int head;
+	int count;
+	int done;			/* The stream is done with us. */
+	int finished;			/* The reader thread has stopped. */
+	int eof;
+	int error;
 };
 
 static int		 zfilter_init(struct stream *, void *);
@@ -148,6 +226,23 @@ static void		 zfilter_fini(struct stream *);
 static ssize_t		 zfilter_fill(struct stream *, struct buf *);
 static int		 zfilter_flush(struct stream *, struct buf *,
 			     stream_flush_t);
+static int		 zfilter_deflate(struct stream *, struct zfilter *,
+			     struct buf *, stream_flush_t);
+static ssize_t		 zfilter_inflate(struct stream *, struct zfilter *,
+			     struct buf *, int *);
+static ssize_t		 zfilter_read(struct stream *, struct buf *, int *);
+static void		 zfilter_tune(struct stream *, struct zfilter *);
+static void		 zfilter_clock(struct timeval *, struct timeval *);
+
+static struct zpipe	*zpipe_new(struct stream *, struct zfilter *, size_t,
+			     void *(*)(void *));
+static void		 zpipe_free(struct zpipe *);
+static void		*zpipe_reader(void *);
+static void		*zpipe_writer(void *);
+static ssize_t		 zpipe_fill(struct stream *, struct zpipe *,
+			     struct buf *);
+static int		 zpipe_flush(struct zpipe *, struct buf *,
+			     stream_flush_t);
 
 /* The MD5 stream filter. */
 struct md5filter {
@@ -285,25 +380,34 @@ buf_free(struct buf *buf)
 	free(buf);
 }
 
+/*
+ * Create a new stream whose buffers start with "bufsize" bytes and may
+ * grow up to "maxbufsize" bytes for large sequential transfers.
+ */
 static struct stream *
 stream_new(stream_readfn_t *readfn, stream_writefn_t *writefn,
-    stream_closefn_t *closefn)
+    stream_closefn_t *closefn, size_t bufsize, size_t maxbufsize)
 {
 	struct stream *stream;
 
-	stream = xmalloc(sizeof(struct stream));
 	if (readfn == NULL && writefn == NULL) {
 		errno = EINVAL;
 		return (NULL);
 	}
+	stream = xmalloc(sizeof(struct stream));
 	if (readfn != NULL)
-		stream->rdbuf = buf_new(STREAM_BUFSIZ);
+		stream->rdbuf = buf_new(bufsize);
 	else
 		stream->rdbuf = NULL;
 	if (writefn != NULL)
-		stream->wrbuf = buf_new(STREAM_BUFSIZ);
+		stream->wrbuf = buf_new(bufsize);
 	else
 		stream->wrbuf = NULL;
+	stream->maxbufsize = maxbufsize;
+	stream->rdstreak = 0;
+	stream->wrstreak = 0;
+	stream->map = NULL;
+	stream->maplen = 0;
 	stream->cookie = NULL;
 	stream->fd = -1;
 	stream->buf = 0;
@@ -326,7 +430,10 @@ stream_open(void *cookie, stream_readfn_t *readfn, stream_writefn_t *writefn,
 {
 	struct stream *stream;
 
-	stream = stream_new(readfn, writefn, closefn);
+	stream = stream_new(readfn, writefn, closefn, STREAM_IOBUFSIZ,
+	    STREAM_MAXBUFSIZ);
+	if (stream == NULL)
+		return (NULL);
 	stream->cookie = cookie;
 	return (stream);
 }
@@ -338,7 +445,10 @@ stream_open_fd(int fd, stream_readfn_t *readfn, stream_writefn_t *writefn,
 {
 	struct stream *stream;
 
-	stream = stream_new(readfn, writefn, closefn);
+	stream = stream_new(readfn, writefn, closefn, STREAM_IOBUFSIZ,
+	    STREAM_MAXBUFSIZ);
+	if (stream == NULL)
+		return (NULL);
 	stream->cookie = &stream->fd;
 	stream->fd = fd;
 	return (stream);
@@ -350,7 +460,8 @@ stream_open_buf(struct buf *b)
 {
 	struct stream *stream;
 
-	stream = stream_new(stream_read_buf, stream_append_buf, stream_close_buf);
+	stream = stream_new(stream_read_buf, stream_append_buf, stream_close_buf,
+	    STREAM_BUFSIZ, STREAM_BUFSIZ);
 	stream->cookie = b;
 	stream->buf = 1;
 	b->in = 0;
@@ -367,9 +478,39 @@ stream_truncate_buf(struct buf *b, off_t off)
 	b->off += off;
 }
 
+/* Returns true if open() wants a mode with these flags. */
+static int
+stream_hasmode(int flags)
+{
+
+#ifdef O_TMPFILE
+	/* Anonymous files need a mode too. */
+	if ((flags & O_TMPFILE) == O_TMPFILE)
+		return (1);
+#endif
+	return (flags & O_CREAT);
+}
+
 /* Like open() but returns a stream. */
 struct stream *
 stream_open_file(const char *path, int flags, ...)
+{
+	struct stream *stream;
+	va_list ap;
+
+	va_start(ap, flags);
+	if (stream_hasmode(flags))
+		stream = stream_open_fileat(AT_FDCWD, path, flags,
+		    va_arg(ap, int));
+	else
+		stream = stream_open_fileat(AT_FDCWD, path, flags);
+	va_end(ap);
+	return (stream);
+}
+
+/* Like openat() but returns a stream. */
+struct stream *
+stream_open_fileat(int dirfd, const char *path, int flags, ...)
 {
 	struct stream *stream;
 	stream_readfn_t *readfn;
@@ -379,15 +520,15 @@ stream_open_file(const char *path, int flags, ...)
 	int fd;
 
 	va_start(ap, flags);
-	if (flags & O_CREAT) {
+	if (stream_hasmode(flags)) {
 		/*
 		 * GCC says I should not be using mode_t here since it's
 		 * promoted to an int when passed through `...'.
 		 */
 		mode = va_arg(ap, int);
-		fd = open(path, flags, mode);
+		fd = openat(dirfd, path, flags, mode);
 	} else
-		fd = open(path, flags);
+		fd = openat(dirfd, path, flags);
 	va_end(ap);
 	if (fd == -1)
 		return (NULL);
@@ -415,6 +556,81 @@ stream_open_file(const char *path, int flags, ...)
 	return (stream);
 }
 
+/*
+ * Open a file for reading through a private mapping of it.  The read
+ * buffer of the stream is the mapping itself, so stream_getln() returns
+ * pointers straight into it and the stream never needs to be refilled.
+ * The pages are copied on write, so callers may still modify the lines
+ * they get; seeking maps the file again to get rid of those changes.
+ * Filters can't be used on such streams.
+ *
+ * Files that fit in a regular stream buffer gain nothing from this and
+ * get a regular stream, as do files that can't be mapped.
+ */
+struct stream *
+stream_open_mmap(const char *path)
+{
+	struct stream *stream;
+	struct stat sb;
+	struct buf *buf;
+	void *map, *p;
+	size_t len, maplen;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (NULL);
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size <= STREAM_IOBUFSIZ || (uintmax_t)sb.st_size >= SIZE_MAX)
+		goto fallback;
+	/*
+	 * Keep a spare byte after the data like buf_new() does.  Since
+	 * the file can't be mapped past its end, we reserve a slightly
+	 * larger anonymous mapping first and map the file over it.
+	 */
+	len = sb.st_size;
+	maplen = len + 1;
+	map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+	    -1, 0);
+	if (map == MAP_FAILED)
+		goto fallback;
+	p = mmap(map, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	    fd, 0);
+	if (p == MAP_FAILED) {
+		munmap(map, maplen);
+		goto fallback;
+	}
+	(void)madvise(map, len, MADV_SEQUENTIAL);
+
+	/* The file descriptor is kept to map the file again on seeks. */
+	stream = stream_new(stream_read_mmap, NULL, stream_close_fd, 0, 0);
+	stream->cookie = &stream->fd;
+	stream->fd = fd;
+	buf = stream->rdbuf;
+	free(buf->buf);
+	buf->buf = map;
+	buf->size = len;
+	buf->in = len;
+	buf->off = 0;
+	stream->map = map;
+	stream->maplen = maplen;
+	return (stream);
+fallback:
+	stream = stream_open_fd(fd, stream_read_fd, NULL, stream_close_fd);
+	if (stream == NULL)
+		close(fd);
+	return (stream);
+}
+
+/* There is never anything more to read than what's already mapped. */
+static ssize_t
+stream_read_mmap(void __unused *cookie, void __unused *buf,
+    size_t __unused size)
+{
+
+	return (0);
+}
+
 /* Return the file descriptor associated with this stream, or -1. */
 int
 stream_fileno(struct stream *stream)
@@ -603,12 +819,152 @@ stream_write(struct stream *stream, const void *src, size_t nbytes)
 		error = stream_flush_int(stream, STREAM_FLUSH_NORMAL);
 		if (error)
 			return (-1);
+		stream_adapt(stream, buf, &stream->wrstreak);
 	}
 	memcpy(buf->buf + buf->off + buf->in, src, nbytes);
 	buf_more(buf, nbytes);
 	return (nbytes);
 }
 
+/*
+ * Move "len" bytes from the "src" stream to the "dst" stream, or until
+ * EOF if "len" is negative.  Returns the number of bytes moved, which is
+ * less than "len" only if the source stream hit EOF or a read error,
+ * which can be told apart with stream_eof().  If writing to "dst"
+ * failed, -1 is returned.
+ *
+ * When both streams are plain file descriptors without any filter, the
+ * kernel is asked to do the copy.  Otherwise, the data is moved directly
+ * from the read buffer of "src" to the write buffer of "dst", without
+ * going through a bounce buffer.  If the latter is empty, the buffers
+ * are simply swapped.
+ */
+off_t
+stream_splice(struct stream *dst, struct stream *src, off_t len)
+{
+	struct buf *rdbuf, *wrbuf;
+	off_t done, n;
+	ssize_t nbytes;
+	int error, raw;
+
+	done = 0;
+	raw = stream_israw(src) && stream_israw(dst);
+	while (len < 0 || done < len) {
+		rdbuf = src->rdbuf;
+		if (buf_count(rdbuf) == 0) {
+			/* Nothing buffered on either side, try the kernel. */
+			if (raw && buf_count(dst->wrbuf) == 0) {
+				n = stream_splice_fd(dst, src,
+				    len < 0 ? -1 : len - done);
+				if (n == -1)
+					return (-1);
+				done += n;
+				if (n > 0 || src->eof)
+					break;
+				/* Not supported for these files. */
+				raw = 0;
+			}
+			nbytes = stream_fill(src);
+			if (nbytes <= 0)
+				break;
+		}
+		n = buf_count(rdbuf);
+		if (len >= 0 && n > len - done)
+			n = len - done;
+		wrbuf = dst->wrbuf;
+		if (src->map == NULL && buf_count(wrbuf) == 0 &&
+		    (size_t)n == buf_count(rdbuf) &&
+		    (size_t)n >= buf_size(wrbuf) / 2) {
+			dst->wrbuf = rdbuf;
+			src->rdbuf = wrbuf;
+			error = stream_flush_int(dst, STREAM_FLUSH_NORMAL);
+			if (error)
+				return (-1);
+		} else {
+			nbytes = stream_write(dst, rdbuf->buf + rdbuf->off, n);
+			if (nbytes == -1)
+				return (-1);
+			buf_less(rdbuf, n);
+		}
+		done += n;
+	}
+	return (done);
+}
+
+/*
+ * Returns true if the stream is a plain file descriptor that we can do
+ * I/O on behind its back.
+ */
+static int
+stream_israw(struct stream *stream)
+{
+
+	if (stream->fd == -1 || stream->buf || stream->map != NULL ||
+	    stream->filter->id != STREAM_FILTER_NULL)
+		return (0);
+	if (stream->rdbuf != NULL && stream->readfn != stream_read_fd)
+		return (0);
+	if (stream->wrbuf != NULL && stream->writefn != stream_write_fd)
+		return (0);
+	return (1);
+}
+
+/*
+ * Let the kernel copy the data between the file descriptors of two raw
+ * streams, with copy_file_range(2) or sendfile(2).  Returns 0 without
+ * setting the EOF flag of "src" if these aren't available or don't work
+ * on these files, so that the caller can fall back to doing the copy.
+ */
+static off_t
+stream_splice_fd(struct stream *dst, struct stream *src, off_t len)
+{
+#ifdef __linux__
+	static const size_t maxchunk = 1024 * 1024 * 1024;
+	off_t done;
+	ssize_t n;
+	size_t chunk;
+	int usesendfile;
+
+	done = 0;
+	usesendfile = 0;
+	while (len < 0 || done < len) {
+		chunk = maxchunk;
+		if (len >= 0 && len - done < (off_t)chunk)
+			chunk = len - done;
+		if (!usesendfile)
+			n = copy_file_range(src->fd, NULL, dst->fd, NULL,
+			    chunk, 0);
+		else
+			n = sendfile(dst->fd, src->fd, NULL, chunk);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (done > 0)
+				return (-1);
+			if (errno != EXDEV && errno != EINVAL &&
+			    errno != ENOSYS && errno != EOPNOTSUPP &&
+			    errno != EBADF)
+				return (-1);
+			if (usesendfile)
+				return (0);
+			usesendfile = 1;
+			continue;
+		}
+		if (n == 0) {
+			src->eof = 1;
+			break;
+		}
+		done += n;
+	}
+	return (done);
+#else
+	(void)dst;
+	(void)src;
+	(void)len;
+	return (0);
+#endif
+}
+
 #ifdef DEBUG
 int
 stream_log(struct stream *stream, const char *path)
@@ -646,6 +1002,7 @@ again:
 			error = stream_flush_int(stream, STREAM_FLUSH_NORMAL);
 			if (error)
 				return (-1);
+			stream_adapt(stream, buf, &stream->wrstreak);
 		}
 		goto again;
 	}
@@ -659,6 +1016,8 @@ stream_flush(struct stream *stream)
 {
 	int error;
 
+	/* Explicit flushes break the sequence of full buffers. */
+	stream->wrstreak = 0;
 	error = stream_flush_int(stream, STREAM_FLUSH_NORMAL);
 	return (error);
 }
@@ -763,6 +1122,31 @@ stream_rewind(struct stream *stream)
 {
 	int error;
 
+	error = stream_seek(stream, 0);
+	return (error);
+}
+
+/* Move to the given offset in the stream, like lseek() with SEEK_SET. */
+int
+stream_seek(struct stream *stream, off_t off)
+{
+	struct buf *buf;
+	int error;
+
+	if (stream->map != NULL) {
+		buf = stream->rdbuf;
+		if (off < 0 || off > (off_t)buf_size(buf)) {
+			errno = EINVAL;
+			return (-1);
+		}
+		if (mmap(stream->map, buf_size(buf), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_FIXED, stream->fd, 0) == MAP_FAILED)
+			return (-1);
+		buf->off = off;
+		buf->in = buf_size(buf) - off;
+		stream->eof = 0;
+		return (0);
+	}
 	if (stream->fd == -1) {
 		errno = EINVAL;
 		return (-1);
@@ -774,8 +1158,25 @@ stream_rewind(struct stream *stream)
 		if (error)
 			return (error);
 	}
-	error = lseek(stream->fd, 0, SEEK_SET);
-	return (error);
+	if (lseek(stream->fd, off, SEEK_SET) == -1)
+		return (-1);
+	stream->eof = 0;
+	return (0);
+}
+
+/*
+ * Return the data that has already been read into the stream's buffer
+ * but not consumed yet, without reading anything more.  The data stays
+ * in the stream and is only valid until the next operation on it.
+ */
+char *
+stream_peek(struct stream *stream, size_t *len)
+{
+	struct buf *buf;
+
+	buf = stream->rdbuf;
+	*len = buf_count(buf);
+	return (buf->buf + buf->off);
 }
 
 /* Return EOF status. */
@@ -806,7 +1207,10 @@ stream_close(struct stream *stream)
 		 * not, we need to close the file descriptor.
 		 */
 		error = (*stream->closefn)(stream->cookie);
-	if (stream->rdbuf != NULL)
+	if (stream->map != NULL) {
+		munmap(stream->map, stream->maplen);
+		free(stream->rdbuf);
+	} else if (stream->rdbuf != NULL)
 		buf_free(stream->rdbuf);
 	if (stream->wrbuf != NULL)
 		buf_free(stream->wrbuf);
@@ -856,6 +1260,10 @@ stream_fill(struct stream *stream)
 
 	filter = stream->filter;
 	buf = stream->rdbuf;
+	if (stream->map != NULL) {
+		stream->eof = 1;
+		return (0);
+	}
 	buf_prewrite(buf);
 #ifndef NDEBUG
 	oldcount = buf_count(buf);
@@ -867,9 +1275,30 @@ stream_fill(struct stream *stream)
 #endif
 	assert((n > 0 && n == (signed)(buf_count(buf) - oldcount)) ||
 	    (n <= 0 && buf_count(buf) == oldcount));
+	if (n > 0 && buf_avail(buf) == 0)
+		stream_adapt(stream, buf, &stream->rdstreak);
+	else
+		stream->rdstreak = 0;
 	return (n);
 }
 
+/*
+ * Called when a read buffer has been filled up to its end, or when a
+ * write buffer had to be flushed because it was full.  Once this has
+ * happened STREAM_GROWSTREAK times in a row, double the buffer size.
+ */
+static void
+stream_adapt(struct stream *stream, struct buf *buf, int *streak)
+{
+
+	if (buf_size(buf) >= stream->maxbufsize)
+		return;
+	if (++*streak < STREAM_GROWSTREAK)
+		return;
+	*streak = 0;
+	buf_grow(buf, 0);
+}
+
 /*
  * Lookup a stream filter.
  *
@@ -925,6 +1354,7 @@ stream_filter_start(struct stream *stream, stream_filter_t id, void *data)
 	filter = stream->filter;
 	if (id == filter->id)
 		return (0);
+	assert(stream->map == NULL);
 	stream_filter_fini(stream);
 	stream->filter = stream_filter_lookup(id);
 	stream->fdata = NULL;
@@ -959,15 +1389,25 @@ zfilter_free(void __unused *opaque, void *ptr)
 }
 
 static int
-zfilter_init(struct stream *stream, void __unused *data)
+zfilter_init(struct stream *stream, void *data)
 {
+	struct stream_zopts *opts;
 	struct zfilter *zf;
 	struct buf *buf;
 	z_stream *state;
 	int rv;
 
+	opts = data;
 	zf = xmalloc(sizeof(struct zfilter));
 	memset(zf, 0, sizeof(struct zfilter));
+	zf->level = Z_DEFAULT_COMPRESSION;
+	if (opts != NULL && opts->level == STREAM_ZLEVEL_AUTO) {
+		zf->level = 6;
+		zf->autolevel = 1;
+		zf->backlog = opts->backlog;
+	} else if (opts != NULL) {
+		zf->level = opts->level;
+	}
 	if (stream->rdbuf != NULL) {
 		state = xmalloc(sizeof(z_stream));
 		state->zalloc = zfilter_alloc;
@@ -986,7 +1426,7 @@ zfilter_init(struct stream *stream, void __unused *data)
 		state->zalloc = zfilter_alloc;
 		state->zfree = zfilter_free;
 		state->opaque = Z_NULL;
-		rv = deflateInit(state, Z_DEFAULT_COMPRESSION);
+		rv = deflateInit(state, zf->level);
 		if (rv != Z_OK)
 			errx(1, "deflateInit: %s", state->msg);
 		buf = buf_new(buf_size(stream->wrbuf));
@@ -994,6 +1434,18 @@ zfilter_init(struct stream *stream, void __unused *data)
 		stream->wrbuf = buf;
 		zf->wrstate = state;
 	}
+	/*
+	 * If we can't start the pipeline threads, we just fall back to
+	 * doing the work inline.
+	 */
+	if (opts != NULL && opts->threaded) {
+		if (zf->rdbuf != NULL)
+			zf->rdpipe = zpipe_new(stream, zf,
+			    buf_size(stream->rdbuf), zpipe_reader);
+		if (zf->wrbuf != NULL)
+			zf->wrpipe = zpipe_new(stream, zf,
+			    buf_size(stream->wrbuf), zpipe_writer);
+	}
 	stream->fdata = zf;
 	return (0);
 }
@@ -1014,9 +1466,16 @@ zfilter_fini(struct stream *stream)
 		 * Even if it has produced all the bytes, zlib sometimes
 		 * hasn't seen the EOF marker, so we need to call inflate()
 		 * again to make sure we have eaten all the zlib'ed bytes.
+		 * The pipeline thread does this on its own.
 		 */
-		if ((zf->flags & ZFILTER_EOF) == 0)
+		if (zf->rdpipe != NULL)
+			zpipe_free(zf->rdpipe);
+		else if ((zf->flags & ZFILTER_EOF) == 0)
 			n = zfilter_fill(stream, stream->rdbuf);
+		pthread_mutex_lock(&zstats_lock);
+		zstats_rdin += state->total_in;
+		zstats_rdout += state->total_out;
+		pthread_mutex_unlock(&zstats_lock);
 		inflateEnd(state);
 		free(state);
 		buf_free(stream->rdbuf);
@@ -1034,6 +1493,12 @@ zfilter_fini(struct stream *stream)
 		 */
 		(void)zfilter_flush(stream, stream->wrbuf,
 		    STREAM_FLUSH_CLOSING);
+		if (zf->wrpipe != NULL)
+			zpipe_free(zf->wrpipe);
+		pthread_mutex_lock(&zstats_lock);
+		zstats_wrin += state->total_in;
+		zstats_wrout += state->total_out;
+		pthread_mutex_unlock(&zstats_lock);
 		deflateEnd(state);
 		free(state);
 		buf_free(stream->wrbuf);
@@ -1046,12 +1511,45 @@ static int
 zfilter_flush(struct stream *stream, struct buf *buf, stream_flush_t how)
 {
 	struct zfilter *zf;
+	int error;
+
+	zf = stream->fdata;
+	if (zf->wrpipe != NULL)
+		error = zpipe_flush(zf->wrpipe, buf, how);
+	else
+		error = zfilter_deflate(stream, zf, buf, how);
+	return (error);
+}
+
+static ssize_t
+zfilter_fill(struct stream *stream, struct buf *buf)
+{
+	struct zfilter *zf;
+	ssize_t n;
+
+	zf = stream->fdata;
+	if (zf->rdpipe != NULL)
+		n = zpipe_fill(stream, zf->rdpipe, buf);
+	else
+		n = zfilter_inflate(stream, zf, buf, &stream->eof);
+	return (n);
+}
+
+/*
+ * Compress the contents of "buf" and write them out.  This only uses
+ * the zlib state and the write function of the stream, so that it can
+ * run on the pipeline thread.
+ */
+static int
+zfilter_deflate(struct stream *stream, struct zfilter *zf, struct buf *buf,
+    stream_flush_t how)
+{
+	struct timeval start;
 	struct buf *zbuf;
 	z_stream *state;
 	size_t lastin, lastout, ate, prod;
-	int done, error, flags, rv;
+	int error, flags, rv;
 
-	zf = stream->fdata;
 	state = zf->wrstate;
 	zbuf = zf->wrbuf;
 
@@ -1060,8 +1558,9 @@ zfilter_flush(struct stream *stream, struct buf *buf, stream_flush_t how)
 	else
 		flags = Z_FINISH;
 
-	done = 0;
 	rv = Z_OK;
+	zf->sampled += buf_count(buf);
+	gettimeofday(&start, NULL);
 
 again:
 	/*
@@ -1073,6 +1572,7 @@ again:
 		error = stream_flush_default(stream, zbuf, how);
 		if (error)
 			return (error);
+		zfilter_clock(&start, &zf->iotime);
 	}
 
 	state->next_in = (Bytef *)(buf->buf + buf->off);
@@ -1084,6 +1584,7 @@ again:
 	rv = deflate(state, flags);
 	if (rv != Z_BUF_ERROR && rv != Z_OK && rv != Z_STREAM_END)
 		errx(1, "deflate: %s", state->msg);
+	zfilter_clock(&start, &zf->cputime);
 	ate = lastin - state->avail_in;
 	prod = lastout - state->avail_out;
 	buf_less(buf, ate);
@@ -1095,26 +1596,93 @@ again:
 
 	assert(rv == Z_OK || (rv == Z_STREAM_END && flags == Z_FINISH));
 	error = stream_flush_default(stream, zbuf, how);
-	return (error);
+	if (error)
+		return (error);
+	zfilter_clock(&start, &zf->iotime);
+	if (zf->autolevel && flags == Z_SYNC_FLUSH &&
+	    zf->sampled >= ZFILTER_SAMPLE)
+		zfilter_tune(stream, zf);
+	return (0);
 }
 
+/*
+ * Pick a new compression level for the "auto" setting.  If the output
+ * buffer is filling up, or if we spent more time waiting to write the
+ * data than compressing it, the network link is the bottleneck and it
+ * pays to compress harder.  If the buffer is mostly empty and zlib is
+ * what takes time, we're slowing things down and should back off.
+ * This is called after a sync flush, so zlib lets us change the level.
+ */
+static void
+zfilter_tune(struct stream *stream, struct zfilter *zf)
+{
+	struct buf *zbuf;
+	z_stream *state;
+	size_t lastout;
+	int backlog, level, rv;
+
+	backlog = -1;
+	if (zf->backlog != NULL)
+		backlog = (*zf->backlog)(stream->cookie);
+	level = zf->level;
+	if (backlog >= ZFILTER_HIWAT ||
+	    (backlog == -1 && timercmp(&zf->iotime, &zf->cputime, >)))
+		level = min(level + 1, Z_BEST_COMPRESSION);
+	else if (backlog < ZFILTER_LOWAT &&
+	    timercmp(&zf->cputime, &zf->iotime, >))
+		level = max(level - 1, Z_NO_COMPRESSION);
+	zf->sampled = 0;
+	timerclear(&zf->cputime);
+	timerclear(&zf->iotime);
+	if (level == zf->level)
+		return;
+
+	state = zf->wrstate;
+	zbuf = zf->wrbuf;
+	state->next_out = (Bytef *)(zbuf->buf + zbuf->off + zbuf->in);
+	state->avail_out = buf_avail(zbuf);
+	lastout = state->avail_out;
+	rv = deflateParams(state, level, Z_DEFAULT_STRATEGY);
+	/* Anything produced here goes out with the next flush. */
+	buf_more(zbuf, lastout - state->avail_out);
+	if (rv == Z_OK)
+		zf->level = level;
+}
+
+/* Add the time elapsed since "start" to "total", and restart the clock. */
+static void
+zfilter_clock(struct timeval *start, struct timeval *total)
+{
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &diff);
+	timeradd(total, &diff, total);
+	*start = now;
+}
+
+/*
+ * Uncompress as many bytes as we can into "buf", reading more data
+ * from the underlying stream as needed.  Like zfilter_deflate(), this
+ * doesn't touch the stream itself, and hitting EOF is recorded in the
+ * variable pointed to by "eof".
+ */
 static ssize_t
-zfilter_fill(struct stream *stream, struct buf *buf)
+zfilter_inflate(struct stream *stream, struct zfilter *zf, struct buf *buf,
+    int *eof)
 {
-	struct zfilter *zf;
 	struct buf *zbuf;
 	z_stream *state;
 	size_t lastin, lastout, new;
 	ssize_t n;
 	int rv;
 
-	zf = stream->fdata;
 	state = zf->rdstate;
 	zbuf = zf->rdbuf;
 
 	assert(buf_avail(buf) > 0);
 	if (buf_count(zbuf) == 0) {
-		n = stream_fill_default(stream, zbuf);
+		n = zfilter_read(stream, zbuf, eof);
 		if (n <= 0)
 			return (n);
 	}
@@ -1130,7 +1698,7 @@ again:
 	buf_less(zbuf, lastin - state->avail_in);
 	new = lastout - state->avail_out;
 	if (new == 0 && rv != Z_STREAM_END) {
-		n = stream_fill_default(stream, zbuf);
+		n = zfilter_read(stream, zbuf, eof);
 		if (n == -1)
 			return (-1);
 		if (n == 0)
@@ -1145,6 +1713,265 @@ again:
 	return (new);
 }
 
+/* Same as stream_fill_default(), but with a separate EOF flag. */
+static ssize_t
+zfilter_read(struct stream *stream, struct buf *zbuf, int *eof)
+{
+	ssize_t n;
+
+	if (*eof)
+		return (0);
+	assert(buf_avail(zbuf) > 0);
+	n = (*stream->readfn)(stream->cookie,
+	    zbuf->buf + zbuf->off + zbuf->in, buf_avail(zbuf));
+	if (n < 0)
+		return (-1);
+	if (n == 0) {
+		*eof = 1;
+		return (0);
+	}
+	buf_more(zbuf, n);
+	return (n);
+}
+
+/*
+ * Create a pipeline stage for one direction of a zlib filter, and start
+ * its thread.  Returns NULL if the thread couldn't be created.
+ */
+static struct zpipe *
+zpipe_new(struct stream *stream, struct zfilter *zf, size_t size,
+    void *(*fn)(void *))
+{
+	struct zpipe *zp;
+	int error, i;
+
+	zp = xmalloc(sizeof(struct zpipe));
+	memset(zp, 0, sizeof(struct zpipe));
+	zp->stream = stream;
+	zp->zf = zf;
+	pthread_mutex_init(&zp->lock, NULL);
+	pthread_cond_init(&zp->cond, NULL);
+	for (i = 0; i < ZPIPE_NSLOTS; i++)
+		zp->slots[i] = buf_new(size);
+	error = pthread_create(&zp->thread, NULL, fn, zp);
+	if (error) {
+		for (i = 0; i < ZPIPE_NSLOTS; i++)
+			buf_free(zp->slots[i]);
+		pthread_cond_destroy(&zp->cond);
+		pthread_mutex_destroy(&zp->lock);
+		free(zp);
+		return (NULL);
+	}
+	return (zp);
+}
+
+/*
+ * Tell the pipeline thread that we're done and wait for it to exit.
+ * The writer thread finishes processing the queued buffers first, and
+ * the reader thread keeps going until it has seen the zlib EOF marker,
+ * throwing away any data that nobody is going to read anymore.
+ */
+static void
+zpipe_free(struct zpipe *zp)
+{
+	int i;
+
+	pthread_mutex_lock(&zp->lock);
+	zp->done = 1;
+	pthread_cond_broadcast(&zp->cond);
+	pthread_mutex_unlock(&zp->lock);
+	pthread_join(zp->thread, NULL);
+	for (i = 0; i < ZPIPE_NSLOTS; i++)
+		buf_free(zp->slots[i]);
+	pthread_cond_destroy(&zp->cond);
+	pthread_mutex_destroy(&zp->lock);
+	free(zp);
+}
+
+/* The pipeline thread for the read side of the zlib filter. */
+static void *
+zpipe_reader(void *arg)
+{
+	struct zpipe *zp;
+	struct buf *buf;
+	ssize_t n;
+	int eof, error;
+
+	zp = arg;
+	eof = 0;
+	pthread_mutex_lock(&zp->lock);
+	for (;;) {
+		while (zp->count == ZPIPE_NSLOTS && !zp->done)
+			pthread_cond_wait(&zp->cond, &zp->lock);
+		if (zp->done) {
+			/* Nobody is going to read these anymore. */
+			while (zp->count > 0) {
+				buf = zp->slots[zp->head];
+				buf_less(buf, buf_count(buf));
+				zp->head = (zp->head + 1) % ZPIPE_NSLOTS;
+				zp->count--;
+			}
+		}
+		buf = zp->slots[(zp->head + zp->count) % ZPIPE_NSLOTS];
+		pthread_mutex_unlock(&zp->lock);
+		n = zfilter_inflate(zp->stream, zp->zf, buf, &eof);
+		error = errno;
+		pthread_mutex_lock(&zp->lock);
+		if (n <= 0) {
+			if (n == -1)
+				zp->error = error != 0 ? error : EIO;
+			zp->eof = eof;
+			break;
+		}
+		zp->count++;
+		pthread_cond_broadcast(&zp->cond);
+		if (zp->zf->flags & ZFILTER_EOF)
+			break;
+	}
+	zp->finished = 1;
+	pthread_cond_broadcast(&zp->cond);
+	pthread_mutex_unlock(&zp->lock);
+	return (NULL);
+}
+
+/* The pipeline thread for the write side of the zlib filter. */
+static void *
+zpipe_writer(void *arg)
+{
+	struct zpipe *zp;
+	struct buf *buf;
+	stream_flush_t how;
+	int error, failed;
+
+	zp = arg;
+	pthread_mutex_lock(&zp->lock);
+	for (;;) {
+		while (zp->count == 0 && !zp->done)
+			pthread_cond_wait(&zp->cond, &zp->lock);
+		if (zp->count == 0)
+			break;
+		buf = zp->slots[zp->head];
+		how = zp->how[zp->head];
+		failed = zp->error;
+		pthread_mutex_unlock(&zp->lock);
+		error = 0;
+		/* Once writing has failed, the data is just discarded. */
+		if (!failed && zfilter_deflate(zp->stream, zp->zf, buf, how))
+			error = errno != 0 ? errno : EIO;
+		buf_less(buf, buf_count(buf));
+		pthread_mutex_lock(&zp->lock);
+		if (error && !zp->error)
+			zp->error = error;
+		zp->head = (zp->head + 1) % ZPIPE_NSLOTS;
+		zp->count--;
+		pthread_cond_broadcast(&zp->cond);
+	}
+	pthread_mutex_unlock(&zp->lock);
+	return (NULL);
+}
+
+/* Hand uncompressed data from the reader thread over to the stream. */
+static ssize_t
+zpipe_fill(struct stream *stream, struct zpipe *zp, struct buf *buf)
+{
+	struct buf *slot;
+	size_t n;
+
+	pthread_mutex_lock(&zp->lock);
+	while (zp->count == 0 && !zp->finished)
+		pthread_cond_wait(&zp->cond, &zp->lock);
+	if (zp->count == 0) {
+		if (zp->error) {
+			errno = zp->error;
+			pthread_mutex_unlock(&zp->lock);
+			return (-1);
+		}
+		if (zp->eof)
+			stream->eof = 1;
+		pthread_mutex_unlock(&zp->lock);
+		return (0);
+	}
+	slot = zp->slots[zp->head];
+	pthread_mutex_unlock(&zp->lock);
+
+	n = min(buf_avail(buf), buf_count(slot));
+	memcpy(buf->buf + buf->off + buf->in, slot->buf + slot->off, n);
+	buf_more(buf, n);
+	buf_less(slot, n);
+	if (buf_count(slot) == 0) {
+		pthread_mutex_lock(&zp->lock);
+		zp->head = (zp->head + 1) % ZPIPE_NSLOTS;
+		zp->count--;
+		pthread_cond_broadcast(&zp->cond);
+		pthread_mutex_unlock(&zp->lock);
+	}
+	return (n);
+}
+
+/*
+ * Queue a copy of the data in "buf" for the writer thread.  We don't
+ * wait for it to be written out unless the stream is being closed,
+ * write errors are reported on the next call.
+ */
+static int
+zpipe_flush(struct zpipe *zp, struct buf *buf, stream_flush_t how)
+{
+	struct buf *slot;
+	int error, i;
+
+	pthread_mutex_lock(&zp->lock);
+	while (zp->count == ZPIPE_NSLOTS)
+		pthread_cond_wait(&zp->cond, &zp->lock);
+	/* There is nothing to do for an empty normal flush. */
+	if (!zp->error && (buf_count(buf) > 0 || how != STREAM_FLUSH_NORMAL)) {
+		i = (zp->head + zp->count) % ZPIPE_NSLOTS;
+		slot = zp->slots[i];
+		pthread_mutex_unlock(&zp->lock);
+		if (buf_count(buf) > buf_size(slot))
+			buf_grow(slot, buf_count(buf));
+		memcpy(slot->buf, buf->buf + buf->off, buf_count(buf));
+		buf_more(slot, buf_count(buf));
+		buf_less(buf, buf_count(buf));
+		pthread_mutex_lock(&zp->lock);
+		zp->how[i] = how;
+		zp->count++;
+		pthread_cond_broadcast(&zp->cond);
+	}
+	if (how == STREAM_FLUSH_CLOSING) {
+		while (zp->count > 0)
+			pthread_cond_wait(&zp->cond, &zp->lock);
+	}
+	error = 0;
+	if (zp->error) {
+		errno = zp->error;
+		error = -1;
+	}
+	pthread_mutex_unlock(&zp->lock);
+	return (error);
+}
+
+/* Report the effective compression ratio of the zlib filters. */
+void
+stream_zreport(int level)
+{
+	uint64_t rdin, rdout, wrin, wrout;
+
+	pthread_mutex_lock(&zstats_lock);
+	rdin = zstats_rdin;
+	rdout = zstats_rdout;
+	wrin = zstats_wrin;
+	wrout = zstats_wrout;
+	pthread_mutex_unlock(&zstats_lock);
+	if (rdin > 0)
+		lprintf(level, "Received %llu compressed bytes for %llu bytes "
+		    "of data (ratio %.2f)\n", (unsigned long long)rdin,
+		    (unsigned long long)rdout, (double)rdout / rdin);
+	if (wrout > 0)
+		lprintf(level, "Sent %llu compressed bytes for %llu bytes "
+		    "of data (ratio %.2f)\n", (unsigned long long)wrout,
+		    (unsigned long long)wrin, (double)wrin / wrout);
+}
+
 /* The MD5 stream filter implementation. */
 static int
 md5filter_init(struct stream *stream, void *data)
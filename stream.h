@@ -39,6 +39,19 @@ typedef enum {
 struct stream;
 struct buf;
 
+typedef int	stream_backlogfn_t(void *);
+
+/* Compression levels for the zlib filter, besides the usual 0 to 9. */
+#define	STREAM_ZLEVEL_DEFAULT	(-1)
+#define	STREAM_ZLEVEL_AUTO	(-2)
+
+/* Options for the zlib filter, passed as its data argument. */
+struct stream_zopts {
+	int threaded;			/* Run zlib on a separate thread. */
+	int level;			/* Compression level. */
+	stream_backlogfn_t *backlog;	/* Output buffer usage, in percent. */
+};
+
 typedef ssize_t	stream_readfn_t(void *, void *, size_t);
 typedef ssize_t	stream_writefn_t(void *, const void *, size_t);
 typedef int	stream_closefn_t(void *);
@@ -59,10 +72,14 @@ struct stream	*stream_open_fd(int, stream_readfn_t *, stream_writefn_t *,
 		     stream_closefn_t *);
 struct stream	*stream_open_buf(struct buf *);
 struct stream	*stream_open_file(const char *, int, ...);
+struct stream	*stream_open_fileat(int, const char *, int, ...);
+struct stream	*stream_open_mmap(const char *);
 int		 stream_fileno(struct stream *);
 ssize_t		 stream_read(struct stream *, void *, size_t);
 ssize_t		 stream_write(struct stream *, const void *, size_t);
+off_t		 stream_splice(struct stream *, struct stream *, off_t);
 char		*stream_getln(struct stream *, size_t *);
+char		*stream_peek(struct stream *, size_t *);
 int		 stream_printf(struct stream *, const char *, ...)
 		     __printflike(2, 3);
 int		 stream_flush(struct stream *);
@@ -71,10 +88,12 @@ int		 stream_truncate(struct stream *, off_t);
 void		 stream_truncate_buf(struct buf *, off_t);
 int		 stream_truncate_rel(struct stream *, off_t);
 int		 stream_rewind(struct stream *);
+int		 stream_seek(struct stream *, off_t);
 int		 stream_eof(struct stream *);
 int		 stream_close(struct stream *);
 int		 stream_filter_start(struct stream *, stream_filter_t, void *);
 void		 stream_filter_stop(struct stream *);
+void		 stream_zreport(int);
 #ifdef DEBUG
 int		 stream_log(struct stream *, const char *);
 #endif
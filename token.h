@@ -43,5 +43,7 @@ int	yyparse(void);
 #define PT_USE_REL_SUFFIX	9
 #define PT_LIST			10
 #define PT_NORSYNC		11
+#define PT_INPLACE		12
+#define PT_DURABILITY		13
 
 #endif /* !_TOKEN_H_ */
@@ -31,7 +31,9 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,72 +41,161 @@
 
 #include "config.h"
 #include "diff.h"
+#include "dircache.h"
 #include "fattr.h"
 #include "fixups.h"
+#include "hashcache.h"
+#include "hasher.h"
 #include "keyword.h"
 #include "updater.h"
 #include "misc.h"
 #include "mux.h"
 #include "proto.h"
+#include "queue.h"
 #include "rcsfile.h"
+#include "rsyncfile.h"
 #include "status.h"
 #include "stream.h"
 
+/* We are always built with a 64 bits off_t. */
+#ifndef OFF_MAX
+#define	OFF_MAX		INT64_MAX
+#endif
+
 /* Internal error codes. */
 #define	UPDATER_ERR_PROTO	(-1)	/* Protocol error. */
 #define	UPDATER_ERR_MSG		(-2)	/* Error is in updater->errmsg. */
 #define	UPDATER_ERR_READ	(-3)	/* Error reading from server. */
 #define	UPDATER_ERR_DELETELIM	(-4)	/* File deletion limit exceeded. */
 
-#define BUFSIZE 4096
+/*
+ * The updater is split in two.  The thread running updater() decodes the
+ * protocol and writes the data received from the server to temporary
+ * files.  A pool of worker threads then finishes the updates: it checks
+ * the new files, installs them and sets their attributes, so that a slow
+ * disk doesn't stall the network.  Since the status file has to be
+ * written in order, the updates are finally committed to it by whichever
+ * thread completes the oldest one, in the order they were received in.
+ */
+#define	UPDATER_MAXTHREADS	8
+#define	UPDATER_MAXJOBS		256	/* Updates in progress. */
+
+/* What to record in the status file once a file has been updated. */
+#define	FUP_STATUS_NONE		0
+#define	FUP_STATUS_PUT		1
+#define	FUP_STATUS_DELETE	2
+
+struct updater;
+struct file_update;
+
+typedef int	 updater_workfn_t(struct updater *, struct file_update *);
 
 /* Everything needed to update a file. */
 struct file_update {
 	struct statusrec srbuf;
 	char *destpath;
 	char *temppath;
+	int tempfd;		/* Anonymous temporary file, or -1. */
 	char *origpath;
+	int moved;		/* The file was removed from origpath. */
 	char *coname;		/* Points somewhere in destpath. */
 	char *wantmd5;
 	int isfixup;
-	int free_wantmd5;	/* Indicates if we need to free the wantmd5
-				   field in fup_reset(). */
 	struct coll *coll;
 	struct status *st;
 	/* Those are only used for diff updating. */
 	char *author;
-	struct stream *orig;
-	struct stream *to;
+	struct difftext *text;
 	int attic;
 	int expand;
+	/* Those are used to finish the update in the worker pool. */
+	char md5[MD5_DIGEST_SIZE];	/* Checksum of the new file. */
+	int iscontent;			/* See updater_updatefile(). */
+	struct hashjob *hashjob;	/* Computes md5, may be NULL. */
+	updater_workfn_t *work;		/* May be NULL. */
+	int ordered;			/* Do the work in sequence. */
+	int status;			/* One of FUP_STATUS_*. */
+	int fixup;			/* Request a fixup for the file. */
+	int done;
+	int error;
+	char *errmsg;
+	STAILQ_ENTRY(file_update) todo;
+	STAILQ_ENTRY(file_update) next;
+};
+
+struct updater_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t newjob;
+	pthread_cond_t jobdone;
+	STAILQ_HEAD(, file_update) todo;	/* Waiting for a worker. */
+	STAILQ_HEAD(, file_update) jobs;	/* Waiting to be committed. */
+	int njobs;
+	int committing;
+	int error;				/* First error, in order. */
+	char *errmsg;
+	int shutdown;
+	struct config *config;
+	struct hasher *hasher;
+	struct pattlist *syncdirs;
+	int nthreads;
+	pthread_t *threads;
 };
 
 struct updater {
 	struct config *config;
 	struct stream *rd;
+	struct hasher *hasher;		/* May be NULL. */
+	struct updater_pool *pool;	/* May be NULL. */
+	struct pattlist *syncdirs;	/* Directories to sync. */
+	struct dircache *dircache;	/* Only for the updater thread. */
+	int tmpfile;			/* Use anonymous temporary files. */
+	char *knowndir;			/* See updater_mkdirhier(). */
 	char *errmsg;
 	int deletecount;
 };
 
-static void	 fup_init(struct file_update *, struct coll *, struct status *);
+static struct file_update	*fup_new(struct coll *, struct status *);
 static int	 fup_prepare(struct file_update *, char *, int);
-static void	 fup_reset(struct file_update *);
-
+static void	 fup_free(struct file_update *);
+
+static struct updater_pool	*updater_pool_new(struct updater *, int);
+static void	 updater_pool_free(struct updater_pool *);
+static void	*updater_worker(void *);
+static int	 updater_submit(struct updater *, struct file_update *);
+static int	 updater_drain(struct updater *);
+static void	 updater_sequence(struct updater *);
+static int	 updater_commit(struct updater *, struct file_update *);
+static void	 updater_syncdir(struct updater *, const char *);
+static int	 updater_samedir(const char *, const char *);
+
+static int	 updater_lookup(struct updater *, const char *, const char **);
+static int	 updater_stale(struct updater *);
+static struct fattr	*updater_getattr(struct updater *, const char *, int);
+#ifdef O_TMPFILE
+static struct stream	*updater_opentmpfile(struct updater *, const char *,
+			     int, mode_t);
+#endif
 static void	 updater_prunedirs(char *, char *);
+static int	 updater_mkdirhier(struct updater *, char *, mode_t);
+static void	 updater_forgetdirs(struct updater *);
 static int	 updater_batch(struct updater *, int);
-static int	 updater_docoll(struct updater *, struct file_update *, int);
+static int	 updater_docoll(struct updater *, struct coll *,
+		     struct status *, int);
+static int	 updater_docmd(struct updater *, struct file_update *, int,
+		     char *);
 static int	 updater_delete(struct updater *, struct file_update *);
-static void	 updater_deletefile(const char *);
+static int	 updater_deletefile(const char *);
+static struct stream	*updater_opentemp(struct updater *,
+			    struct file_update *, int, mode_t);
+static void	 updater_droptemp(struct file_update *);
 static int	 updater_checkout(struct updater *, struct file_update *);
 static int	 updater_addfile(struct updater *, struct file_update *);
 static int	 updater_addelta(struct rcsfile *rf, struct stream *rd,
 		     char *revnum, char *diffbase, char *revdate, char *author);
-static int	 updater_setattrs(struct updater *, struct file_update *,
-		     char *, char *, char *, char *, char *, struct fattr *);
-static int	 updater_setdirattrs(struct updater *, struct coll *,
-		     struct file_update *, char *, char *);
-static int	 updater_updatefile(struct updater *, struct file_update *fup,
-		     const char *);
+static int	 updater_setattrs(struct updater *, struct file_update *);
+static int	 updater_setdirattrs(struct updater *, struct file_update *);
+static int	 updater_rmdir(struct updater *, struct file_update *);
+static int	 updater_updatefile(struct updater *, struct file_update *);
 static int	 updater_updatenode(struct updater *, struct coll *,
 		     struct file_update *, char *);
 static int	 updater_diff(struct updater *, struct file_update *);
@@ -115,19 +206,27 @@ static void	 updater_openrcs(struct rcsfile **, struct file_update *,
 		     const char *, const char *);
 static int	 updater_rcsedit(struct updater *, struct file_update *, char *,
 		     char *);
+static int	 updater_rcsedit_install(struct updater *,
+		     struct file_update *);
 int		 updater_append_file(struct updater *, struct file_update *,
 		     off_t);
 static int	 updater_rsync(struct updater *, struct file_update *, size_t);
+static int	 updater_rsync_sync(struct stream *, struct hashjob *);
+static int	 updater_rsync_inplace(struct updater *, struct file_update *,
+		     size_t);
 static int	 updater_read_checkout(struct stream *, struct stream *);
 
-static void
-fup_init(struct file_update *fup, struct coll *coll, struct status *st)
+static struct file_update *
+fup_new(struct coll *coll, struct status *st)
 {
+	struct file_update *fup;
 
+	fup = xmalloc(sizeof(struct file_update));
 	memset(fup, 0, sizeof(*fup));
 	fup->coll = coll;
 	fup->st = st;
-	fup->free_wantmd5 = 1;
+	fup->tempfd = -1;
+	return (fup);
 }
 
 static int
@@ -138,7 +237,6 @@ fup_prepare(struct file_update *fup, char *name, int attic)
 	coll = fup->coll;
 	fup->attic = 0;
 	fup->origpath = NULL;
-	fup->free_wantmd5 = 1;
 
 	if (coll->co_options & CO_CHECKOUTMODE)
 		fup->destpath = checkoutpath(coll->co_prefix, name);
@@ -159,47 +257,32 @@ fup_prepare(struct file_update *fup, char *name, int attic)
 	return (0);
 }
 
-/* Called after each file update to reinit the structure. */
+/* Called once the update of a file has been committed or abandoned. */
 static void
-fup_reset(struct file_update *fup)
+fup_free(struct file_update *fup)
 {
 	struct statusrec *sr;
 
 	sr = &fup->srbuf;
 
-	if (fup->destpath != NULL) {
+	if (fup->hashjob != NULL)
+		(void)hashjob_wait(fup->hashjob, fup->md5, NULL, NULL);
+	if (fup->tempfd != -1)
+		close(fup->tempfd);
+	if (fup->destpath != NULL)
 		free(fup->destpath);
-		fup->destpath = NULL;
-	}
-	if (fup->temppath != NULL) {
+	if (fup->temppath != NULL)
 		free(fup->temppath);
-		fup->temppath = NULL;
-	}
-	if (fup->origpath != NULL) {
+	if (fup->origpath != NULL)
 		free(fup->origpath);
-		fup->origpath = NULL;
-	}
-	fup->coname = NULL;
-	if (fup->author != NULL) {
+	if (fup->author != NULL)
 		free(fup->author);
-		fup->author = NULL;
-	}
-	fup->expand = 0;
-	if (fup->wantmd5 != NULL) {
-		if (fup->free_wantmd5)
-			free(fup->wantmd5);
-		fup->wantmd5 = NULL;
-	}
-	fup->free_wantmd5 = 1;
-	fup->isfixup = 0;
-	if (fup->orig != NULL) {
-		stream_close(fup->orig);
-		fup->orig = NULL;
-	}
-	if (fup->to != NULL) {
-		stream_close(fup->to);
-		fup->to = NULL;
-	}
+	if (fup->wantmd5 != NULL)
+		free(fup->wantmd5);
+	if (fup->text != NULL)
+		difftext_free(fup->text);
+	if (fup->errmsg != NULL)
+		free(fup->errmsg);
 	if (sr->sr_file != NULL)
 		free(sr->sr_file);
 	if (sr->sr_tag != NULL)
@@ -212,7 +295,302 @@ fup_reset(struct file_update *fup)
 		free(sr->sr_revdate);
 	fattr_free(sr->sr_clientattr);
 	fattr_free(sr->sr_serverattr);
-	memset(sr, 0, sizeof(*sr));
+	free(fup);
+}
+
+/*
+ * Start the worker pool, with as many threads as there are processors
+ * if "nthreads" is 0.  Returns NULL if no thread could be started, in
+ * which case the updates are done synchronously.
+ */
+static struct updater_pool *
+updater_pool_new(struct updater *up, int nthreads)
+{
+	struct updater_pool *pool;
+	long ncpu;
+	int error, i;
+
+	if (nthreads <= 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? (int)min(ncpu, UPDATER_MAXTHREADS) : 1;
+	}
+	pool = xmalloc(sizeof(struct updater_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->newjob, NULL);
+	pthread_cond_init(&pool->jobdone, NULL);
+	STAILQ_INIT(&pool->todo);
+	STAILQ_INIT(&pool->jobs);
+	pool->njobs = 0;
+	pool->committing = 0;
+	pool->error = 0;
+	pool->errmsg = NULL;
+	pool->shutdown = 0;
+	pool->config = up->config;
+	pool->hasher = up->hasher;
+	pool->syncdirs = up->syncdirs;
+	pool->threads = xmalloc(nthreads * sizeof(pthread_t));
+	for (i = 0; i < nthreads; i++) {
+		error = pthread_create(&pool->threads[i], NULL, updater_worker,
+		    pool);
+		if (error)
+			break;
+	}
+	pool->nthreads = i;
+	if (pool->nthreads == 0) {
+		updater_pool_free(pool);
+		return (NULL);
+	}
+	return (pool);
+}
+
+/* Stop the workers.  The pool must have been drained. */
+static void
+updater_pool_free(struct updater_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	assert(STAILQ_EMPTY(&pool->jobs));
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->newjob);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->jobdone);
+	pthread_cond_destroy(&pool->newjob);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+static void *
+updater_worker(void *arg)
+{
+	struct updater_pool *pool;
+	struct updater upbuf, *up;
+	struct file_update *fup;
+	int error;
+
+	pool = arg;
+	up = &upbuf;
+	memset(up, 0, sizeof(*up));
+	up->config = pool->config;
+	up->hasher = pool->hasher;
+	up->syncdirs = pool->syncdirs;
+	up->pool = pool;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (STAILQ_EMPTY(&pool->todo) && !pool->shutdown)
+			pthread_cond_wait(&pool->newjob, &pool->lock);
+		fup = STAILQ_FIRST(&pool->todo);
+		if (fup == NULL)
+			break;
+		STAILQ_REMOVE_HEAD(&pool->todo, todo);
+		error = pool->error;
+		pthread_mutex_unlock(&pool->lock);
+		if (error) {
+			/* Nothing will be committed anymore. */
+			if (fup->temppath != NULL)
+				updater_droptemp(fup);
+		} else {
+			fup->error = fup->work(up, fup);
+			if (fup->error == UPDATER_ERR_MSG) {
+				fup->errmsg = up->errmsg;
+				up->errmsg = NULL;
+			}
+		}
+		pthread_mutex_lock(&pool->lock);
+		fup->done = 1;
+		updater_sequence(up);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return (NULL);
+}
+
+/*
+ * Hand over the update of a file, once all the data for it has been
+ * received.  The updater waits here if too many updates are pending.
+ * A non-zero return value means that an update has failed, and that
+ * updater_drain() must be called to get the error.
+ */
+static int
+updater_submit(struct updater *up, struct file_update *fup)
+{
+	struct updater_pool *pool;
+	int error;
+
+	pool = up->pool;
+	if (pool == NULL) {
+		error = 0;
+		if (fup->work != NULL && !fup->ordered)
+			error = fup->work(up, fup);
+		if (!error)
+			error = updater_commit(up, fup);
+		fup_free(fup);
+		return (error);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->njobs >= UPDATER_MAXJOBS)
+		pthread_cond_wait(&pool->jobdone, &pool->lock);
+	pool->njobs++;
+	STAILQ_INSERT_TAIL(&pool->jobs, fup, next);
+	if (fup->work != NULL && !fup->ordered) {
+		STAILQ_INSERT_TAIL(&pool->todo, fup, todo);
+		pthread_cond_signal(&pool->newjob);
+	} else {
+		fup->done = 1;
+		updater_sequence(up);
+	}
+	error = pool->error;
+	pthread_mutex_unlock(&pool->lock);
+	return (error);
+}
+
+/*
+ * Wait until all the pending updates have been committed, and return
+ * the error of the first one that failed, if any.
+ */
+static int
+updater_drain(struct updater *up)
+{
+	struct updater_pool *pool;
+	int error;
+
+	pool = up->pool;
+	if (pool == NULL)
+		return (0);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->njobs > 0)
+		pthread_cond_wait(&pool->jobdone, &pool->lock);
+	error = pool->error;
+	if (pool->errmsg != NULL) {
+		if (up->errmsg != NULL)
+			free(up->errmsg);
+		up->errmsg = pool->errmsg;
+	}
+	pool->error = 0;
+	pool->errmsg = NULL;
+	pthread_mutex_unlock(&pool->lock);
+	return (error);
+}
+
+/*
+ * Commit the updates at the head of the queue that are done.  Only one
+ * thread does this at a time, the others just leave their updates for
+ * it.  Called and returns with the pool lock held.
+ */
+static void
+updater_sequence(struct updater *up)
+{
+	struct updater_pool *pool;
+	struct file_update *fup;
+	int error;
+
+	pool = up->pool;
+	if (pool->committing)
+		return;
+	pool->committing = 1;
+	while ((fup = STAILQ_FIRST(&pool->jobs)) != NULL && fup->done) {
+		STAILQ_REMOVE_HEAD(&pool->jobs, next);
+		error = pool->error;
+		pthread_mutex_unlock(&pool->lock);
+		if (!error)
+			error = updater_commit(up, fup);
+		else
+			error = 0;
+		fup_free(fup);
+		pthread_mutex_lock(&pool->lock);
+		if (error) {
+			pool->error = error;
+			pool->errmsg = up->errmsg;
+			up->errmsg = NULL;
+		}
+		pool->njobs--;
+		pthread_cond_broadcast(&pool->jobdone);
+	}
+	pool->committing = 0;
+}
+
+/*
+ * Record the update of a file in the status file.  Updates whose work
+ * has to be done in sequence, like setting the attributes of a directory
+ * once all the files in it have been installed, are done here.
+ */
+static int
+updater_commit(struct updater *up, struct file_update *fup)
+{
+	int error;
+
+	if (fup->error) {
+		up->errmsg = fup->errmsg;
+		fup->errmsg = NULL;
+		return (fup->error);
+	}
+	if (fup->ordered) {
+		error = fup->work(up, fup);
+		if (error)
+			return (error);
+	}
+	if (fup->fixup)
+		fixups_put(up->config->fixups, fup->coll, fup->srbuf.sr_file);
+	switch (fup->status) {
+	case FUP_STATUS_PUT:
+		error = status_put(fup->st, &fup->srbuf);
+		break;
+	case FUP_STATUS_DELETE:
+		error = status_delete(fup->st, fup->srbuf.sr_file, 0);
+		break;
+	default:
+		error = 0;
+		break;
+	}
+	if (error) {
+		up->errmsg = status_errmsg(fup->st);
+		return (UPDATER_ERR_MSG);
+	}
+	/*
+	 * Remember the directory of the file so that it gets synced
+	 * before the status file, as well as the directory the file
+	 * was removed from if it moved in or out of the Attic.
+	 */
+	if (fup->status != FUP_STATUS_NONE &&
+	    fup->coll->co_durability == DURABILITY_BATCH) {
+		if (fup->destpath != NULL)
+			updater_syncdir(up, fup->destpath);
+		if (fup->moved)
+			updater_syncdir(up, fup->origpath);
+	}
+	return (0);
+}
+
+/*
+ * Add the directory of a file to the ones to sync.  Updates come sorted,
+ * so checking against the last directory is enough to avoid most
+ * duplicates.
+ */
+static void
+updater_syncdir(struct updater *up, const char *path)
+{
+	const char *last;
+	size_t n;
+
+	n = pattlist_size(up->syncdirs);
+	last = n > 0 ? pattlist_get(up->syncdirs, n - 1) : NULL;
+	if (last == NULL || !updater_samedir(last, path))
+		pattlist_add(up->syncdirs, path);
+}
+
+/* Return non-zero if both paths are in the same directory. */
+static int
+updater_samedir(const char *path1, const char *path2)
+{
+	size_t len;
+
+	len = pathlast(path1) - path1;
+	return (len == (size_t)(pathlast(path2) - path2) &&
+	    strncmp(path1, path2, len) == 0);
 }
 
 void *
@@ -229,6 +607,17 @@ updater(void *arg)
 	up->rd = args->rd;
 	up->errmsg = NULL;
 	up->deletecount = 0;
+	up->hasher = hasher_new(1);
+	up->syncdirs = pattlist_new();
+	up->knowndir = NULL;
+	up->dircache = NULL;
+#ifdef O_TMPFILE
+	/* We need /proc to give a name to the files. */
+	up->tmpfile = (access("/proc/self/fd", F_OK) == 0);
+#else
+	up->tmpfile = 0;
+#endif
+	up->pool = updater_pool_new(up, 0);
 
 #ifdef UPDATER_DEBUG
 	error = stream_log(up->rd, "updater.log");
@@ -244,6 +633,12 @@ updater(void *arg)
 	fixups_close(up->config->fixups);
 	if (!error)
 		error = updater_batch(up, 1);
+	if (up->pool != NULL)
+		updater_pool_free(up->pool);
+	if (up->hasher != NULL)
+		hasher_free(up->hasher);
+	pattlist_free(up->syncdirs);
+	updater_forgetdirs(up);
 	switch (error) {
 	case UPDATER_ERR_PROTO:
 		xasprintf(&args->errmsg, "Updater failed: Protocol error");
@@ -280,13 +675,16 @@ static int
 updater_batch(struct updater *up, int isfixups)
 {
 	struct stream *rd;
+	struct stream_zopts zopts;
 	struct coll *coll;
 	struct status *st;
-	struct file_update fup;
-	char *line, *cmd, *errmsg, *collname, *release;
+	char *line, *cmd, *errmsg, *collname, *release, *path;
+	size_t i, first;
 	int error;
 
 	rd = up->rd;
+	zopts.threaded = up->config->zthreaded;
+	zopts.backlog = (stream_backlogfn_t *)chan_backlog;
 	STAILQ_FOREACH(coll, &up->config->colls, co_next) {
 		if (coll->co_options & CO_SKIP)
 			continue;
@@ -308,18 +706,37 @@ updater_batch(struct updater *up, int isfixups)
 			lprintf(1, "Updating collection %s/%s\n", coll->co_name,
 			    coll->co_release);
 
-		if (coll->co_options & CO_COMPRESS)
-			stream_filter_start(rd, STREAM_FILTER_ZLIB, NULL);
+		if (coll->co_options & CO_COMPRESS) {
+			zopts.level = coll->co_zlevel;
+			stream_filter_start(rd, STREAM_FILTER_ZLIB, &zopts);
+		}
 
 		st = status_open(coll, coll->co_scantime, &errmsg);
 		if (st == NULL) {
 			up->errmsg = errmsg;
 			return (UPDATER_ERR_MSG);
 		}
-		fup_init(&fup, coll, st);
-		error = updater_docoll(up, &fup, isfixups);
+		first = pattlist_size(up->syncdirs);
+		up->dircache = dircache_new();
+		error = updater_docoll(up, coll, st, isfixups);
+		dircache_free(up->dircache);
+		up->dircache = NULL;
+		/*
+		 * The updated files have been synced by the workers, now
+		 * make their directory entries durable too, so that the
+		 * status file never gets ahead of the tree.  A directory
+		 * that has been removed since is recorded as well, through
+		 * its parent.
+		 */
+		for (i = first; i < pattlist_size(up->syncdirs); i++) {
+			path = pattlist_get(up->syncdirs, i);
+			if (!error && syncdir(path) == -1 && errno != ENOENT) {
+				xasprintf(&up->errmsg, "Cannot sync directory "
+				    "of \"%s\": %s", path, strerror(errno));
+				error = UPDATER_ERR_MSG;
+			}
+		}
 		status_close(st, &errmsg);
-		fup_reset(&fup);
 		if (errmsg != NULL) {
 			/* Discard previous error. */
 			if (up->errmsg != NULL)
@@ -342,489 +759,509 @@ updater_batch(struct updater *up, int isfixups)
 }
 
 static int
-updater_docoll(struct updater *up, struct file_update *fup, int isfixups)
+updater_docoll(struct updater *up, struct coll *coll, struct status *st,
+    int isfixups)
 {
 	struct stream *rd;
-	struct coll *coll;
-	struct statusrec srbuf, *sr;
-	struct fattr *rcsattr, *tmp;
-	char *attr, *blocksize, *line, *msg;
-	char *name, *tag, *date, *revdate;
-	char *expand, *wantmd5, *revnum;
-	char *rcsopt, *pos;
-	time_t t;
-	off_t position;
-	int attic, cmd, error, needfixupmsg;
+	struct file_update *fup;
+	char *line;
+	int cmd, error, error2, needfixupmsg;
 
 	cmd = -1;
 	error = 0;
 	rd = up->rd;
-	coll = fup->coll;
 	needfixupmsg = isfixups;
+	/* Collections may share directories that were removed since. */
+	updater_forgetdirs(up);
 	while ((line = stream_getln(rd, NULL)) != NULL) {
 		cmd = proto_get_char(&line);
 		if (cmd == '.' && line == NULL)
 			break;
-		memset(&srbuf, 0, sizeof(srbuf));
 		if (needfixupmsg) {
 			lprintf(1, "Applying fixups for collection %s/%s\n",
 			    coll->co_name, coll->co_release);
 			needfixupmsg = 0;
 		}
-		switch (cmd) {
-		case 'T':
-			/* Update recorded information for checked-out file. */
-			name = proto_get_ascii(&line);
-			tag = proto_get_ascii(&line);
-			date = proto_get_ascii(&line);
-			revnum = proto_get_ascii(&line);
-			revdate = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
+		fup = fup_new(coll, st);
+		error = updater_docmd(up, fup, cmd, line);
+		if (error) {
+			fup_free(fup);
+			break;
+		}
+		error = updater_submit(up, fup);
+		if (error)
+			break;
+	}
+	/* An earlier update that failed takes precedence. */
+	error2 = updater_drain(up);
+	if (error2)
+		return (error2);
+	if (error)
+		return (error);
+	if (line == NULL && cmd != '.')
+		return (UPDATER_ERR_READ);
+	return (0);
+}
 
-			rcsattr = fattr_decode(attr);
-			if (rcsattr == NULL)
-				return (UPDATER_ERR_PROTO);
+/*
+ * Handle one command from the server.  Everything that depends on the
+ * data sent by the server is done here, the rest is left to the worker
+ * pool through "fup".
+ */
+static int
+updater_docmd(struct updater *up, struct file_update *fup, int cmd,
+    char *line)
+{
+	struct coll *coll;
+	struct statusrec *sr;
+	struct fattr *rcsattr, *tmp;
+	char *attr, *msg;
+	char *name, *tag, *date, *revdate;
+	char *expand, *wantmd5, *revnum;
+	char *rcsopt, *pos;
+	time_t t;
+	off_t position;
+	size_t blocksize;
+	int attic, error;
 
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			error = updater_setattrs(up, fup, name, tag, date,
-			    revnum, revdate, rcsattr);
+	coll = fup->coll;
+	switch (cmd) {
+	case 'T':
+		/* Update recorded information for checked-out file. */
+		name = proto_get_ascii(&line);
+		tag = proto_get_ascii(&line);
+		date = proto_get_ascii(&line);
+		revnum = proto_get_ascii(&line);
+		revdate = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+
+		rcsattr = fattr_decode(attr);
+		if (rcsattr == NULL)
+			return (UPDATER_ERR_PROTO);
+
+		error = fup_prepare(fup, name, 0);
+		if (error) {
 			fattr_free(rcsattr);
-			if (error)
-				return (error);
-			break;
-		case 'c':
-			/* Checkout dead file. */
-			name = proto_get_ascii(&line);
-			tag = proto_get_ascii(&line);
-			date = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
+			return (UPDATER_ERR_PROTO);
+		}
+		sr = &fup->srbuf;
+		sr->sr_type = SR_CHECKOUTLIVE;
+		sr->sr_file = xstrdup(name);
+		sr->sr_tag = xstrdup(tag);
+		sr->sr_date = xstrdup(date);
+		sr->sr_revnum = xstrdup(revnum);
+		sr->sr_revdate = xstrdup(revdate);
+		sr->sr_serverattr = rcsattr;
+		fup->work = updater_setattrs;
+		break;
+	case 'c':
+		/* Checkout dead file. */
+		name = proto_get_ascii(&line);
+		tag = proto_get_ascii(&line);
+		date = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
 
-			error = fup_prepare(fup, name, 0);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		/* Theoritically, the file does not exist on the client.
+		   Just to make sure, we'll delete it here, if it
+		   exists. */
+		if (access(fup->destpath, F_OK) == 0) {
+			error = updater_delete(up, fup);
 			if (error)
-				return (UPDATER_ERR_PROTO);
-			/* Theoritically, the file does not exist on the client.
-			   Just to make sure, we'll delete it here, if it
-			   exists. */
-			if (access(fup->destpath, F_OK) == 0) {
-				error = updater_delete(up, fup);
-				if (error)
-					return (error);
-			}
-
-			sr = &srbuf;
-			sr->sr_type = SR_CHECKOUTDEAD;
-			sr->sr_file = name;
-			sr->sr_tag = tag;
-			sr->sr_date = date;
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
+				return (error);
+		}
 
-			error = status_put(fup->st, sr);
-			fattr_free(sr->sr_serverattr);
-			if (error) {
-				up->errmsg = status_errmsg(fup->st);
-				return (UPDATER_ERR_MSG);
-			}
-			break;
-		case 'U':
-			/* Update live checked-out file. */
-			name = proto_get_ascii(&line);
-			tag = proto_get_ascii(&line);
-			date = proto_get_ascii(&line);
-			proto_get_ascii(&line);	/* XXX - oldRevNum */
-			proto_get_ascii(&line);	/* XXX - fromAttic */
-			proto_get_ascii(&line);	/* XXX - logLines */
-			expand = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			wantmd5 = proto_get_ascii(&line);
-			if (wantmd5 == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
+		sr = &fup->srbuf;
+		sr->sr_type = SR_CHECKOUTDEAD;
+		sr->sr_file = xstrdup(name);
+		sr->sr_tag = xstrdup(tag);
+		sr->sr_date = xstrdup(date);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
+		fup->status = FUP_STATUS_PUT;
+		break;
+	case 'U':
+		/* Update live checked-out file. */
+		name = proto_get_ascii(&line);
+		tag = proto_get_ascii(&line);
+		date = proto_get_ascii(&line);
+		proto_get_ascii(&line);	/* XXX - oldRevNum */
+		proto_get_ascii(&line);	/* XXX - fromAttic */
+		proto_get_ascii(&line);	/* XXX - logLines */
+		expand = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		wantmd5 = proto_get_ascii(&line);
+		if (wantmd5 == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
 
-			sr = &fup->srbuf;
-			sr->sr_type = SR_CHECKOUTLIVE;
-			sr->sr_file = xstrdup(name);
-			sr->sr_date = xstrdup(date);
-			sr->sr_tag = xstrdup(tag);
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
+		sr = &fup->srbuf;
+		sr->sr_type = SR_CHECKOUTLIVE;
+		sr->sr_file = xstrdup(name);
+		sr->sr_date = xstrdup(date);
+		sr->sr_tag = xstrdup(tag);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
 
-			fup->expand = keyword_decode_expand(expand);
-			if (fup->expand == -1)
-				return (UPDATER_ERR_PROTO);
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
+		fup->expand = keyword_decode_expand(expand);
+		if (fup->expand == -1)
+			return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
 
-			fup->wantmd5 = xstrdup(wantmd5);
-			fup->temppath = tempname(fup->destpath);
-			error = updater_diff(up, fup);
-			if (error)
-				return (error);
-			break;
-		case 'u':
-			/* Update dead checked-out file. */
-			name = proto_get_ascii(&line);
-			tag = proto_get_ascii(&line);
-			date = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
+		fup->wantmd5 = xstrdup(wantmd5);
+		fup->temppath = tempname(fup->destpath);
+		error = updater_diff(up, fup);
+		if (error)
+			return (error);
+		break;
+	case 'u':
+		/* Update dead checked-out file. */
+		name = proto_get_ascii(&line);
+		tag = proto_get_ascii(&line);
+		date = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
 
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			error = updater_delete(up, fup);
-			if (error)
-				return (error);
-			sr = &srbuf;
-			sr->sr_type = SR_CHECKOUTDEAD;
-			sr->sr_file = name;
-			sr->sr_tag = tag;
-			sr->sr_date = date;
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
-			error = status_put(fup->st, sr);
-			fattr_free(sr->sr_serverattr);
-			if (error) {
-				up->errmsg = status_errmsg(fup->st);
-				return (UPDATER_ERR_MSG);
-			}
-			break;
-		case 'C':	/* Checkout file. */
-		case 'Y':	/* Receive checkout-mode fixup. */
-			name = proto_get_ascii(&line);
-			tag = proto_get_ascii(&line);
-			date = proto_get_ascii(&line);
-			revnum = proto_get_ascii(&line);
-			revdate = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		error = updater_delete(up, fup);
+		if (error)
+			return (error);
+		sr = &fup->srbuf;
+		sr->sr_type = SR_CHECKOUTDEAD;
+		sr->sr_file = xstrdup(name);
+		sr->sr_tag = xstrdup(tag);
+		sr->sr_date = xstrdup(date);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
+		fup->status = FUP_STATUS_PUT;
+		break;
+	case 'C':	/* Checkout file. */
+	case 'Y':	/* Receive checkout-mode fixup. */
+		name = proto_get_ascii(&line);
+		tag = proto_get_ascii(&line);
+		date = proto_get_ascii(&line);
+		revnum = proto_get_ascii(&line);
+		revdate = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
 
-			sr = &fup->srbuf;
-			sr->sr_type = SR_CHECKOUTLIVE;
-			sr->sr_file = xstrdup(name);
-			sr->sr_tag = xstrdup(tag);
-			sr->sr_date = xstrdup(date);
-			sr->sr_revnum = xstrdup(revnum);
-			sr->sr_revdate = xstrdup(revdate);
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
+		sr = &fup->srbuf;
+		sr->sr_type = SR_CHECKOUTLIVE;
+		sr->sr_file = xstrdup(name);
+		sr->sr_tag = xstrdup(tag);
+		sr->sr_date = xstrdup(date);
+		sr->sr_revnum = xstrdup(revnum);
+		sr->sr_revdate = xstrdup(revdate);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
 
-			t = rcsdatetotime(revdate);
-			if (t == -1)
-				return (UPDATER_ERR_PROTO);
+		t = rcsdatetotime(revdate);
+		if (t == -1)
+			return (UPDATER_ERR_PROTO);
 
-			sr->sr_clientattr = fattr_new(FT_FILE, t);
-			tmp = fattr_forcheckout(sr->sr_serverattr,
-			    coll->co_umask);
-			fattr_override(sr->sr_clientattr, tmp, FA_MASK);
-			fattr_free(tmp);
-			fattr_mergedefault(sr->sr_clientattr);
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			fup->temppath = tempname(fup->destpath);
-			fup->isfixup = cmd == 'Y';
-			error = updater_checkout(up, fup);
-			if (error)
-				return (error);
-			break;
-		case 'D':
-			/* Delete file. */
-			name = proto_get_ascii(&line);
-			if (name == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			error = updater_delete(up, fup);
-			if (error)
-				return (error);
-			error = status_delete(fup->st, name, 0);
-			if (error) {
-				up->errmsg = status_errmsg(fup->st);
-				return (UPDATER_ERR_MSG);
-			}
-			break;
-		case 'A':
-		case 'a':
-		case 'R':
-			/* Add/replace regular file. */
-			name = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			attic = cmd == 'a';
-			error = fup_prepare(fup, name, attic);
-			if (error)
-				return (UPDATER_ERR_PROTO);
+		sr->sr_clientattr = fattr_new(FT_FILE, t);
+		tmp = fattr_forcheckout(sr->sr_serverattr,
+		    coll->co_umask);
+		fattr_override(sr->sr_clientattr, tmp, FA_MASK);
+		fattr_free(tmp);
+		fattr_mergedefault(sr->sr_clientattr);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		fup->temppath = tempname(fup->destpath);
+		fup->isfixup = cmd == 'Y';
+		error = updater_checkout(up, fup);
+		if (error)
+			return (error);
+		break;
+	case 'D':
+		/* Delete file. */
+		name = proto_get_ascii(&line);
+		if (name == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		error = updater_delete(up, fup);
+		if (error)
+			return (error);
+		fup->srbuf.sr_file = xstrdup(name);
+		fup->status = FUP_STATUS_DELETE;
+		break;
+	case 'A':
+	case 'a':
+	case 'R':
+		/* Add/replace regular file. */
+		name = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		attic = cmd == 'a';
+		error = fup_prepare(fup, name, attic);
+		if (error)
+			return (UPDATER_ERR_PROTO);
 
-			fup->temppath = tempname(fup->destpath);
-			sr = &fup->srbuf;
-			sr->sr_type = attic ? SR_FILEDEAD : SR_FILELIVE;
-			sr->sr_file = xstrdup(name);
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
-			if (attic)
-				lprintf(1, " Create %s -> Attic\n", name);
-			else
-				lprintf(1, " Create %s\n", name);
-			error = updater_addfile(up, fup);
-			if (error)
-				return (error);
-			break;
-		case 'r':
-			/* Update regular file with rsync algorithm. */
-			name = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			blocksize = proto_get_ascii(&line);
-			wantmd5 = proto_get_ascii(&line);
-			if (wantmd5 == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			fup->wantmd5 = xstrdup(wantmd5);
-			fup->temppath = tempname(fup->destpath);
-			sr = &fup->srbuf;
-			sr->sr_file = xstrdup(name);
-			sr->sr_serverattr = fattr_decode(attr);
-			sr->sr_type = SR_FILELIVE;
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
-			error = updater_rsync(up, fup, strtol(blocksize, NULL,
-			    10));
-			if (error)
-				return (error);
-			break;
-		case 'I':
-			/* Create directory and add DirDown entry in status
-			   file. */
-			name = proto_get_ascii(&line);
-			if (name == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			sr = &fup->srbuf;
-			sr->sr_type = SR_DIRDOWN;
-			sr->sr_file = xstrdup(name);
-			sr->sr_serverattr = NULL;
-			sr->sr_clientattr = fattr_new(FT_DIRECTORY, -1);
-			fattr_mergedefault(sr->sr_clientattr);
-
-			error = mkdirhier(fup->destpath, coll->co_umask);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			if (access(fup->destpath, F_OK) != 0) {
-				lprintf(1, " Mkdir %s\n", name);
-				error = fattr_makenode(sr->sr_clientattr,
-				    fup->destpath);
-				if (error)
-					return (UPDATER_ERR_PROTO);
-			}
-			error = status_put(fup->st, sr);
-			if (error) {
-				up->errmsg = status_errmsg(fup->st);
-				return (UPDATER_ERR_MSG);
-			}
-			break;
-		case 'i':
-			/* Remove DirDown entry in status file. */
-			name = proto_get_ascii(&line);
-			if (name == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			error = status_delete(fup->st, name, 0);
-			if (error) {
-				up->errmsg = status_errmsg(fup->st);
-				return (UPDATER_ERR_MSG);
-			}
-			break;
-		case 'J':
-			/* Set attributes of directory and update DirUp entry
-			   in status file. */
-			name = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			error = fup_prepare(fup, name, 0);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			error = updater_setdirattrs(up, coll, fup, name, attr);
-			if (error)
-				return (error);
-			break;
-		case 'j':
-			/* Remove directory and delete its DirUp entry in
-			   status file. */
-			name = proto_get_ascii(&line);
-			if (name == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			error = fup_prepare(fup, name, 0);
+		fup->temppath = tempname(fup->destpath);
+		sr = &fup->srbuf;
+		sr->sr_type = attic ? SR_FILEDEAD : SR_FILELIVE;
+		sr->sr_file = xstrdup(name);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
+		if (attic)
+			lprintf(1, " Create %s -> Attic\n", name);
+		else
+			lprintf(1, " Create %s\n", name);
+		error = updater_addfile(up, fup);
+		if (error)
+			return (error);
+		break;
+	case 'r':
+		/* Update regular file with rsync algorithm. */
+		name = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (proto_get_sizet(&line, &blocksize, 10) != 0 ||
+		    blocksize == 0)
+			return (UPDATER_ERR_PROTO);
+		wantmd5 = proto_get_ascii(&line);
+		if (wantmd5 == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		fup->wantmd5 = xstrdup(wantmd5);
+		fup->temppath = tempname(fup->destpath);
+		sr = &fup->srbuf;
+		sr->sr_file = xstrdup(name);
+		sr->sr_serverattr = fattr_decode(attr);
+		sr->sr_type = SR_FILELIVE;
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
+		error = updater_rsync(up, fup, blocksize);
+		if (error)
+			return (error);
+		break;
+	case 'I':
+		/* Create directory and add DirDown entry in status
+		   file. */
+		name = proto_get_ascii(&line);
+		if (name == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		sr = &fup->srbuf;
+		sr->sr_type = SR_DIRDOWN;
+		sr->sr_file = xstrdup(name);
+		sr->sr_serverattr = NULL;
+		sr->sr_clientattr = fattr_new(FT_DIRECTORY, -1);
+		fattr_mergedefault(sr->sr_clientattr);
+
+		error = updater_mkdirhier(up, fup->destpath, coll->co_umask);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		if (access(fup->destpath, F_OK) != 0) {
+			lprintf(1, " Mkdir %s\n", name);
+			error = fattr_makenode(sr->sr_clientattr,
+			    fup->destpath);
 			if (error)
 				return (UPDATER_ERR_PROTO);
-			lprintf(1, " Rmdir %s\n", name);
-			updater_deletefile(fup->destpath);
-			error = status_delete(fup->st, name, 0);
-			if (error) {
-				up->errmsg = status_errmsg(fup->st);
-				return (UPDATER_ERR_MSG);
-			}
-			break;
-		case 'L':
-		case 'l':
-			/* Update recorded information for cvs file. */
-			name = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			attic = cmd == 'l';
-			sr = &fup->srbuf;
-			sr->sr_type = attic ? SR_FILEDEAD : SR_FILELIVE;
-			sr->sr_file = xstrdup(name);
-			sr->sr_serverattr = fattr_decode(attr);
-			sr->sr_clientattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL ||
-			    sr->sr_clientattr == NULL)
-				return (UPDATER_ERR_PROTO);
+		}
+		fup->status = FUP_STATUS_PUT;
+		break;
+	case 'i':
+		/* Remove DirDown entry in status file. */
+		name = proto_get_ascii(&line);
+		if (name == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		fup->srbuf.sr_file = xstrdup(name);
+		fup->status = FUP_STATUS_DELETE;
+		break;
+	case 'J':
+		/* Set attributes of directory and update DirUp entry
+		   in status file. */
+		name = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		sr = &fup->srbuf;
+		sr->sr_type = SR_DIRUP;
+		sr->sr_file = xstrdup(name);
+		sr->sr_clientattr = fattr_decode(attr);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_clientattr == NULL || sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
+		/* The files in the directory must have been installed. */
+		fup->work = updater_setdirattrs;
+		fup->ordered = 1;
+		break;
+	case 'j':
+		/* Remove directory and delete its DirUp entry in
+		   status file. */
+		name = proto_get_ascii(&line);
+		if (name == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		fup->srbuf.sr_file = xstrdup(name);
+		/* The files in the directory must have been deleted. */
+		fup->work = updater_rmdir;
+		fup->ordered = 1;
+		updater_forgetdirs(up);
+		break;
+	case 'L':
+	case 'l':
+		/* Update recorded information for cvs file. */
+		name = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		attic = cmd == 'l';
+		sr = &fup->srbuf;
+		sr->sr_type = attic ? SR_FILEDEAD : SR_FILELIVE;
+		sr->sr_file = xstrdup(name);
+		sr->sr_serverattr = fattr_decode(attr);
+		sr->sr_clientattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL ||
+		    sr->sr_clientattr == NULL)
+			return (UPDATER_ERR_PROTO);
 
-			/* Save space. Described in detail in updatefile. */
-			if (!(fattr_getmask(sr->sr_clientattr) & FA_LINKCOUNT)
-			    || fattr_getlinkcount(sr->sr_clientattr) <= 1)
-				fattr_maskout(sr->sr_clientattr,
-				    FA_DEV | FA_INODE);
-			fattr_maskout(sr->sr_clientattr, FA_FLAGS);
-			error = status_put(fup->st, sr);
-			if (error) {
-				up->errmsg = status_errmsg(fup->st);
-				return (UPDATER_ERR_MSG);
-			}
-			break;
-		case 'N':
-		case 'n':
-			/* Create a node. */
-			name = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			attic = cmd == 'n';
-			error = fup_prepare(fup, name, attic);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			sr = &fup->srbuf;
-			sr->sr_type = (attic ? SR_FILEDEAD : SR_FILELIVE);
-			sr->sr_file = xstrdup(name);
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
-			sr->sr_clientattr = fattr_new(FT_SYMLINK, -1);
-			fattr_mergedefault(sr->sr_clientattr);
-			fattr_maskout(sr->sr_clientattr, FA_FLAGS);
-			error = updater_updatenode(up, coll, fup, name);
-			if (error)
-				return (error);
-			break;
-		case 'V':
-		case 'v':
-			/* Edit RCS file. */
-			name = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			rcsopt = proto_get_ascii(&line);
-			wantmd5 = proto_get_ascii(&line);
-			if (wantmd5 == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			attic = cmd == 'v';
-			error = fup_prepare(fup, name, attic);
-			if (error)
-				return (UPDATER_ERR_PROTO);
-			fup->temppath = tempname(fup->destpath);
-			fup->wantmd5 = xstrdup(wantmd5);
-			sr = &fup->srbuf;
-			sr->sr_type = attic ? SR_FILEDEAD : SR_FILELIVE;
-			sr->sr_file = xstrdup(name);
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
+		/* Save space. Described in detail in updatefile. */
+		if (!(fattr_getmask(sr->sr_clientattr) & FA_LINKCOUNT)
+		    || fattr_getlinkcount(sr->sr_clientattr) <= 1)
+			fattr_maskout(sr->sr_clientattr,
+			    FA_DEV | FA_INODE);
+		fattr_maskout(sr->sr_clientattr, FA_FLAGS);
+		fup->status = FUP_STATUS_PUT;
+		break;
+	case 'N':
+	case 'n':
+		/* Create a node. */
+		name = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		attic = cmd == 'n';
+		error = fup_prepare(fup, name, attic);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		sr = &fup->srbuf;
+		sr->sr_type = (attic ? SR_FILEDEAD : SR_FILELIVE);
+		sr->sr_file = xstrdup(name);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
+		sr->sr_clientattr = fattr_new(FT_SYMLINK, -1);
+		fattr_mergedefault(sr->sr_clientattr);
+		fattr_maskout(sr->sr_clientattr, FA_FLAGS);
+		error = updater_updatenode(up, coll, fup, name);
+		if (error)
+			return (error);
+		break;
+	case 'V':
+	case 'v':
+		/* Edit RCS file. */
+		name = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		rcsopt = proto_get_ascii(&line);
+		wantmd5 = proto_get_ascii(&line);
+		if (wantmd5 == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		attic = cmd == 'v';
+		error = fup_prepare(fup, name, attic);
+		if (error)
+			return (UPDATER_ERR_PROTO);
+		fup->temppath = tempname(fup->destpath);
+		fup->wantmd5 = xstrdup(wantmd5);
+		sr = &fup->srbuf;
+		sr->sr_type = attic ? SR_FILEDEAD : SR_FILELIVE;
+		sr->sr_file = xstrdup(name);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
 
-			error = updater_rcsedit(up, fup, name, rcsopt);
-			if (error)
-				return (error);
-			break;
-		case 'X':
-		case 'x':
-			/* Receive RCS file fixup. */
-			name = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			if (attr == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			attic = cmd == 'x';
-			error = fup_prepare(fup, name, attic);
-			if (error)
-				return (UPDATER_ERR_PROTO);
+		error = updater_rcsedit(up, fup, name, rcsopt);
+		if (error)
+			return (error);
+		break;
+	case 'X':
+	case 'x':
+		/* Receive RCS file fixup. */
+		name = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		if (attr == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		attic = cmd == 'x';
+		error = fup_prepare(fup, name, attic);
+		if (error)
+			return (UPDATER_ERR_PROTO);
 
-			fup->temppath = tempname(fup->destpath);
-			fup->isfixup = 1;
-			sr = &fup->srbuf;
-			sr->sr_type = attic ? SR_FILEDEAD : SR_FILELIVE;
-			sr->sr_file = xstrdup(name);
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
-			lprintf(1, " Fixup %s\n", name);
-			error = updater_addfile(up, fup);
-			if (error)
-				return (error);
-			break;
-		case 'Z':
-			/* Append to regular file. */
-			name = proto_get_ascii(&line);
-			attr = proto_get_ascii(&line);
-			pos  = proto_get_ascii(&line);
-			if (pos == NULL || line != NULL)
-				return (UPDATER_ERR_PROTO);
-			error = fup_prepare(fup, name, 0);
-			fup->temppath = tempname(fup->destpath);
-			sr = &fup->srbuf;
-			sr->sr_type = SR_FILELIVE;
-			sr->sr_file = xstrdup(name);
-			sr->sr_serverattr = fattr_decode(attr);
-			if (sr->sr_serverattr == NULL)
-				return (UPDATER_ERR_PROTO);
-			position = strtol(pos, NULL, 10);
-			lprintf(1, " Append to %s\n", name);
-			error = updater_append_file(up, fup, position);
-			if (error)
-				return (error);
-			break;
-		case '!':
-			/* Warning from server. */
-			msg = proto_get_rest(&line);
-			if (msg == NULL)
-				return (UPDATER_ERR_PROTO);
-			lprintf(-1, "Server warning: %s\n", msg);
-			break;
-		default:
+		fup->temppath = tempname(fup->destpath);
+		fup->isfixup = 1;
+		sr = &fup->srbuf;
+		sr->sr_type = attic ? SR_FILEDEAD : SR_FILELIVE;
+		sr->sr_file = xstrdup(name);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
 			return (UPDATER_ERR_PROTO);
-		}
-		fup_reset(fup);
+		lprintf(1, " Fixup %s\n", name);
+		error = updater_addfile(up, fup);
+		if (error)
+			return (error);
+		break;
+	case 'Z':
+		/* Append to regular file. */
+		name = proto_get_ascii(&line);
+		attr = proto_get_ascii(&line);
+		pos  = proto_get_ascii(&line);
+		if (pos == NULL || line != NULL)
+			return (UPDATER_ERR_PROTO);
+		error = fup_prepare(fup, name, 0);
+		fup->temppath = tempname(fup->destpath);
+		sr = &fup->srbuf;
+		sr->sr_type = SR_FILELIVE;
+		sr->sr_file = xstrdup(name);
+		sr->sr_serverattr = fattr_decode(attr);
+		if (sr->sr_serverattr == NULL)
+			return (UPDATER_ERR_PROTO);
+		position = strtol(pos, NULL, 10);
+		lprintf(1, " Append to %s\n", name);
+		error = updater_append_file(up, fup, position);
+		if (error)
+			return (error);
+		break;
+	case '!':
+		/* Warning from server. */
+		msg = proto_get_rest(&line);
+		if (msg == NULL)
+			return (UPDATER_ERR_PROTO);
+		lprintf(-1, "Server warning: %s\n", msg);
+		break;
+	default:
+		return (UPDATER_ERR_PROTO);
 	}
-	if (line == NULL && cmd != '.')
-		return (UPDATER_ERR_READ);
 	return (0);
 }
 
@@ -834,6 +1271,7 @@ updater_delete(struct updater *up, struct file_update *fup)
 {
 	struct config *config;
 	struct coll *coll;
+	int error;
 
 	config = up->config;
 	coll = fup->coll;
@@ -843,16 +1281,29 @@ updater_delete(struct updater *up, struct file_update *fup)
 		    up->deletecount >= config->deletelim)
 			return (UPDATER_ERR_DELETELIM);
 		up->deletecount++;
+		if (coll->co_options & CO_CHECKOUTMODE) {
+			/*
+			 * The pending updates may still have to link an
+			 * anonymous file into a directory that looks empty
+			 * to updater_prunedirs(), so let them finish first.
+			 */
+			error = updater_drain(up);
+			if (error)
+				return (error);
+		}
 		updater_deletefile(fup->destpath);
-		if (coll->co_options & CO_CHECKOUTMODE)
+		if (coll->co_options & CO_CHECKOUTMODE) {
 			updater_prunedirs(coll->co_prefix, fup->destpath);
+			updater_forgetdirs(up);
+		}
 	} else {
 		lprintf(1," NoDelete %s\n", fup->coname);
 	}
 	return (0);
 }
 
-static void
+/* Returns 0 if the file was there and has been deleted. */
+static int
 updater_deletefile(const char *path)
 {
 	int error;
@@ -862,34 +1313,120 @@ updater_deletefile(const char *path)
 		lprintf(-1, "Cannot delete \"%s\": %s\n",
 		    path, strerror(errno));
 	}
+	return (error);
+}
+
+/*
+ * Create the temporary file for the new version of fup->destpath.  When
+ * we can, this is an anonymous file in the same directory, which is only
+ * linked into place by fattr_installfd() once complete, so a crash doesn't
+ * leave it behind.  It is kept open in fup->tempfd until then.  Otherwise,
+ * we use fup->temppath.
+ */
+static struct stream *
+updater_opentemp(struct updater *up, struct file_update *fup, int flags,
+    mode_t mode)
+{
+	struct stream *to;
+	const char *name;
+	int dirfd;
+
+#ifdef O_TMPFILE
+	assert(fup->tempfd == -1);
+	if (up->tmpfile) {
+		to = updater_opentmpfile(up, fup->destpath, flags, mode);
+		if (to != NULL) {
+			fup->tempfd = dup(stream_fileno(to));
+			if (fup->tempfd != -1)
+				return (to);
+			stream_close(to);
+		}
+		/* The file system may not support it, try the old way. */
+	}
+#endif
+	dirfd = updater_lookup(up, fup->temppath, &name);
+	to = stream_open_fileat(dirfd, name, flags | O_CREAT | O_TRUNC, mode);
+	if (to == NULL && updater_stale(up)) {
+		dirfd = updater_lookup(up, fup->temppath, &name);
+		to = stream_open_fileat(dirfd, name, flags | O_CREAT | O_TRUNC,
+		    mode);
+	}
+	return (to);
+}
+
+#ifdef O_TMPFILE
+/* Create an anonymous file in the directory of "path". */
+static struct stream *
+updater_opentmpfile(struct updater *up, const char *path, int flags,
+    mode_t mode)
+{
+	struct stream *to;
+	const char *name;
+	char *dir;
+	int dirfd;
+
+	dirfd = updater_lookup(up, path, &name);
+	if (dirfd != AT_FDCWD) {
+		to = stream_open_fileat(dirfd, ".", flags | O_TMPFILE, mode);
+		if (to != NULL || !updater_stale(up))
+			return (to);
+		dirfd = updater_lookup(up, path, &name);
+		if (dirfd != AT_FDCWD)
+			return (stream_open_fileat(dirfd, ".",
+			    flags | O_TMPFILE, mode));
+	}
+	/* No cache, or the directory can't be opened. */
+	dir = xstrdup(path);
+	dir[pathlast(dir) - dir] = '\0';
+	to = stream_open_file(dir, flags | O_TMPFILE, mode);
+	free(dir);
+	return (to);
 }
+#endif
 
+/* Get rid of the temporary file of an update that won't be installed. */
+static void
+updater_droptemp(struct file_update *fup)
+{
+
+	if (fup->tempfd == -1) {
+		updater_deletefile(fup->temppath);
+		return;
+	}
+	/* The hasher may not have opened the file yet. */
+	if (fup->hashjob != NULL) {
+		(void)hashjob_wait(fup->hashjob, fup->md5, NULL, NULL);
+		fup->hashjob = NULL;
+	}
+	close(fup->tempfd);
+	fup->tempfd = -1;
+}
+
+/*
+ * Set the attributes of a checked-out file which hasn't changed, and
+ * record them, or remove its entry from the status file if it has
+ * vanished.
+ */
 static int
-updater_setattrs(struct updater *up, struct file_update *fup, char *name,
-    char *tag, char *date, char *revnum, char *revdate, struct fattr *rcsattr)
+updater_setattrs(struct updater *up, struct file_update *fup)
 {
-	struct statusrec sr;
-	struct status *st;
+	struct statusrec *sr;
 	struct coll *coll;
 	struct fattr *fileattr, *fa;
 	char *path;
-	int error, rv;
+	int rv;
 
 	coll = fup->coll;
-	st = fup->st;
+	sr = &fup->srbuf;
 	path = fup->destpath;
 
-	fileattr = fattr_frompath(path, FATTR_NOFOLLOW);
+	fileattr = updater_getattr(up, path, FATTR_NOFOLLOW);
 	if (fileattr == NULL) {
 		/* The file has vanished. */
-		error = status_delete(st, name, 0);
-		if (error) {
-			up->errmsg = status_errmsg(st);
-			return (UPDATER_ERR_MSG);
-		}
+		fup->status = FUP_STATUS_DELETE;
 		return (0);
 	}
-	fa = fattr_forcheckout(rcsattr, coll->co_umask);
+	fa = fattr_forcheckout(sr->sr_serverattr, coll->co_umask);
 	fattr_override(fileattr, fa, FA_MASK);
 	fattr_free(fa);
 
@@ -904,84 +1441,120 @@ updater_setattrs(struct updater *up, struct file_update *fup, char *name,
 	if (rv == 1) {
 		lprintf(1, " SetAttrs %s\n", fup->coname);
 		fattr_free(fileattr);
-		fileattr = fattr_frompath(path, FATTR_NOFOLLOW);
+		fileattr = updater_getattr(up, path, FATTR_NOFOLLOW);
 		if (fileattr == NULL) {
 			/* We're being very unlucky. */
-			error = status_delete(st, name, 0);
-			if (error) {
-				up->errmsg = status_errmsg(st);
-				return (UPDATER_ERR_MSG);
-			}
+			fup->status = FUP_STATUS_DELETE;
 			return (0);
 		}
 	}
 
 	fattr_maskout(fileattr, FA_COIGNORE);
-
-	sr.sr_type = SR_CHECKOUTLIVE;
-	sr.sr_file = name;
-	sr.sr_tag = tag;
-	sr.sr_date = date;
-	sr.sr_revnum = revnum;
-	sr.sr_revdate = revdate;
-	sr.sr_clientattr = fileattr;
-	sr.sr_serverattr = rcsattr;
-
-	error = status_put(st, &sr);
-	fattr_free(fileattr);
-	if (error) {
-		up->errmsg = status_errmsg(st);
-		return (UPDATER_ERR_MSG);
-	}
+	sr->sr_clientattr = fileattr;
+	fup->status = FUP_STATUS_PUT;
 	return (0);
 }
 
 static void
-updater_needfixup(struct updater *up, struct file_update *fup, const char *msg)
+updater_needfixup(struct file_update *fup, const char *msg)
 {
-	struct statusrec *sr;
 	struct coll *coll;
 
 	coll = fup->coll;
-	sr = &fup->srbuf;
-	lprintf(-1, "%s: %s -- ", fup->coname, msg);
+	/* One line at a time, the workers share the output. */
 	if (fup->isfixup) {
-		lprintf(-1, "file not updated\n");
+		lprintf(-1, "%s: %s -- file not updated\n", fup->coname, msg);
 	} else {
-		lprintf(-1, "will transfer entire file\n");
-		fixups_put(up->config->fixups, fup->coll, sr->sr_file);
+		lprintf(-1, "%s: %s -- will transfer entire file\n",
+		    fup->coname, msg);
+		/* Requested when the update is committed, in order. */
+		fup->fixup = 1;
 	}
-	if (coll->co_options & CO_KEEPBADFILES)
+	/* Files updated in place don't have a temporary file. */
+	if (fup->temppath == NULL)
+		return;
+	if (coll->co_options & CO_KEEPBADFILES &&
+	    (fup->tempfd == -1 || linkfd(fup->tempfd, fup->temppath) == 0))
 		lprintf(-1, "Bad version saved in %s\n", fup->temppath);
 	else
-		updater_deletefile(fup->temppath);
+		updater_droptemp(fup);
 }
 
+/*
+ * Install the new version of a file, once its checksum is in fup->md5,
+ * or is being computed by fup->hashjob.  If it is the checksum of the
+ * whole file, as opposed to the canonical form of an RCS file, the
+ * caller sets fup->iscontent so that we can remember it in the checksum
+ * cache.  This runs in the worker pool.
+ */
 static int
-updater_updatefile(struct updater *up, struct file_update *fup, const char *md5)
+updater_updatefile(struct updater *up, struct file_update *fup)
 {
 	struct coll *coll;
-	struct status *st;
 	struct statusrec *sr;
 	struct fattr *fileattr;
+	struct stat sb;
+	char *path;
 	int error, rv;
 
 	coll = fup->coll;
 	sr = &fup->srbuf;
-	st = fup->st;
 
-	if (strcmp(fup->wantmd5, md5) != 0) {
-		updater_needfixup(up, fup, "Checksum mismatch");
+	if (fup->hashjob != NULL) {
+		path = xstrdup(hashjob_path(fup->hashjob));
+		error = hashjob_wait(fup->hashjob, fup->md5, NULL, NULL);
+		fup->hashjob = NULL;
+		if (error) {
+			xasprintf(&up->errmsg, "%s: Cannot read: %s", path,
+			    strerror(errno));
+			free(path);
+			return (UPDATER_ERR_MSG);
+		}
+		free(path);
+	}
+	if (strcmp(fup->wantmd5, fup->md5) != 0) {
+		updater_needfixup(fup, "Checksum mismatch");
 		return (0);
 	}
 
+	/*
+	 * In batch durability mode, the data is synced here, in parallel
+	 * with the other updates, and the directories once at the end of
+	 * the collection.  We don't need the metadata of the temporary
+	 * file since it is about to be renamed.
+	 */
+	if (coll->co_durability == DURABILITY_BATCH && fup->temppath != NULL) {
+		if (fup->tempfd != -1)
+			error = fdatasync(fup->tempfd);
+		else
+			error = syncfile(fup->temppath, 1);
+		if (error) {
+			xasprintf(&up->errmsg, "%s: Cannot sync: %s",
+			    fup->temppath, strerror(errno));
+			return (UPDATER_ERR_MSG);
+		}
+	}
 	fattr_umask(sr->sr_clientattr, coll->co_umask);
-	rv = fattr_install(sr->sr_clientattr, fup->destpath, fup->temppath);
+	if (fup->tempfd != -1)
+		rv = fattr_installfd(sr->sr_clientattr, fup->destpath,
+		    fup->temppath, fup->tempfd);
+	else
+		rv = fattr_install(sr->sr_clientattr, fup->destpath,
+		    fup->temppath);
+	if (rv == -1 && fup->temppath == NULL) {
+		xasprintf(&up->errmsg, "Cannot set attributes of \"%s\": %s",
+		    fup->destpath, strerror(errno));
+		return (UPDATER_ERR_MSG);
+	}
 	if (rv == -1) {
 		xasprintf(&up->errmsg, "Cannot install \"%s\" to \"%s\": %s",
 		    fup->temppath, fup->destpath, strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
+	if (fup->iscontent && coll->co_hashcache != NULL &&
+	    lstat(fup->destpath, &sb) == 0 && S_ISREG(sb.st_mode))
+		hashcache_putmd5(coll->co_hashcache, fup->destpath, &sb,
+		    fup->md5);
 
 	/* XXX Executes */
 	/*
@@ -994,7 +1567,7 @@ updater_updatefile(struct updater *up, struct file_update *fup, const char *md5)
 	 * server.  This is important for preserving hard links in mirror
 	 * mode.
 	 */
-	fileattr = fattr_frompath(fup->destpath, FATTR_NOFOLLOW);
+	fileattr = updater_getattr(up, fup->destpath, FATTR_NOFOLLOW);
 	if (fileattr == NULL) {
 		xasprintf(&up->errmsg, "Cannot stat \"%s\": %s", fup->destpath,
 		    strerror(errno));
@@ -1016,12 +1589,7 @@ updater_updatefile(struct updater *up, struct file_update *fup, const char *md5)
 
 	if (coll->co_options & CO_CHECKOUTMODE)
 		fattr_maskout(sr->sr_clientattr, FA_COIGNORE);
-
-	error = status_put(st, sr);
-	if (error) {
-		up->errmsg = status_errmsg(st);
-		return (UPDATER_ERR_MSG);
-	}
+	fup->status = FUP_STATUS_PUT;
 	return (0);
 }
 
@@ -1029,24 +1597,17 @@ updater_updatefile(struct updater *up, struct file_update *fup, const char *md5)
  * Update attributes of a directory.
  */
 static int
-updater_setdirattrs(struct updater *up, struct coll *coll,
-    struct file_update *fup, char *name, char *attr)
+updater_setdirattrs(struct updater *up, struct file_update *fup)
 {
 	struct statusrec *sr;
 	struct fattr *fa;
-	int error, rv;
+	int rv;
 
 	sr = &fup->srbuf;
-	sr->sr_type = SR_DIRUP;
-	sr->sr_file = xstrdup(name);
-	sr->sr_clientattr = fattr_decode(attr);
-	sr->sr_serverattr = fattr_decode(attr);
-	if (sr->sr_clientattr == NULL || sr->sr_serverattr == NULL)
-		return (UPDATER_ERR_PROTO);
 	fattr_mergedefault(sr->sr_clientattr);
-	fattr_umask(sr->sr_clientattr, coll->co_umask);
+	fattr_umask(sr->sr_clientattr, fup->coll->co_umask);
 	rv = fattr_install(sr->sr_clientattr, fup->destpath, NULL);
-	lprintf(1, " SetAttrs %s\n", name);
+	lprintf(1, " SetAttrs %s\n", sr->sr_file);
 	if (rv == -1) {
 		xasprintf(&up->errmsg, "Cannot install \"%s\" to \"%s\": %s",
 		    fup->temppath, fup->destpath, strerror(errno));
@@ -1056,7 +1617,7 @@ updater_setdirattrs(struct updater *up, struct coll *coll,
 	 * Now, make sure they were set and record what was set in the status
 	 * file.
 	 */
-	fa = fattr_frompath(fup->destpath, FATTR_NOFOLLOW);
+	fa = updater_getattr(up, fup->destpath, FATTR_NOFOLLOW);
 	if (fa == NULL) {
 		xasprintf(&up->errmsg, "Cannot open \%s\": %s", fup->destpath,
 		    strerror(errno));
@@ -1065,22 +1626,28 @@ updater_setdirattrs(struct updater *up, struct coll *coll,
 	fattr_free(sr->sr_clientattr);
 	fattr_maskout(fa, FA_FLAGS);
 	sr->sr_clientattr = fa;
-	error = status_put(fup->st, sr);
-	if (error) {
-		up->errmsg = status_errmsg(fup->st);
-		return (UPDATER_ERR_MSG);
-	}
+	fup->status = FUP_STATUS_PUT;
+	return (0);
+}
 
+/* Remove a directory, once the files in it have been deleted. */
+static int
+updater_rmdir(struct updater __unused *up, struct file_update *fup)
+{
+
+	lprintf(1, " Rmdir %s\n", fup->srbuf.sr_file);
+	updater_deletefile(fup->destpath);
+	fup->status = FUP_STATUS_DELETE;
 	return (0);
 }
 
 static int
 updater_diff(struct updater *up, struct file_update *fup)
 {
-	char md5[MD5_DIGEST_SIZE];
 	struct coll *coll;
 	struct statusrec *sr;
 	struct fattr *fa, *tmp;
+	struct stream *orig, *to;
 	char *line, *author, *path, *revnum, *revdate;
 	int error, cmd;
 
@@ -1111,29 +1678,24 @@ updater_diff(struct updater *up, struct file_update *fup)
 		sr->sr_revnum = xstrdup(revnum);
 		sr->sr_revdate = xstrdup(revdate);
 		fup->author = xstrdup(author);
-		if (fup->orig == NULL) {
-			/* First patch, the "origin" file is the one we have. */
-			fup->orig = stream_open_file(path, O_RDONLY);
-			if (fup->orig == NULL) {
+		if (fup->text == NULL) {
+			/*
+			 * First patch, read in the file we have.  All the
+			 * deltas are applied to it in memory.
+			 */
+			orig = stream_open_mmap(path);
+			if (orig == NULL) {
 				xasprintf(&up->errmsg, "%s: Cannot open: %s",
 				    path, strerror(errno));
 				return (UPDATER_ERR_MSG);
 			}
-		} else {
-			/* Subsequent patches. */
-			stream_close(fup->orig);
-			fup->orig = fup->to;
-			stream_rewind(fup->orig);
-			unlink(fup->temppath);
-			free(fup->temppath);
-			fup->temppath = tempname(path);
-		}
-		fup->to = stream_open_file(fup->temppath,
-		    O_RDWR | O_CREAT | O_TRUNC, 0600);
-		if (fup->to == NULL) {
-			xasprintf(&up->errmsg, "%s: Cannot open: %s",
-			    fup->temppath, strerror(errno));
-			return (UPDATER_ERR_MSG);
+			fup->text = difftext_new(orig);
+			stream_close(orig);
+			if (fup->text == NULL) {
+				xasprintf(&up->errmsg, "%s: Cannot read: %s",
+				    path, strerror(errno));
+				return (UPDATER_ERR_MSG);
+			}
 		}
 		lprintf(2, "  Add delta %s %s %s\n", sr->sr_revnum,
 		    sr->sr_revdate, fup->author);
@@ -1144,21 +1706,45 @@ updater_diff(struct updater *up, struct file_update *fup)
 	if (line == NULL && cmd != '.')
 		return (UPDATER_ERR_READ);
 
-	fa = fattr_frompath(path, FATTR_FOLLOW);
+	fa = updater_getattr(up, path, FATTR_FOLLOW);
 	tmp = fattr_forcheckout(sr->sr_serverattr, coll->co_umask);
 	fattr_override(fa, tmp, FA_MASK);
 	fattr_free(tmp);
 	fattr_maskout(fa, FA_MODTIME);
 	sr->sr_clientattr = fa;
 
-	if (MD5_File(fup->temppath, md5, NULL) == -1) {
-		xasprintf(&up->errmsg,
-		    "Cannot calculate checksum for \"%s\": %s",
-		    path, strerror(errno));
-		return (UPDATER_ERR_MSG);
+	if (fup->text == NULL) {
+		/* We didn't get any delta. */
+		if (MD5_File(fup->temppath, fup->md5, NULL) == -1) {
+			xasprintf(&up->errmsg,
+			    "Cannot calculate checksum for \"%s\": %s",
+			    path, strerror(errno));
+			return (UPDATER_ERR_MSG);
+		}
+	} else {
+		to = updater_opentemp(up, fup, O_WRONLY, 0600);
+		if (to == NULL) {
+			xasprintf(&up->errmsg, "%s: Cannot open: %s",
+			    fup->temppath, strerror(errno));
+			return (UPDATER_ERR_MSG);
+		}
+		/* Checksum the file as we write it. */
+		stream_filter_start(to, STREAM_FILTER_MD5, fup->md5);
+		if (difftext_write(fup->text, to) != 0 ||
+		    stream_flush(to) != 0) {
+			xasprintf(&up->errmsg, "%s: Cannot write: %s",
+			    fup->temppath, strerror(errno));
+			stream_close(to);
+			return (UPDATER_ERR_MSG);
+		}
+		stream_filter_stop(to);
+		stream_close(to);
+		difftext_free(fup->text);
+		fup->text = NULL;
 	}
-	error = updater_updatefile(up, fup, md5);
-	return (error);
+	fup->iscontent = 1;
+	fup->work = updater_updatefile;
+	return (0);
 }
 
 /*
@@ -1246,7 +1832,7 @@ updater_diff_apply(struct updater *up, struct file_update *fup, char *state)
 	di->di_state = state;
 	di->di_expand = fup->expand;
 
-	error = diff_apply(up->rd, fup->orig, fup->to, coll->co_keyword, di, 1);
+	error = difftext_apply(fup->text, up->rd, coll->co_keyword, di);
 	if (error) {
 		/* XXX Bad error message */
 		xasprintf(&up->errmsg, "Bad diff from server");
@@ -1261,12 +1847,10 @@ updater_updatenode(struct updater *up, struct coll *coll,
     struct file_update *fup, char *name)
 {
 	struct fattr *fileattr;
-	struct status *st;
 	struct statusrec *sr;
 	int error, rv;
 
 	sr = &fup->srbuf;
-	st = fup->st;
 
 	if (fattr_type(sr->sr_serverattr) == FT_SYMLINK) {
 		lprintf(1, " Symlink %s -> %s\n", name,
@@ -1276,7 +1860,7 @@ updater_updatenode(struct updater *up, struct coll *coll,
 	}
 
 	/* Create directory. */
-	error = mkdirhier(fup->destpath, coll->co_umask);
+	error = updater_mkdirhier(up, fup->destpath, coll->co_umask);
 	if (error)
 		return (UPDATER_ERR_PROTO);
 
@@ -1310,7 +1894,7 @@ updater_updatenode(struct updater *up, struct coll *coll,
 	 * server.  This is important for preserving hard links in mirror
 	 * mode.
 	 */
-	fileattr = fattr_frompath(fup->destpath, FATTR_NOFOLLOW);
+	fileattr = updater_getattr(up, fup->destpath, FATTR_NOFOLLOW);
 	if (fileattr == NULL) {
 		xasprintf(&up->errmsg, "Cannot stat \"%s\": %s", fup->destpath,
 		    strerror(errno));
@@ -1336,11 +1920,7 @@ updater_updatenode(struct updater *up, struct coll *coll,
 		    FA_LINKTARGET));
 	}
 	fattr_maskout(sr->sr_clientattr, FA_FLAGS);
-	error = status_put(st, sr);
-	if (error) {
-		up->errmsg = status_errmsg(st);
-		return (UPDATER_ERR_MSG);
-	}
+	fup->status = FUP_STATUS_PUT;
 	return (0);
 }
 
@@ -1353,11 +1933,8 @@ updater_addfile(struct updater *up, struct file_update *fup)
 	struct coll *coll;
 	struct stream *to;
 	struct statusrec *sr;
-	char buf[BUFSIZE];
-	char md5[MD5_DIGEST_SIZE];
-	ssize_t nread;
-	off_t fsize, remains;
-	char *line, *path;
+	off_t fsize, nbytes;
+	char *line, *path, *wantmd5;
 	int cmd, error;
 
 	coll = fup->coll;
@@ -1365,30 +1942,25 @@ updater_addfile(struct updater *up, struct file_update *fup)
 	sr = &fup->srbuf;
 	fsize = fattr_filesize(sr->sr_serverattr);
 
-	error = mkdirhier(path, coll->co_umask);
+	error = updater_mkdirhier(up, path, coll->co_umask);
 	if (error)
 		return (UPDATER_ERR_PROTO);
-	to = stream_open_file(fup->temppath, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	to = updater_opentemp(up, fup, O_WRONLY, 0755);
 	if (to == NULL) {
 		xasprintf(&up->errmsg, "%s: Cannot create: %s",
 		    fup->temppath, strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
-	stream_filter_start(to, STREAM_FILTER_MD5, md5);
-	remains = fsize;
-	do {
-		nread = stream_read(up->rd, buf, (BUFSIZE > remains ?
-		    remains : BUFSIZE));
-		if (nread == -1) {
-			stream_close(to);
-			return (UPDATER_ERR_PROTO);
-		}
-		remains -= nread;
-		if (stream_write(to, buf, nread) == -1) {
-			stream_close(to);
-			goto bad;
-		}
-	} while (remains > 0);
+	stream_filter_start(to, STREAM_FILTER_MD5, fup->md5);
+	nbytes = stream_splice(to, up->rd, fsize);
+	if (nbytes == -1) {
+		stream_close(to);
+		goto bad;
+	}
+	if (nbytes < fsize) {
+		stream_close(to);
+		return (UPDATER_ERR_PROTO);
+	}
 	stream_close(to);
 	line = stream_getln(up->rd, NULL);
 	if (line == NULL)
@@ -1401,18 +1973,27 @@ updater_addfile(struct updater *up, struct file_update *fup)
 		return (UPDATER_ERR_PROTO);
 
 	cmd = proto_get_char(&line);
-	fup->wantmd5 = proto_get_ascii(&line);
-	fup->free_wantmd5 = 0;
-	if (fup->wantmd5 == NULL || line != NULL || cmd != '5')
+	wantmd5 = proto_get_ascii(&line);
+	if (wantmd5 == NULL || line != NULL || cmd != '5')
 		return (UPDATER_ERR_PROTO);
+	fup->wantmd5 = xstrdup(wantmd5);
 
-	sr->sr_clientattr = fattr_frompath(fup->temppath, FATTR_NOFOLLOW);
+	if (fup->tempfd != -1) {
+		/* Its link count is 0 for now, use the real one. */
+		sr->sr_clientattr = fattr_fromfd(fup->tempfd);
+		if (sr->sr_clientattr != NULL)
+			fattr_maskout(sr->sr_clientattr, FA_LINKCOUNT);
+	} else {
+		sr->sr_clientattr = updater_getattr(up, fup->temppath,
+		    FATTR_NOFOLLOW);
+	}
 	if (sr->sr_clientattr == NULL)
 		return (UPDATER_ERR_PROTO);
 	fattr_override(sr->sr_clientattr, sr->sr_serverattr,
 	    FA_MODTIME | FA_MASK);
-	error = updater_updatefile(up, fup, md5);
-	return (error);
+	fup->iscontent = 1;
+	fup->work = updater_updatefile;
+	return (0);
 bad:
 	xasprintf(&up->errmsg, "%s: Cannot write: %s", fup->temppath,
 	    strerror(errno));
@@ -1422,13 +2003,12 @@ bad:
 static int
 updater_checkout(struct updater *up, struct file_update *fup)
 {
-	char md5[MD5_DIGEST_SIZE];
 	struct statusrec *sr;
 	struct coll *coll;
 	struct stream *to;
 	ssize_t nbytes;
 	size_t size;
-	char *path, *line;
+	char *path, *line, *wantmd5;
 	int cmd, error, first;
 
 	coll = fup->coll;
@@ -1439,7 +2019,7 @@ updater_checkout(struct updater *up, struct file_update *fup)
 		lprintf(1, " Fixup %s\n", fup->coname);
 	else
 		lprintf(1, " Checkout %s\n", fup->coname);
-	error = mkdirhier(path, coll->co_umask);
+	error = updater_mkdirhier(up, path, coll->co_umask);
 	if (error) {
 		xasprintf(&up->errmsg,
 		    "Cannot create directories leading to \"%s\": %s",
@@ -1447,14 +2027,13 @@ updater_checkout(struct updater *up, struct file_update *fup)
 		return (UPDATER_ERR_MSG);
 	}
 
-	to = stream_open_file(fup->temppath,
-	    O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	to = updater_opentemp(up, fup, O_WRONLY, 0600);
 	if (to == NULL) {
 		xasprintf(&up->errmsg, "%s: Cannot create: %s",
 		    fup->temppath, strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
-	stream_filter_start(to, STREAM_FILTER_MD5, md5);
+	stream_filter_start(to, STREAM_FILTER_MD5, fup->md5);
 	line = stream_getln(up->rd, &size);
 	first = 1;
 	while (line != NULL) {
@@ -1493,13 +2072,12 @@ updater_checkout(struct updater *up, struct file_update *fup)
 	if (line == NULL)
 		return (UPDATER_ERR_READ);
 	cmd = proto_get_char(&line);
-	fup->wantmd5 = proto_get_ascii(&line);
-	fup->free_wantmd5 = 0;
-	if (fup->wantmd5 == NULL || line != NULL || cmd != '5')
+	wantmd5 = proto_get_ascii(&line);
+	if (wantmd5 == NULL || line != NULL || cmd != '5')
 		return (UPDATER_ERR_PROTO);
-	error = updater_updatefile(up, fup, md5);
-	if (error)
-		return (error);
+	fup->wantmd5 = xstrdup(wantmd5);
+	fup->iscontent = 1;
+	fup->work = updater_updatefile;
 	return (0);
 bad:
 	xasprintf(&up->errmsg, "%s: Cannot write: %s", fup->temppath,
@@ -1507,9 +2085,94 @@ bad:
 	return (UPDATER_ERR_MSG);
 }
 
+/*
+ * Return a descriptor for the directory of "path" and the name of the
+ * file in it, like dircache_lookup().  The workers run in parallel on
+ * unrelated files and have no cache, so they get AT_FDCWD and "path".
+ */
+static int
+updater_lookup(struct updater *up, const char *path, const char **name)
+{
+
+	if (up->dircache == NULL) {
+		*name = path;
+		return (AT_FDCWD);
+	}
+	return (dircache_lookup(up->dircache, path, name));
+}
+
+/*
+ * Called after an operation relative to a directory from updater_lookup()
+ * failed.  Returns true if it should be tried again because the directory
+ * had been removed since it was opened, by the workers or when we pruned
+ * directories ourselves.
+ */
+static int
+updater_stale(struct updater *up)
+{
+
+	return (errno == ENOENT && up->dircache != NULL &&
+	    dircache_stale(up->dircache));
+}
+
+/* Like fattr_frompath(), but through the directory cache. */
+static struct fattr *
+updater_getattr(struct updater *up, const char *path, int nofollow)
+{
+	struct fattr *fa;
+	const char *name;
+	int dirfd;
+
+	dirfd = updater_lookup(up, path, &name);
+	fa = fattr_frompathat(dirfd, name, nofollow);
+	if (fa == NULL && updater_stale(up)) {
+		dirfd = updater_lookup(up, path, &name);
+		fa = fattr_frompathat(dirfd, name, nofollow);
+	}
+	return (fa);
+}
+
+/*
+ * Like mkdirhier(), but remember the directory of "path" once it is known
+ * to exist.  The files come sorted, so most of them are in that directory
+ * or one of its parents, which then need no system call at all.
+ */
+static int
+updater_mkdirhier(struct updater *up, char *path, mode_t mask)
+{
+	size_t len;
+	int error;
+
+	len = pathlast(path) - path;
+	if (up->knowndir != NULL && len <= strlen(up->knowndir) &&
+	    strncmp(up->knowndir, path, len) == 0)
+		return (0);
+	error = mkdirhier(path, mask);
+	if (error)
+		return (error);
+	updater_forgetdirs(up);
+	up->knowndir = xmalloc(len + 1);
+	memcpy(up->knowndir, path, len);
+	up->knowndir[len] = '\0';
+	return (0);
+}
+
+/* Called when directories may have been removed. */
+static void
+updater_forgetdirs(struct updater *up)
+{
+
+	if (up->knowndir != NULL) {
+		free(up->knowndir);
+		up->knowndir = NULL;
+	}
+}
+
 /*
  * Remove all empty directories below file.
- * This function will trash the path passed to it.
+ * This function will trash the path passed to it: it is left pointing
+ * to the last directory removed, or to the file itself if there was
+ * none, so that its parent is the directory that was modified last.
  */
 static void
 updater_prunedirs(char *base, char *file)
@@ -1520,11 +2183,13 @@ updater_prunedirs(char *base, char *file)
 	while ((cp = strrchr(file, '/')) != NULL) {
 		*cp = '\0';
 		if (strcmp(base, file) == 0)
-			return;
+			break;
 		error = rmdir(file);
 		if (error)
-			return;
+			break;
 	}
+	if (cp != NULL)
+		*cp = '/';
 }
 
 /* Open the RCS file for edition if it hasn't been already. */
@@ -1557,23 +2222,20 @@ updater_rcsedit(struct updater *up, struct file_update *fup, char *name,
 	struct coll *coll;
 	struct stream *dest;
 	struct statusrec *sr;
-	struct status *st;
 	struct rcsfile *rf;
 	struct fattr *oldfattr;
-	char md5[MD5_DIGEST_SIZE];
 	char *branch, *expandtxt, *line, *path, *revnum, *tag, *temppath;
 	char *diffbase, *revdate, *author;
 	int cmd, error, expand;
 
 	coll = fup->coll;
 	sr = &fup->srbuf;
-	st = fup->st;
 	temppath = fup->temppath;
 	path = fup->origpath != NULL ? fup->origpath : fup->destpath;
 
 	/* If the path is new, we must create the Attic dir if needed. */
 	if (fup->origpath != NULL) {
-		error = mkdirhier(fup->destpath, coll->co_umask);
+		error = updater_mkdirhier(up, fup->destpath, coll->co_umask);
 		if (error) {
 			xasprintf(&up->errmsg, "Unable to create Attic dir for "
 			    "%s", fup->origpath);
@@ -1584,7 +2246,7 @@ updater_rcsedit(struct updater *up, struct file_update *fup, char *name,
 	 * XXX: we could avoid parsing overhead if we're reading ahead before we
 	 * parse the file.
 	 */
-	oldfattr = fattr_frompath(path, FATTR_NOFOLLOW);
+	oldfattr = updater_getattr(up, path, FATTR_NOFOLLOW);
 	if (oldfattr == NULL) {
 		xasprintf(&up->errmsg, "%s: Cannot get attributes: %s", path,
 		    strerror(errno));
@@ -1695,7 +2357,7 @@ updater_rcsedit(struct updater *up, struct file_update *fup, char *name,
 				return (UPDATER_ERR_MSG);
 			}
 
-			updater_needfixup(up, fup, "Invalid RCS file");
+			updater_needfixup(fup, "Invalid RCS file");
 			/* We requested a fixup but we must still read the
 			   remaining update commands for this RCS file to stay
 			   in sync. */
@@ -1731,14 +2393,13 @@ updater_rcsedit(struct updater *up, struct file_update *fup, char *name,
 
 	fattr_free(oldfattr);
 	/* Write and rename temp file. */
-	dest = stream_open_file(fup->temppath,
-	    O_RDWR | O_CREAT | O_TRUNC, 0600);
+	dest = updater_opentemp(up, fup, O_RDWR, 0600);
 	if (dest == NULL) {
 		xasprintf(&up->errmsg, "Error opening file %s for writing: %s",
 		    fup->temppath, strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
-	stream_filter_start(dest, STREAM_FILTER_MD5RCS, md5);
+	stream_filter_start(dest, STREAM_FILTER_MD5RCS, fup->md5);
 	error = rcsfile_write(rf, dest);
 	stream_close(dest);
 	rcsfile_free(rf);
@@ -1749,7 +2410,7 @@ updater_rcsedit(struct updater *up, struct file_update *fup, char *name,
 	}
 
 finish:
-	sr->sr_clientattr = fattr_frompath(path, FATTR_NOFOLLOW);
+	sr->sr_clientattr = updater_getattr(up, path, FATTR_NOFOLLOW);
 	if (sr->sr_clientattr == NULL) {
 		xasprintf(&up->errmsg, "%s: Cannot get attributes: %s",
 		    fup->destpath, strerror(errno));
@@ -1758,28 +2419,36 @@ finish:
 	fattr_override(sr->sr_clientattr, sr->sr_serverattr,
 	    FA_MODTIME | FA_MASK);
 	if (rf != NULL) {
-		error = updater_updatefile(up, fup, md5);
-		if (error)
-			return (error);
-	} else {
-		/* Record its attributes since we touched it. */
-		if (!(fattr_getmask(sr->sr_clientattr) & FA_LINKCOUNT) ||
-		    fattr_getlinkcount(sr->sr_clientattr) <= 1)
-		fattr_maskout(sr->sr_clientattr, FA_DEV | FA_INODE);
-		error = status_put(st, sr);
-		if (error) {
-			up->errmsg = status_errmsg(st);
-			return (UPDATER_ERR_MSG);
-		}
+		fup->iscontent = 0;
+		fup->work = updater_rcsedit_install;
+		return (0);
 	}
+	/* Record its attributes since we touched it. */
+	if (!(fattr_getmask(sr->sr_clientattr) & FA_LINKCOUNT) ||
+	    fattr_getlinkcount(sr->sr_clientattr) <= 1)
+	fattr_maskout(sr->sr_clientattr, FA_DEV | FA_INODE);
+	fup->status = FUP_STATUS_PUT;
+	if (fup->origpath != NULL && updater_deletefile(fup->origpath) == 0)
+		fup->moved = 1;
+	return (0);
+}
+
+/* Install an edited RCS file, from the worker pool. */
+static int
+updater_rcsedit_install(struct updater *up, struct file_update *fup)
+{
+	int error;
 
+	error = updater_updatefile(up, fup);
+	if (error)
+		return (error);
 	/* In this case, we need to remove the old file afterwards. */
 	/* XXX: Can we be sure that a file not edited is moved? I don't think
 	 * this is a problem, since if a file is moved, it should be edited to
 	 * show if it's dead or not.
 	 */
-	if (fup->origpath != NULL)
-		updater_deletefile(fup->origpath);
+	if (fup->origpath != NULL && updater_deletefile(fup->origpath) == 0)
+		fup->moved = 1;
 	return (0);
 }
 
@@ -1875,54 +2544,46 @@ int
 updater_append_file(struct updater *up, struct file_update *fup, off_t pos)
 {
 	struct fattr *fa;
-	struct stream *to;
+	struct stream *from, *to;
 	struct statusrec *sr;
-	ssize_t nread;
-	off_t bytes;
-	char buf[BUFSIZE], md5[MD5_DIGEST_SIZE];
-	char *line;
-	int cmd, error, fd;
+	off_t bytes, nbytes;
+	char *line, *wantmd5;
+	int cmd;
 
 	sr = &fup->srbuf;
 	fa = sr->sr_serverattr;
-	to = stream_open_file(fup->temppath, O_WRONLY | O_CREAT | O_TRUNC,
-	    0755);
+	to = updater_opentemp(up, fup, O_WRONLY, 0755);
 	if (to == NULL) {
 		xasprintf(&up->errmsg, "%s: Cannot open: %s", fup->temppath,
 		    strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
-	fd = open(fup->destpath, O_RDONLY);
-	if (fd < 0) {
+	from = stream_open_file(fup->destpath, O_RDONLY);
+	if (from == NULL) {
 		xasprintf(&up->errmsg, "%s: Cannot open: %s", fup->destpath,
 		    strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
 
-	stream_filter_start(to, STREAM_FILTER_MD5, md5);
+	stream_filter_start(to, STREAM_FILTER_MD5, fup->md5);
 	/* First write the existing content. */
-	while ((nread = read(fd, buf, BUFSIZE)) > 0) {
-		if (stream_write(to, buf, nread) == -1)
-			goto bad;
-	}
-	if (nread == -1) {
+	nbytes = stream_splice(to, from, -1);
+	if (nbytes == -1)
+		goto bad;
+	if (!stream_eof(from)) {
 		xasprintf(&up->errmsg, "%s: Error reading: %s", fup->destpath,
 		    strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
-	close(fd);
+	stream_close(from);
 
 	bytes = fattr_filesize(fa) - pos;
 	/* Append the new data. */
-	do {
-		nread = stream_read(up->rd, buf,
-		    (BUFSIZE > bytes) ? bytes : BUFSIZE);
-		if (nread == -1)
-			return (UPDATER_ERR_PROTO);
-		bytes -= nread;
-		if (stream_write(to, buf, nread) == -1)
-			goto bad;
-	} while (bytes > 0);
+	nbytes = stream_splice(to, up->rd, bytes);
+	if (nbytes == -1)
+		goto bad;
+	if (nbytes < bytes)
+		return (UPDATER_ERR_PROTO);
 	stream_close(to);
 
 	line = stream_getln(up->rd, NULL);
@@ -1936,18 +2597,19 @@ updater_append_file(struct updater *up, struct file_update *fup, off_t pos)
 		return (UPDATER_ERR_PROTO);
 
 	cmd = proto_get_char(&line);
-	fup->wantmd5 = proto_get_ascii(&line);
-	fup->free_wantmd5 = 0;
-	if (fup->wantmd5 == NULL || line != NULL || cmd != '5')
+	wantmd5 = proto_get_ascii(&line);
+	if (wantmd5 == NULL || line != NULL || cmd != '5')
 		return (UPDATER_ERR_PROTO);
+	fup->wantmd5 = xstrdup(wantmd5);
 
-	sr->sr_clientattr = fattr_frompath(fup->destpath, FATTR_NOFOLLOW);
+	sr->sr_clientattr = updater_getattr(up, fup->destpath, FATTR_NOFOLLOW);
 	if (sr->sr_clientattr == NULL)
 		return (UPDATER_ERR_PROTO);
 	fattr_override(sr->sr_clientattr, sr->sr_serverattr,
 	    FA_MODTIME | FA_MASK);
-	error = updater_updatefile(up, fup, md5);
-	return (error);
+	fup->iscontent = 1;
+	fup->work = updater_updatefile;
+	return (0);
 bad:
 	xasprintf(&up->errmsg, "%s: Cannot write: %s", fup->temppath,
 	    strerror(errno));
@@ -1999,72 +2661,100 @@ updater_read_checkout(struct stream *src, struct stream *dest)
 	return (0);
 }
 
-/* Update file using the rsync protocol. */
+/*
+ * Rebuild a file from the blocks of the old version and the literal data
+ * sent by the server.  The blocks are copied with stream_splice(), which
+ * lets the kernel do it with copy_file_range(2), or share the extents if
+ * the file system supports it, so that unchanged data doesn't go through
+ * userland.  For that, the MD5 checksum of the new file is computed by
+ * the hasher reading it back in parallel, rather than by a filter on the
+ * output stream, which would force every byte through our buffers.
+ */
 static int
 updater_rsync(struct updater *up, struct file_update *fup, size_t blocksize)
 {
 	struct statusrec *sr;
-	struct stream *to;
-	char md5[MD5_DIGEST_SIZE];
-	ssize_t nbytes;
-	size_t blocknum, blockstart, blockcount;
-	char *buf, *line;
-	int error, orig;
+	struct stream *orig, *to;
+	struct hashjob *job;
+	off_t blockcount, blockstart, nbytes, want;
+	char *line, *path;
+	int error;
 
 	sr = &fup->srbuf;
 
+	if (coll_inplace(fup->coll, sr->sr_file))
+		return (updater_rsync_inplace(up, fup, blocksize));
+
 	lprintf(1, " Rsync %s\n", fup->coname);
 	/* First open all files that we are going to work on. */
-	to = stream_open_file(fup->temppath, O_WRONLY | O_CREAT | O_TRUNC,
-	    0600);
+	to = updater_opentemp(up, fup, O_WRONLY, 0600);
 	if (to == NULL) {
 		xasprintf(&up->errmsg, "%s: Cannot create: %s",
 		    fup->temppath, strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
-	orig = open(fup->destpath, O_RDONLY);
-	if (orig < 0) {
+	orig = stream_open_file(fup->destpath, O_RDONLY);
+	if (orig == NULL) {
 		xasprintf(&up->errmsg, "%s: Cannot open: %s",
 		    fup->destpath, strerror(errno));
 		return (UPDATER_ERR_MSG);
 	}
-	stream_filter_start(to, STREAM_FILTER_MD5, md5);
+	job = NULL;
+	if (up->hasher != NULL && fup->tempfd != -1) {
+		path = fdpath(fup->tempfd);
+		job = hasher_follow(up->hasher, path);
+		free(path);
+	} else if (up->hasher != NULL)
+		job = hasher_follow(up->hasher, fup->temppath);
+	else
+		stream_filter_start(to, STREAM_FILTER_MD5, fup->md5);
 
 	error = updater_read_checkout(up->rd, to);
 	if (error) {
 		xasprintf(&up->errmsg, "%s: Cannot write: %s", fup->temppath,
 		    strerror(errno));
-		return (error);
+		goto bad;
 	}
 
-	/* Buffer must contain blocksize bytes. */
-	buf = xmalloc(blocksize);
 	/* Done with the initial text, read and write chunks. */
 	line = stream_getln(up->rd, NULL);
 	while (line != NULL) {
 		if (strcmp(line, ".") == 0)
 			break;
 		error = UPDATER_ERR_PROTO;
-		if (proto_get_sizet(&line, &blockstart, 10) != 0)
+		if (proto_get_off(&line, &blockstart) != 0 || blockstart < 0)
+			goto bad;
+		if (proto_get_off(&line, &blockcount) != 0 || blockcount < 0)
 			goto bad;
-		if (proto_get_sizet(&line, &blockcount, 10) != 0)
+		if (blockstart > OFF_MAX / (off_t)blocksize ||
+		    blockcount > OFF_MAX / (off_t)blocksize)
 			goto bad;
-		/* Read blocks from original file. */
-		lseek(orig, (blocksize * blockstart), SEEK_SET);
+		/*
+		 * Copy the blocks from the original file.  The last one
+		 * may be short, so hitting EOF is fine.  The literal data
+		 * has to be flushed first for the copy to bypass our
+		 * buffers.
+		 */
 		error = UPDATER_ERR_MSG;
-		for (blocknum = 0; blocknum < blockcount; blocknum++) {
-			nbytes = read(orig, buf, blocksize);
-			if (nbytes < 0) {
-				xasprintf(&up->errmsg, "%s: Cannot read: %s",
-				    fup->destpath, strerror(errno));
-				goto bad;
-			}
-			nbytes = stream_write(to, buf, nbytes);
-			if (nbytes == -1) {
-				xasprintf(&up->errmsg, "%s: Cannot write: %s",
-				    fup->temppath, strerror(errno));
-				goto bad;
-			}
+		if (job != NULL && updater_rsync_sync(to, job) == -1) {
+			xasprintf(&up->errmsg, "%s: Cannot write: %s",
+			    fup->temppath, strerror(errno));
+			goto bad;
+		}
+		want = blockcount * (off_t)blocksize;
+		if (stream_seek(orig, blockstart * (off_t)blocksize) == -1)
+			nbytes = 0;
+		else
+			nbytes = stream_splice(to, orig, want);
+		if (nbytes == -1) {
+			xasprintf(&up->errmsg, "%s: Cannot write: %s",
+			    fup->temppath, strerror(errno));
+			goto bad;
+		}
+		if (nbytes < want && !stream_eof(orig)) {
+			xasprintf(&up->errmsg, "%s: Cannot read: %s",
+			    fup->destpath, strerror(errno));
+			goto bad;
 		}
 		/* Get the remaining text from the server. */
 		error = updater_read_checkout(up->rd, to);
@@ -2075,17 +2765,141 @@ updater_rsync(struct updater *up, struct file_update *fup, size_t blocksize)
 		}
 		line = stream_getln(up->rd, NULL);
 	}
+	if (job != NULL) {
+		if (updater_rsync_sync(to, job) == -1) {
+			xasprintf(&up->errmsg, "%s: Cannot write: %s",
+			    fup->temppath, strerror(errno));
+			error = UPDATER_ERR_MSG;
+			goto bad;
+		}
+		/* The worker waits for the checksum. */
+		hashjob_extend(job, lseek(stream_fileno(to), 0, SEEK_CUR), 1);
+		fup->hashjob = job;
+	}
 	stream_close(to);
-	close(orig);
+	stream_close(orig);
 
-	sr->sr_clientattr = fattr_frompath(fup->destpath, FATTR_NOFOLLOW);
+	sr->sr_clientattr = updater_getattr(up, fup->destpath, FATTR_NOFOLLOW);
 	if (sr->sr_clientattr == NULL)
 		return (UPDATER_ERR_PROTO);
 	fattr_override(sr->sr_clientattr, sr->sr_serverattr,
 	    FA_MODTIME | FA_MASK);
 
-	error = updater_updatefile(up, fup, md5);
+	fup->iscontent = 1;
+	fup->work = updater_updatefile;
+	return (0);
+bad:
+	if (job != NULL) {
+		hashjob_extend(job, lseek(stream_fileno(to), 0, SEEK_CUR), 1);
+		(void)hashjob_wait(job, fup->md5, NULL, NULL);
+	}
+	stream_close(to);
+	stream_close(orig);
+	return (error);
+}
+
+/*
+ * Same as updater_rsync(), but for the files that are configured to be
+ * updated in place: only the parts that have changed are written to the
+ * file, see rsync_patch_new().  Since the old version is gone once this
+ * is done, we have to read the file again to check the result.
+ */
+static int
+updater_rsync_inplace(struct updater *up, struct file_update *fup,
+    size_t blocksize)
+{
+	struct statusrec *sr;
+	struct rsyncpatch *patch;
+	off_t blockcount, blockstart;
+	char *line;
+	int error;
+
+	sr = &fup->srbuf;
+
+	lprintf(1, " Rsync %s (in place)\n", fup->coname);
+	patch = rsync_patch_new(fup->destpath);
+	if (patch == NULL) {
+		xasprintf(&up->errmsg, "%s: Cannot open: %s",
+		    fup->destpath, strerror(errno));
+		return (UPDATER_ERR_MSG);
+	}
+	error = updater_read_checkout(up->rd, rsync_patch_data(patch));
+	if (error)
+		goto bad;
+	line = stream_getln(up->rd, NULL);
+	while (line != NULL) {
+		if (strcmp(line, ".") == 0)
+			break;
+		error = UPDATER_ERR_PROTO;
+		if (proto_get_off(&line, &blockstart) != 0 || blockstart < 0)
+			goto bad;
+		if (proto_get_off(&line, &blockcount) != 0 || blockcount < 0)
+			goto bad;
+		if (blockstart > OFF_MAX / (off_t)blocksize ||
+		    blockcount > OFF_MAX / (off_t)blocksize)
+			goto bad;
+		error = UPDATER_ERR_MSG;
+		if (rsync_patch_copy(patch, blockstart * (off_t)blocksize,
+		    blockcount * (off_t)blocksize) == -1)
+			goto bad;
+		error = updater_read_checkout(up->rd, rsync_patch_data(patch));
+		if (error)
+			goto bad;
+		line = stream_getln(up->rd, NULL);
+	}
+	if (line == NULL) {
+		error = UPDATER_ERR_READ;
+		goto bad;
+	}
+	if (rsync_patch_apply(patch) == -1) {
+		xasprintf(&up->errmsg, "%s: Cannot update in place: %s",
+		    fup->destpath, strerror(errno));
+		rsync_patch_free(patch);
+		return (UPDATER_ERR_MSG);
+	}
+	rsync_patch_free(patch);
+
+	/* There is no temporary file to install. */
+	free(fup->temppath);
+	fup->temppath = NULL;
+	if (up->hasher != NULL) {
+		fup->hashjob = hasher_submit(up->hasher, fup->destpath, 0, -1);
+	} else if (MD5_File(fup->destpath, fup->md5, NULL) == -1) {
+		xasprintf(&up->errmsg, "%s: Cannot read: %s", fup->destpath,
+		    strerror(errno));
+		return (UPDATER_ERR_MSG);
+	}
+	sr->sr_clientattr = updater_getattr(up, fup->destpath, FATTR_NOFOLLOW);
+	if (sr->sr_clientattr == NULL)
+		return (UPDATER_ERR_PROTO);
+	fattr_override(sr->sr_clientattr, sr->sr_serverattr,
+	    FA_MODTIME | FA_MASK);
+
+	fup->iscontent = 1;
+	fup->work = updater_updatefile;
+	return (0);
 bad:
-	free(buf);
+	if (error == UPDATER_ERR_MSG && up->errmsg == NULL)
+		xasprintf(&up->errmsg, "%s: Cannot write: %s",
+		    fup->destpath, strerror(errno));
+	rsync_patch_free(patch);
 	return (error);
 }
+
+/*
+ * Write out what we have buffered for the new file, and let the hasher
+ * know that it can read up to there.
+ */
+static int
+updater_rsync_sync(struct stream *to, struct hashjob *job)
+{
+	off_t off;
+
+	if (stream_flush(to) != 0)
+		return (-1);
+	off = lseek(stream_fileno(to), 0, SEEK_CUR);
+	if (off == -1)
+		return (-1);
+	hashjob_extend(job, off, 0);
+	return (0);
+}